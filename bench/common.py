@@ -0,0 +1,143 @@
+"""Shared plumbing of the benchmark scenarios.
+
+Each scenario module has a ``run(args)`` returning a list of result dicts and
+a ``main()`` to run it on its own. ``run.py`` runs all of them.
+
+The package is imported as installed, or straight from the source tree with
+the ``_uring_io`` extension found on ``PYTHONPATH`` as the ``bench`` CMake
+target sets it up.
+"""
+
+import argparse
+import asyncio
+import importlib.util
+import json
+import os
+import platform
+import resource
+import sys
+import time
+
+_SRC = os.path.join(os.path.dirname(os.path.dirname(__file__)), "src")
+
+
+def _import_package():
+    try:
+        import asyncio_uring
+    except ImportError:
+        spec = importlib.util.spec_from_file_location(
+            "asyncio_uring",
+            os.path.join(_SRC, "__init__.py"),
+            submodule_search_locations=[_SRC],
+        )
+        asyncio_uring = importlib.util.module_from_spec(spec)
+        sys.modules["asyncio_uring"] = asyncio_uring
+        spec.loader.exec_module(asyncio_uring)
+    return asyncio_uring
+
+
+def loop_factories():
+    """Event loops to compare by name, uvloop only when it is installed"""
+    factories = {
+        "uring": _import_package().UringIOEventLoop,
+        "selector": asyncio.SelectorEventLoop,
+    }
+    try:
+        import uvloop
+    except ImportError:
+        pass
+    else:
+        factories["uvloop"] = uvloop.new_event_loop
+    return factories
+
+
+def selected_loops(args):
+    factories = loop_factories()
+    if not args.loops:
+        return factories
+    missing = set(args.loops) - set(factories)
+    if missing:
+        raise SystemExit(f"unavailable loops: {', '.join(sorted(missing))}")
+    return {name: factories[name] for name in args.loops}
+
+
+def run_on(factory, main, *args):
+    """Run coroutine function main on a new loop of factory"""
+    loop = factory()
+    try:
+        return loop.run_until_complete(main(loop, *args))
+    finally:
+        loop.run_until_complete(loop.shutdown_asyncgens())
+        loop.close()
+
+
+def raise_nofile(wanted):
+    """Raise the soft open files limit towards wanted, return the new limit"""
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if soft < wanted:
+        soft = wanted if hard == resource.RLIM_INFINITY else min(wanted, hard)
+        resource.setrlimit(resource.RLIMIT_NOFILE, (soft, hard))
+    return soft
+
+
+def percentiles(samples, points=(50, 99)):
+    """Percentiles of a list of latencies in seconds, as microseconds"""
+    if not samples:
+        return {f"p{p}_us": None for p in points}
+    samples = sorted(samples)
+    last = len(samples) - 1
+    return {
+        f"p{p}_us": samples[min(last, len(samples) * p // 100)] * 1e6 for p in points
+    }
+
+
+class Deadline:
+    """Wall clock end of a timed run"""
+
+    def __init__(self, duration):
+        self.start = time.perf_counter()
+        self.end = self.start + duration
+
+    def __bool__(self):
+        return time.perf_counter() < self.end
+
+    def elapsed(self):
+        return time.perf_counter() - self.start
+
+
+def parser(doc):
+    """Argument parser with the options every scenario takes"""
+    parser = argparse.ArgumentParser(
+        description=doc, formatter_class=argparse.RawDescriptionHelpFormatter
+    )
+    parser.add_argument(
+        "--loops",
+        nargs="*",
+        help="event loops to compare, all available ones by default",
+    )
+    parser.add_argument(
+        "--duration", type=float, default=2.0, help="seconds per measurement"
+    )
+    parser.add_argument("--output", help="write the JSON results to this file")
+    return parser
+
+
+def metadata():
+    return {
+        "python": platform.python_version(),
+        "kernel": platform.release(),
+        "machine": platform.machine(),
+        "cpus": os.cpu_count(),
+        "loops": sorted(loop_factories()),
+        "time": time.strftime("%Y-%m-%dT%H:%M:%S%z"),
+    }
+
+
+def emit(results, output=None):
+    """Print the results as JSON, or write them to output"""
+    document = json.dumps({"meta": metadata(), "results": results}, indent=2)
+    if output:
+        with open(output, "w") as f:
+            f.write(document + "\n")
+    else:
+        print(document)
@@ -0,0 +1,147 @@
+"""TCP echo over loopback with a varying number of connections.
+
+An echo server runs in a child process and the clients in this one, both on
+the loop under test. Every connection sends a message, waits for it to come
+back whole and sends the next one until the duration is over. The result
+is the round trips per second over all connections.
+"""
+
+import asyncio
+import multiprocessing
+import time
+
+import common
+
+CONNECTIONS = (1, 10, 100, 1000, 10000)
+
+
+class _Echo(asyncio.Protocol):
+    def connection_made(self, transport):
+        self.transport = transport
+
+    def data_received(self, data):
+        self.transport.write(data)
+
+
+async def _server(loop, conn):
+    server = await loop.create_server(_Echo, "127.0.0.1", 0, backlog=4096)
+    conn.send(server.sockets[0].getsockname()[1])
+    # Serve until the parent says stop
+    await loop.run_in_executor(None, conn.recv)
+    server.close()
+    await server.wait_closed()
+
+
+def serve(name, conn, nofile):
+    common.raise_nofile(nofile)
+    common.run_on(common.loop_factories()[name], _server, conn)
+
+
+class _Client(asyncio.Protocol):
+    def __init__(self, message, latencies):
+        self.message = message
+        self.latencies = latencies
+        self.done = asyncio.get_running_loop().create_future()
+
+    def connection_made(self, transport):
+        self.transport = transport
+
+    def start(self, deadline):
+        self.deadline = deadline
+        self._send()
+
+    def _send(self):
+        self.received = 0
+        self.sent_at = time.perf_counter()
+        self.transport.write(self.message)
+
+    def data_received(self, data):
+        self.received += len(data)
+        if self.received < len(self.message):
+            return
+        self.latencies.append(time.perf_counter() - self.sent_at)
+        if self.deadline:
+            self._send()
+        else:
+            self.transport.close()
+
+    def connection_lost(self, exc):
+        if not self.done.done():
+            self.done.set_result(None)
+
+
+async def _clients(loop, port, connections, size, duration):
+    message = b"x" * size
+    latencies = []
+    limit = asyncio.Semaphore(256)
+
+    async def connect():
+        async with limit:
+            _, client = await loop.create_connection(
+                lambda: _Client(message, latencies), "127.0.0.1", port
+            )
+            return client
+
+    # The measurement starts once everyone is connected
+    clients = await asyncio.gather(*(connect() for _ in range(connections)))
+    deadline = common.Deadline(duration)
+    for client in clients:
+        client.start(deadline)
+    await asyncio.gather(*(client.done for client in clients))
+    return len(latencies), deadline.elapsed(), latencies
+
+
+def measure(name, factory, connections, size, duration):
+    result = {
+        "scenario": "echo",
+        "loop": name,
+        "connections": connections,
+        "message_size": size,
+    }
+    nofile = connections + 256
+    if common.raise_nofile(nofile) < nofile:
+        return {**result, "skipped": "open files limit too low"}
+
+    context = multiprocessing.get_context("spawn")
+    conn, child_conn = context.Pipe()
+    server = context.Process(target=serve, args=(name, child_conn, nofile))
+    server.start()
+    try:
+        port = conn.recv()
+        count, elapsed, latencies = common.run_on(
+            factory, _clients, port, connections, size, duration
+        )
+    finally:
+        conn.send(None)
+        server.join()
+    return {
+        **result,
+        "requests_per_sec": count / elapsed,
+        **common.percentiles(latencies),
+    }
+
+
+def run(args):
+    return [
+        measure(name, factory, connections, args.message_size, args.duration)
+        for name, factory in common.selected_loops(args).items()
+        for connections in args.connections
+    ]
+
+
+def add_arguments(parser):
+    parser.add_argument(
+        "--connections", type=int, nargs="*", default=list(CONNECTIONS)
+    )
+    parser.add_argument("--message-size", type=int, default=64)
+
+
+def main():
+    parser = common.parser(__doc__)
+    add_arguments(parser)
+    args = parser.parse_args()
+    common.emit(run(args), args.output)
+
+
+if __name__ == "__main__":
+    main()
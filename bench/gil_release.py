@@ -0,0 +1,98 @@
+"""Throughput of Python threads while another thread blocks on the ring.
+
+A poll on an idle pipe is submitted and one thread keeps waiting on it with
+``wait_for_cqe_timeout``. Meanwhile a number of worker threads spin on pure
+Python work. The score is how much of the workers' throughput survives next
+to the blocked waiter, compared to a run without it.
+"""
+
+import os
+import select
+import threading
+import time
+
+from _uring_io import Ring, opcodes
+
+import common
+
+
+def _spin(stop, counts, index):
+    n = 0
+    while not stop.is_set():
+        for _ in range(1000):
+            n += 1
+    counts[index] = n
+
+
+def _waiter(ring, stop, waits):
+    while not stop.is_set():
+        ring.wait_for_cqe_timeout(0, 10_000_000)
+        waits[0] += 1
+
+
+def measure(workers, duration, with_waiter):
+    stop = threading.Event()
+    counts = [0] * workers
+    waits = [0]
+    threads = [
+        threading.Thread(target=_spin, args=(stop, counts, i))
+        for i in range(workers)
+    ]
+
+    ring = Ring(8)
+    rfd, wfd = os.pipe()
+    if with_waiter:
+        sqe = ring.get_sqe()
+        sqe.opcode = opcodes.OP_POLL_ADD
+        sqe.fd = rfd
+        sqe.op_flags = select.POLLIN
+        ring.submit()
+        threads.append(threading.Thread(target=_waiter, args=(ring, stop, waits)))
+
+    start = time.perf_counter()
+    for t in threads:
+        t.start()
+    time.sleep(duration)
+    stop.set()
+    os.write(wfd, b"x")
+    for t in threads:
+        t.join()
+    elapsed = time.perf_counter() - start
+
+    os.close(rfd)
+    os.close(wfd)
+    return {
+        "ops_per_sec": sum(counts) / elapsed,
+        "ring_waits": waits[0],
+    }
+
+
+def run(args):
+    baseline = measure(args.workers, args.duration, with_waiter=False)
+    blocked = measure(args.workers, args.duration, with_waiter=True)
+    return [
+        {
+            "scenario": "gil_release",
+            "loop": "native",
+            "workers": args.workers,
+            "baseline_ops_per_sec": baseline["ops_per_sec"],
+            "blocked_ops_per_sec": blocked["ops_per_sec"],
+            "ring_waits": blocked["ring_waits"],
+            "ratio": blocked["ops_per_sec"] / baseline["ops_per_sec"],
+        }
+    ]
+
+
+def add_arguments(parser):
+    parser.add_argument("--workers", type=int, default=4)
+
+
+def main():
+    parser = common.parser(__doc__)
+    add_arguments(parser)
+    args = parser.parse_args()
+    common.emit(run(args), args.output)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,83 @@
+"""NOP round trips through the native binding at varying batch sizes.
+
+A batch of NOPs is queued, submitted and waited for, then its completions
+are consumed. This measures the cost per operation of the binding itself,
+so there is no event loop involved and nothing to compare against:
+
+- ``prep``: one prep_nop call per operation
+- ``tuples``: submit_batch with a list of (OP_NOP,) tuples
+- ``packed``: submit_batch with a buffer of packed SQEs
+"""
+
+from _uring_io import SQE_SIZE, Ring, opcodes
+
+import common
+
+BATCHES = (1, 8, 32, 128, 512)
+
+
+def _prep(ring, batch):
+    for _ in range(batch):
+        ring.prep_nop()
+
+
+def _tuples(ring, batch, ops={}):
+    if batch not in ops:
+        ops[batch] = [(opcodes.OP_NOP,)] * batch
+    ring.submit_batch(ops[batch])
+
+
+def _packed(ring, batch, ops={}):
+    # All zero is a NOP with no flags and user_data 0
+    if batch not in ops:
+        ops[batch] = bytes(SQE_SIZE * batch)
+    ring.submit_batch(ops[batch])
+
+
+MODES = {"prep": _prep, "tuples": _tuples, "packed": _packed}
+
+
+def measure(mode, batch, duration):
+    ring = Ring(max(batch, 8))
+    queue = MODES[mode]
+    ops = 0
+    deadline = common.Deadline(duration)
+    while deadline:
+        queue(ring, batch)
+        ring.submit_and_wait(batch)
+        ops += ring.dispatch_completions(0)
+    elapsed = deadline.elapsed()
+    return {
+        "scenario": "nop",
+        "loop": "native",
+        "mode": mode,
+        "batch": batch,
+        "ops_per_sec": ops / elapsed,
+        "ns_per_op": elapsed / ops * 1e9,
+    }
+
+
+def run(args):
+    return [
+        measure(mode, batch, args.duration)
+        for mode in args.modes
+        for batch in args.batches
+    ]
+
+
+def add_arguments(parser):
+    parser.add_argument("--batches", type=int, nargs="*", default=list(BATCHES))
+    parser.add_argument(
+        "--modes", nargs="*", choices=list(MODES), default=list(MODES)
+    )
+
+
+def main():
+    parser = common.parser(__doc__)
+    add_arguments(parser)
+    args = parser.parse_args()
+    common.emit(run(args), args.output)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,113 @@
+"""Random 4K reads from a file at varying queue depths.
+
+QD tasks each read blocks at random aligned offsets for the duration. The
+uring loop reads with file_read; the other loops have no asynchronous file
+I/O and run os.pread in a thread pool of QD threads, the usual way asyncio
+code reads files.
+
+The file is created in --dir, put it on tmpfs or ext4 as needed. It is read
+through the page cache, so after the first pass this measures the I/O path
+rather than the disk; make --size larger than memory to get the disk.
+"""
+
+import asyncio
+import concurrent.futures
+import os
+import random
+import tempfile
+import time
+
+import common
+
+DEPTHS = (1, 4, 16, 64, 256)
+
+
+def make_file(directory, size):
+    fd, path = tempfile.mkstemp(prefix="uring-bench-", dir=directory)
+    chunk = os.urandom(1 << 20)
+    with os.fdopen(fd, "wb") as f:
+        for _ in range(0, size, len(chunk)):
+            f.write(chunk)
+    return path
+
+
+async def _reads(loop, name, fd, blocks, block_size, depth, duration):
+    if name == "uring":
+        read = loop.file_read
+    else:
+        pool = concurrent.futures.ThreadPoolExecutor(depth)
+
+        def read(fd, size, offset):
+            return loop.run_in_executor(pool, os.pread, fd, size, offset)
+
+    latencies = []
+    deadline = common.Deadline(duration)
+
+    async def worker(rng):
+        while deadline:
+            offset = rng.randrange(blocks) * block_size
+            start = time.perf_counter()
+            data = await read(fd, block_size, offset)
+            latencies.append(time.perf_counter() - start)
+            assert len(data) == block_size
+
+    try:
+        await asyncio.gather(*(worker(random.Random(i)) for i in range(depth)))
+    finally:
+        if name != "uring":
+            pool.shutdown()
+    return len(latencies), deadline.elapsed(), latencies
+
+
+def run(args):
+    path = make_file(args.dir, args.size)
+    blocks = args.size // args.block_size
+    results = []
+    try:
+        fd = os.open(path, os.O_RDONLY)
+        try:
+            for name, factory in common.selected_loops(args).items():
+                for depth in args.depths:
+                    count, elapsed, latencies = common.run_on(
+                        factory,
+                        _reads,
+                        name,
+                        fd,
+                        blocks,
+                        args.block_size,
+                        depth,
+                        args.duration,
+                    )
+                    results.append(
+                        {
+                            "scenario": "random_read",
+                            "loop": name,
+                            "queue_depth": depth,
+                            "block_size": args.block_size,
+                            "iops": count / elapsed,
+                            **common.percentiles(latencies),
+                        }
+                    )
+        finally:
+            os.close(fd)
+    finally:
+        os.unlink(path)
+    return results
+
+
+def add_arguments(parser):
+    parser.add_argument("--depths", type=int, nargs="*", default=list(DEPTHS))
+    parser.add_argument("--dir", default=None, help="directory of the file")
+    parser.add_argument("--size", type=int, default=64 << 20, help="file size")
+    parser.add_argument("--block-size", type=int, default=4096)
+
+
+def main():
+    parser = common.parser(__doc__)
+    add_arguments(parser)
+    args = parser.parse_args()
+    common.emit(run(args), args.output)
+
+
+if __name__ == "__main__":
+    main()
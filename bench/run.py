@@ -0,0 +1,69 @@
+"""Run the benchmark scenarios and collect their results in one JSON file.
+
+Every scenario runs with its own defaults, only --loops and --duration are
+passed on; run a scenario module directly to tune its parameters. --quick
+cuts the parameter sets down to a smoke run, e.g. to catch regressions in
+CI.
+"""
+
+import sys
+
+import common
+import echo
+import gil_release
+import nop
+import random_read
+import setup_modes
+import small_files
+
+SCENARIOS = {
+    "nop": nop,
+    "random_read": random_read,
+    "echo": echo,
+    "small_files": small_files,
+    "gil_release": gil_release,
+    "setup_modes": setup_modes,
+}
+
+QUICK = {
+    "nop": ["--batches", "1", "32"],
+    "random_read": ["--depths", "1", "16", "--size", str(8 << 20)],
+    "echo": ["--connections", "1", "100"],
+    "small_files": ["--files", "100", "--connections", "16"],
+    "gil_release": [],
+    "setup_modes": [],
+}
+
+
+def main():
+    parser = common.parser(__doc__)
+    parser.add_argument(
+        "scenarios",
+        nargs="*",
+        help=f"scenarios to run out of {', '.join(SCENARIOS)}, all by default",
+    )
+    parser.add_argument(
+        "--quick", action="store_true", help="short runs of fewer parameters"
+    )
+    args = parser.parse_args()
+    unknown = set(args.scenarios) - set(SCENARIOS)
+    if unknown:
+        parser.error(f"unknown scenarios: {', '.join(sorted(unknown))}")
+
+    forwarded = ["--duration", str(0.5 if args.quick else args.duration)]
+    if args.loops:
+        forwarded += ["--loops", *args.loops]
+
+    results = []
+    for name in args.scenarios or SCENARIOS:
+        module = SCENARIOS[name]
+        scenario_parser = common.parser(module.__doc__)
+        module.add_arguments(scenario_parser)
+        argv = forwarded + (QUICK[name] if args.quick else [])
+        print(f"running {name}", file=sys.stderr)
+        results += module.run(scenario_parser.parse_args(argv))
+    common.emit(results, args.output)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,118 @@
+"""Ping-pong over a socket pair on the uring loop in each ring setup mode.
+
+Two tasks bounce a message over a socket pair with sock_sendall and
+sock_recv, so every round trip is a few submissions and waits of the loop,
+which is what the setup modes speed up:
+
+- ``plain``: no setup flags
+- ``coop``: COOP_TASKRUN, completion work doesn't interrupt the thread
+- ``single_issuer``: SINGLE_ISSUER and COOP_TASKRUN
+- ``defer``: SINGLE_ISSUER and DEFER_TASKRUN, completion work runs only
+  when the loop waits; the default of the loop where supported
+
+Each runs with and without the ring fd registered. Modes the kernel doesn't
+support are reported as skipped.
+"""
+
+import asyncio
+import socket
+import time
+
+from _uring_io import flags
+
+import common
+
+_TASKRUN = flags.RING_SETUP_COOP_TASKRUN | flags.RING_SETUP_TASKRUN_FLAG
+
+MODES = {
+    "plain": 0,
+    "coop": _TASKRUN,
+    "single_issuer": flags.RING_SETUP_SINGLE_ISSUER | _TASKRUN,
+    "defer": flags.RING_SETUP_SINGLE_ISSUER
+    | flags.RING_SETUP_DEFER_TASKRUN
+    | flags.RING_SETUP_TASKRUN_FLAG,
+}
+
+
+async def _ping_pong(loop, size, duration):
+    a, b = socket.socketpair()
+    a.setblocking(False)
+    b.setblocking(False)
+    message = b"x" * size
+    latencies = []
+    deadline = common.Deadline(duration)
+
+    async def echo():
+        while data := await loop.sock_recv(b, size):
+            await loop.sock_sendall(b, data)
+
+    server = loop.create_task(echo())
+    try:
+        while deadline:
+            start = time.perf_counter()
+            await loop.sock_sendall(a, message)
+            received = 0
+            while received < size:
+                received += len(await loop.sock_recv(a, size))
+            latencies.append(time.perf_counter() - start)
+    finally:
+        a.close()
+        await server
+        b.close()
+    return len(latencies), deadline.elapsed(), latencies
+
+
+def measure(mode, register_ring_fd, args):
+    result = {
+        "scenario": "setup_modes",
+        "loop": "uring",
+        "mode": mode,
+        "register_ring_fd": register_ring_fd,
+        "message_size": args.message_size,
+    }
+    factory = common.loop_factories()["uring"]
+    try:
+        factory(flags=MODES[mode], register_ring_fd=register_ring_fd).close()
+    except RuntimeError:
+        return {**result, "skipped": "not supported by the kernel"}
+
+    count, elapsed, latencies = common.run_on(
+        lambda: factory(flags=MODES[mode], register_ring_fd=register_ring_fd),
+        _ping_pong,
+        args.message_size,
+        args.duration,
+    )
+    return {
+        **result,
+        "round_trips_per_sec": count / elapsed,
+        **common.percentiles(latencies),
+    }
+
+
+def run(args):
+    return [
+        measure(mode, register_ring_fd, args)
+        for mode in args.modes
+        for register_ring_fd in (False, True)
+    ]
+
+
+def add_arguments(parser):
+    parser.add_argument(
+        "--modes", nargs="*", default=list(MODES), help=", ".join(MODES)
+    )
+    parser.add_argument("--message-size", type=int, default=64)
+
+
+def main():
+    parser = common.parser(__doc__)
+    add_arguments(parser)
+    args = parser.parse_args()
+    unknown = set(args.modes) - set(MODES)
+    if unknown:
+        parser.error(f"unknown modes: {', '.join(sorted(unknown))}")
+    common.emit(run(args), args.output)
+
+
+if __name__ == "__main__":
+    main()
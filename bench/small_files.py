@@ -0,0 +1,181 @@
+"""Small files served over loopback.
+
+A server in a child process answers each request line naming one of --files
+files of --file-size bytes with the content of that file, sent with
+loop.sendfile. The clients in this process keep --connections connections
+busy with requests for random files. The uring loop splices the files on
+the ring, the selector loop uses os.sendfile and uvloop falls back to reads
+and writes.
+"""
+
+import asyncio
+import multiprocessing
+import os
+import random
+import shutil
+import tempfile
+import time
+
+import common
+
+
+class _FileServer(asyncio.Protocol):
+    def __init__(self, directory):
+        self.directory = directory
+        self.buffer = b""
+        self.requests = asyncio.Queue()
+
+    def connection_made(self, transport):
+        self.transport = transport
+        self.task = asyncio.get_running_loop().create_task(self._serve())
+
+    def data_received(self, data):
+        *lines, self.buffer = (self.buffer + data).split(b"\n")
+        for name in lines:
+            self.requests.put_nowait(name.decode())
+
+    def connection_lost(self, exc):
+        self.requests.put_nowait(None)
+
+    async def _serve(self):
+        loop = asyncio.get_running_loop()
+        while (name := await self.requests.get()) is not None:
+            with open(os.path.join(self.directory, name), "rb") as f:
+                try:
+                    await loop.sendfile(self.transport, f)
+                except (ConnectionError, RuntimeError):
+                    # Closed while sending, the client is gone
+                    break
+
+
+async def _server(loop, conn, directory):
+    server = await loop.create_server(
+        lambda: _FileServer(directory), "127.0.0.1", 0, backlog=4096
+    )
+    conn.send(server.sockets[0].getsockname()[1])
+    # Serve until the parent says stop
+    await loop.run_in_executor(None, conn.recv)
+    server.close()
+    await server.wait_closed()
+
+
+def serve(name, conn, directory):
+    common.run_on(common.loop_factories()[name], _server, conn, directory)
+
+
+class _Fetcher(asyncio.Protocol):
+    def __init__(self, names, size, rng, latencies):
+        self.names = names
+        self.size = size
+        self.rng = rng
+        self.latencies = latencies
+        self.done = asyncio.get_running_loop().create_future()
+
+    def connection_made(self, transport):
+        self.transport = transport
+
+    def start(self, deadline):
+        self.deadline = deadline
+        self._request()
+
+    def _request(self):
+        self.received = 0
+        self.sent_at = time.perf_counter()
+        self.transport.write(self.rng.choice(self.names) + b"\n")
+
+    def data_received(self, data):
+        self.received += len(data)
+        if self.received < self.size:
+            return
+        self.latencies.append(time.perf_counter() - self.sent_at)
+        if self.deadline:
+            self._request()
+        else:
+            self.transport.close()
+
+    def connection_lost(self, exc):
+        if not self.done.done():
+            self.done.set_result(None)
+
+
+async def _clients(loop, port, names, size, connections, duration):
+    latencies = []
+    clients = []
+    for i in range(connections):
+        _, client = await loop.create_connection(
+            lambda: _Fetcher(names, size, random.Random(i), latencies),
+            "127.0.0.1",
+            port,
+        )
+        clients.append(client)
+
+    deadline = common.Deadline(duration)
+    for client in clients:
+        client.start(deadline)
+    await asyncio.gather(*(client.done for client in clients))
+    return len(latencies), deadline.elapsed(), latencies
+
+
+def measure(name, factory, directory, names, args):
+    context = multiprocessing.get_context("spawn")
+    conn, child_conn = context.Pipe()
+    server = context.Process(target=serve, args=(name, child_conn, directory))
+    server.start()
+    try:
+        port = conn.recv()
+        count, elapsed, latencies = common.run_on(
+            factory,
+            _clients,
+            port,
+            names,
+            args.file_size,
+            args.connections,
+            args.duration,
+        )
+    finally:
+        conn.send(None)
+        server.join()
+    return {
+        "scenario": "small_files",
+        "loop": name,
+        "connections": args.connections,
+        "file_size": args.file_size,
+        "files_per_sec": count / elapsed,
+        "mb_per_sec": count * args.file_size / elapsed / 1e6,
+        **common.percentiles(latencies),
+    }
+
+
+def run(args):
+    directory = tempfile.mkdtemp(prefix="uring-bench-", dir=args.dir)
+    try:
+        names = []
+        for i in range(args.files):
+            name = f"{i:06d}"
+            with open(os.path.join(directory, name), "wb") as f:
+                f.write(os.urandom(args.file_size))
+            names.append(name.encode())
+        return [
+            measure(name, factory, directory, names, args)
+            for name, factory in common.selected_loops(args).items()
+        ]
+    finally:
+        shutil.rmtree(directory)
+
+
+def add_arguments(parser):
+    parser.add_argument("--files", type=int, default=1000)
+    parser.add_argument("--file-size", type=int, default=4096)
+    parser.add_argument("--connections", type=int, default=64)
+    parser.add_argument("--dir", default=None, help="directory of the files")
+
+
+def main():
+    parser = common.parser(__doc__)
+    add_arguments(parser)
+    args = parser.parse_args()
+    common.emit(run(args), args.output)
+
+
+if __name__ == "__main__":
+    main()
@@ -1,2 +1,2 @@
-
 from ._version import __version__
+from .loop import EventLoopPolicy, UringChain, UringIOEventLoop, UringProactor
@@ -0,0 +1,183 @@
+import asyncio
+import collections
+import errno
+import os
+
+from _uring_io import FixedFile
+
+
+class FileTable:
+    """Registered file table of a ring with its slots handed out from Python
+
+    The first ``size`` slots are managed here. The ``auto`` slots after them
+    are left for the kernel, which picks one of them for direct opens and
+    accepts queued with ``FILE_INDEX_ALLOC``.
+    """
+
+    def __init__(self, ring, size, auto=0):
+        ring.register_files(size + auto)
+        if auto:
+            ring.register_file_alloc_range(size, auto)
+        self._ring = ring
+        self._size = size
+        self._free = list(range(size - 1, -1, -1))
+
+    def __len__(self):
+        return self._size - len(self._free)
+
+    def allocate(self):
+        """Reserve an empty slot, e.g. as target of a direct open"""
+        if not self._free:
+            raise OSError(errno.ENFILE, "registered file table is full")
+        return FixedFile(self._free.pop())
+
+    def install(self, fd):
+        """Register a file descriptor in a free slot and return the slot
+
+        The descriptor itself stays open and owned by the caller.
+        """
+        slot = self.allocate()
+        try:
+            self._ring.update_files(slot, [fd])
+        except BaseException:
+            self._free.append(int(slot))
+            raise
+        return slot
+
+    def remove(self, slot):
+        """Clear a slot and give it back"""
+        self._ring.update_files(slot, [-1])
+        self.free(slot)
+
+    def free(self, slot):
+        """Give back a slot that is already empty, e.g. after a direct close"""
+        if slot < self._size:
+            self._free.append(int(slot))
+
+
+class AsyncFile:
+    """Regular file read and written through the ring of a UringIOEventLoop
+
+    Sequential reads keep up to ``read_ahead`` reads of ``chunk_size`` bytes
+    in flight past the position, so the disk works while the caller consumes
+    what is there already. A write or seek drops them.
+    """
+
+    def __init__(self, fd, *, read_ahead=4, chunk_size=64 * 1024, loop=None):
+        self._loop = loop or asyncio.get_running_loop()
+        self._fd = fd
+        self._read_ahead = read_ahead
+        self._chunk_size = chunk_size
+        self._pos = 0
+        self._buffer = bytearray()  # read ahead data at _pos
+        self._ahead = collections.deque()  # reads of the chunks after it
+        self._next = 0
+
+    @classmethod
+    async def open(cls, path, flags=os.O_RDONLY, mode=0o644, **kwargs):
+        """Open path like os.open and wrap it"""
+        loop = kwargs.get("loop") or asyncio.get_running_loop()
+        fd = await loop.file_open(path, flags, mode)
+        return cls(fd, **kwargs)
+
+    def fileno(self):
+        return self._fd
+
+    @property
+    def closed(self):
+        return self._fd is None
+
+    def tell(self):
+        return self._pos
+
+    def seek(self, offset, whence=os.SEEK_SET):
+        """Move the position, SEEK_END isn't supported"""
+        if whence == os.SEEK_CUR:
+            offset += self._pos
+        elif whence != os.SEEK_SET:
+            raise ValueError(f"unsupported whence {whence}")
+        if offset < 0:
+            raise ValueError(f"negative seek position {offset}")
+        if offset != self._pos:
+            self._drop_ahead()
+            self._pos = offset
+        return self._pos
+
+    def _drop_ahead(self):
+        for fut in self._ahead:
+            fut.cancel()
+        self._ahead.clear()
+        self._buffer.clear()
+
+    def _fill_ahead(self):
+        if not self._ahead:
+            self._next = self._pos + len(self._buffer)
+        proactor = self._loop._proactor
+        while len(self._ahead) < self._read_ahead:
+            # Queued right away rather than once a task got to run
+            fut = proactor.file_read(self._fd, self._chunk_size, self._next)
+            self._ahead.append(fut)
+            self._next += self._chunk_size
+
+    async def read(self, size=-1):
+        """Read up to size bytes at the position, everything left if size < 0"""
+        buffer = self._buffer
+        try:
+            while size < 0 or len(buffer) < size:
+                self._fill_ahead()
+                chunk = await self._ahead[0]
+                self._ahead.popleft()
+                buffer += chunk
+                if len(chunk) < self._chunk_size:
+                    # End of file, the reads past it have nothing either
+                    for fut in self._ahead:
+                        fut.cancel()
+                    self._ahead.clear()
+                    break
+        except BaseException:
+            self._drop_ahead()
+            raise
+        if size < 0:
+            size = len(buffer)
+        data = bytes(buffer[:size])
+        del buffer[:size]
+        self._pos += len(data)
+        return data
+
+    async def write(self, data):
+        """Write all of data at the position"""
+        self._drop_ahead()
+        view = memoryview(data).cast("B")
+        nbytes = len(view)
+        while view:
+            written = await self._loop.file_write(self._fd, view, self._pos)
+            self._pos += written
+            view = view[written:]
+        return nbytes
+
+    async def fsync(self, datasync=False):
+        await self._loop.file_fsync(self._fd, datasync)
+
+    async def stat(self):
+        return await self._loop.file_statx(self._fd)
+
+    async def close(self):
+        if self._fd is not None:
+            self._drop_ahead()
+            fd, self._fd = self._fd, None
+            await self._loop.file_close(fd)
+
+    async def __aenter__(self):
+        return self
+
+    async def __aexit__(self, *exc_info):
+        await self.close()
+
+    def __aiter__(self):
+        return self
+
+    async def __anext__(self):
+        chunk = await self.read(self._chunk_size)
+        if not chunk:
+            raise StopAsyncIteration
+        return chunk
@@ -1,37 +1,1403 @@
-from asyncio import AbstractEventLoop
+import collections
+import errno
+import fcntl
+import functools
+import logging
+import math
+import os
+import resource
+import select
+import selectors
+import socket
+import struct
+import sys
+import threading
+import time
+from asyncio import (
+    base_events,
+    events,
+    exceptions,
+    futures,
+    proactor_events,
+    sslproto,
+    unix_events,
+)
 
-from _uring_io import Ring
+from _uring_io import Ring, TimerWheel, capabilities
+from _uring_io import flags as ring_flags
 
+from .files import FileTable
 
-class UringIOEventLoop(AbstractEventLoop):
-    """asyncio equivalent loop based on uring_io"""
+logger = logging.getLogger(__name__)
+
+__all__ = ["UringChain", "UringProactor", "UringIOEventLoop", "EventLoopPolicy"]
+
+# Completions dispatched after a single wait
+_DISPATCH_BATCH = 256
+
+# Chunk of relay when it copies through Python
+_COPY_SIZE = 64 * 1024
+
+# Slots of the registered file table of a loop, RLIMIT_NOFILE limits it too
+_FILE_TABLE_SIZE = 16384
+
+_MAX_TIMEOUT = base_events.MAXIMUM_SELECT_TIMEOUT
+
+_UnixLoop = unix_events._UnixSelectorEventLoop
+
+# Returned by a completion callback that queued another operation for its
+# future instead of resolving it
+_PENDING = object()
+
+# struct statx up to the device numbers, its timestamps are (sec, nsec)
+_STATX = struct.Struct("=IIQIIIH2xQQQQqI4xqI4xqI4xqI4xIIII")
+_STATX_SIZE = 256
+
+
+# Setup flags for a ring only entered by the thread running its loop, the
+# fastest first: completion work runs only when the loop waits (Linux 6.1),
+# or without interrupting the thread (Linux 5.19), and the kernel skips
+# the locking for other submitters (Linux 6.0).
+_SETUP_MODES = (
+    ring_flags.RING_SETUP_SINGLE_ISSUER
+    | ring_flags.RING_SETUP_DEFER_TASKRUN
+    | ring_flags.RING_SETUP_TASKRUN_FLAG,
+    ring_flags.RING_SETUP_SINGLE_ISSUER
+    | ring_flags.RING_SETUP_COOP_TASKRUN
+    | ring_flags.RING_SETUP_TASKRUN_FLAG,
+    ring_flags.RING_SETUP_COOP_TASKRUN | ring_flags.RING_SETUP_TASKRUN_FLAG,
+)
+
+# Rings bound to the thread that first used them, see UringProactor._bind
+_THREAD_BOUND = ring_flags.RING_SETUP_SINGLE_ISSUER
+
+
+def _default_setup_flags():
+    """The first of _SETUP_MODES the kernel accepts, or 0"""
+    accepted = capabilities().setup_flags
+    for flags in _SETUP_MODES:
+        if flags & accepted == flags:
+            return flags
+    return 0
+
+
+def _accepted(fd):
+    """The (conn, address) of a connection accepted on the ring"""
+    conn = socket.socket(fileno=fd)
+    conn.setblocking(False)
+    try:
+        return conn, conn.getpeername()
+    except OSError:
+        conn.close()
+        raise
+
+
+def _stat_result(buf):
+    """Convert a struct statx to an os.stat_result"""
+    fields = _STATX.unpack_from(buf)
+    blksize, _, nlink, uid, gid, mode, ino, size, blocks = fields[1:10]
+    atime, _, ctime, mtime = zip(fields[11:19:2], fields[12:19:2])
+    rdev_major, rdev_minor, dev_major, dev_minor = fields[19:]
+    extra = {"st_blksize": blksize, "st_blocks": blocks}
+    extra["st_rdev"] = os.makedev(rdev_major, rdev_minor)
+    for name, (sec, nsec) in (("atime", atime), ("mtime", mtime), ("ctime", ctime)):
+        extra[f"st_{name}"] = sec + nsec * 1e-9
+        extra[f"st_{name}_ns"] = sec * 10**9 + nsec
+    dev = os.makedev(dev_major, dev_minor)
+    return os.stat_result(
+        (mode, ino, dev, nlink, uid, gid, size, atime[0], mtime[0], ctime[0]), extra
+    )
+
+
+class _UringFuture(futures.Future):
+    """Future of an operation queued on the ring
+
+    Cancelling it also cancels the operation in the kernel. Its completion
+    still arrives, with -ECANCELED, and is dropped by the proactor.
+    """
+
+    def __init__(self, proactor, *, loop=None):
+        super().__init__(loop=loop)
+        if self._source_traceback:
+            del self._source_traceback[-1]
+        self._proactor = proactor
+        self._user_data = None
+        # Buffers the kernel may still use
+        self._keep = None
+
+    def _repr_info(self):
+        info = super()._repr_info()
+        if self._user_data is not None:
+            info.insert(1, f"user_data={self._user_data:#x}")
+        return info
+
+    def cancel(self, msg=None):
+        if not self.done() and self._user_data is not None:
+            self._proactor._cancel(self._user_data)
+        return super().cancel(msg=msg)
+
+
+class _Operation:
+    """Completion handler of an operation whose result needs converting
+
+    The future is resolved with callback(res, flags, obj). obj keeps the
+    buffers of the operation alive until it completes.
+    """
+
+    __slots__ = ("proactor", "fut", "prep", "args", "callback", "obj", "on_drop")
+
+    def __init__(self, proactor, fut, prep, args, callback, obj, on_drop):
+        self.proactor = proactor
+        self.fut = fut
+        self.prep = prep
+        self.args = args
+        self.callback = callback
+        self.obj = obj
+        self.on_drop = on_drop
+
+    def __call__(self, res, flags):
+        fut = self.fut
+        if fut.done():
+            # Cancelled, but it may have succeeded meanwhile
+            if self.on_drop is not None and res >= 0:
+                self.on_drop(res)
+            return
+        if res == -errno.EINTR:
+            # Retried like the interrupted system calls of PEP 475, blocking
+            # files can see it when a signal or task work is pending
+            self.proactor._requeue(
+                fut, self.prep, self.args, self.callback, self.obj, self.on_drop
+            )
+            return
+        if res < 0:
+            fut.set_exception(OSError(-res, os.strerror(-res)))
+            return
+        try:
+            value = self.callback(res, flags, self.obj)
+        except OSError as exc:
+            fut.set_exception(exc)
+        else:
+            if value is not _PENDING:
+                fut.set_result(value)
+
+
+class _ZeroCopySend:
+    """Completion handler of a zero copy send of a whole buffer
+
+    Each send completes twice: with its result, flagged CQE_F_MORE if the
+    kernel still reads the buffer, and with CQE_F_NOTIF once it stopped.
+    The future gets the result and released is done after the last
+    notification, or once the send failed without one pending.
+    """
+
+    __slots__ = ("proactor", "fut", "fd", "view", "flags", "sent", "busy", "released")
+
+    def __init__(self, proactor, fut, fd, view, flags):
+        self.proactor = proactor
+        self.fut = fut
+        self.fd = fd
+        self.view = view
+        self.flags = flags
+        self.sent = 0
+        # Sends and notifications still to complete
+        self.busy = 0
+        self.released = proactor._loop.create_future()
+
+    def queue(self):
+        proactor = self.proactor
+        args = (self.fd, self.view[self.sent :], self.flags, 0, self)
+        self.fut._user_data = proactor._queue(proactor._ring.prep_send_zc, *args)
+        self.busy += 1
+
+    def __call__(self, res, flags):
+        if flags & ring_flags.CQE_F_MORE:
+            self.busy += 1
+        self.busy -= 1
+        if not flags & ring_flags.CQE_F_NOTIF and not self.fut.done():
+            self._done(res)
+        if not self.busy and not self.released.done():
+            self.released.set_result(None)
+
+    def _done(self, res):
+        if res == -errno.EINTR:
+            self.queue()
+        elif res < 0:
+            self.fut.set_exception(OSError(-res, os.strerror(-res)))
+        else:
+            self.sent += res
+            if self.sent < len(self.view):
+                self.queue()
+            else:
+                self.fut.set_result(self.sent)
+
+
+class _MultishotAccept:
+    """Accepts of a serving listener, by a single multishot accept
+
+    The operation posts a completion for every connection until it fails
+    or is cancelled, it is queued again by the next accept after that.
+    Connections accepted while no accept waits are kept for the next one.
+    The futures of the accepts have no operation of their own to cancel.
+    """
+
+    __slots__ = ("proactor", "listener", "user_data", "backlog", "waiters", "stopped")
+
+    def __init__(self, proactor, listener):
+        self.proactor = proactor
+        self.listener = listener
+        self.user_data = None
+        # Results not waited for yet and accepts waiting for one, one of
+        # them is empty
+        self.backlog = collections.deque()
+        self.waiters = collections.deque()
+        self.stopped = False
+
+    def accept(self):
+        proactor = self.proactor
+        proactor._check_closed()
+        fut = _UringFuture(proactor, loop=proactor._loop)
+        if self.backlog:
+            self._resolve(fut, self.backlog.popleft())
+            return fut
+        self.waiters.append(fut)
+        if self.user_data is None:
+            flags = socket.SOCK_CLOEXEC | socket.SOCK_NONBLOCK
+            prep = proactor._ring.prep_multishot_accept
+            self.user_data = proactor._queue(
+                prep, proactor._file(self.listener), flags, False, self
+            )
+        return fut
+
+    def __call__(self, res, flags):
+        if not flags & ring_flags.CQE_F_MORE:
+            self.user_data = None
+        if self.stopped:
+            if res >= 0:
+                os.close(res)
+            return
+        while self.waiters:
+            fut = self.waiters.popleft()
+            if not fut.done():
+                self._resolve(fut, res)
+                return
+        self.backlog.append(res)
+
+    @staticmethod
+    def _resolve(fut, res):
+        if res < 0:
+            fut.set_exception(OSError(-res, os.strerror(-res)))
+            return
+        try:
+            fut.set_result(_accepted(res))
+        except OSError as exc:
+            fut.set_exception(exc)
+
+    def stop(self):
+        self.stopped = True
+        if self.user_data is not None:
+            self.proactor._cancel(self.user_data)
+        while self.backlog:
+            res = self.backlog.popleft()
+            if res >= 0:
+                os.close(res)
+        while self.waiters:
+            self.waiters.popleft().cancel()
+
+
+class _UringChainFuture(_UringFuture):
+    """Future of a chain, resolved with the results of all of its steps
+
+    Its user_data is the list of the user_data of the steps. Cancelling it
+    cancels the running step, which cuts off the rest of the chain.
+    """
+
+    def __init__(self, proactor, *, loop=None):
+        super().__init__(proactor, loop=loop)
+        self._results = []
+        self._remaining = 0
+
+    def _repr_info(self):
+        info = futures.Future._repr_info(self)
+        info.insert(1, f"steps={len(self._results)}")
+        return info
+
+    def _add_step(self):
+        self._results.append(None)
+        self._remaining += 1
+        return functools.partial(self._step_done, len(self._results) - 1)
+
+    def _step_done(self, index, res, flags):
+        self._results[index] = res
+        self._remaining -= 1
+        if not self._remaining and not self.done():
+            self.set_result(self._results)
+
+    def cancel(self, msg=None):
+        if not self.done() and self._user_data is not None:
+            for user_data, res in zip(self._user_data, self._results):
+                if res is None:
+                    self._proactor._cancel(user_data)
+        return futures.Future.cancel(self, msg=msg)
+
+
+class UringChain:
+    """Operations linked in the kernel and awaited as one
+
+    Steps take the arguments of the prep_* method of their opcode and only
+    start once the step before them completed, without a round trip through
+    the loop. The future returned by submit() gets the list of the results
+    of all steps, link timeouts included: the step result or a negative
+    errno. A failed or short step cancels the steps after it, which get
+    -ECANCELED, unless the chain is hard linked. An expired link timeout
+    completes with -ETIME and cancels the step it limits.
+    """
+
+    def __init__(self, proactor, hard=False):
+        self._chain = proactor._ring.chain(hard)
+        self._fut = _UringChainFuture(proactor, loop=proactor._loop)
+        self._keep = []
+
+    def __len__(self):
+        return len(self._chain)
+
+    def add(self, opcode, *args):
+        """Add a step, returns the chain"""
+        self._chain.add(opcode, *args, data=self._fut._add_step())
+        self._keep.append(args)
+        return self
+
+    def link_timeout(self, seconds):
+        """Limit the step added last to seconds, returns the chain"""
+        self._chain.link_timeout(seconds, data=self._fut._add_step())
+        return self
+
+    def submit(self):
+        """Submit all steps at once and return the future of the chain"""
+        fut = self._fut
+        if fut._user_data is not None:
+            raise RuntimeError("chain is submitted already")
+        fut._user_data = self._chain.submit()
+        fut._keep = self._keep
+        return fut
+
+
+class _WheelTimerHandle(events.TimerHandle):
+    """TimerHandle kept in the TimerWheel of the loop instead of a heap"""
+
+    __slots__ = ("_timer_id",)
+
+
+class UringProactor:
+    """Proactor of UringIOEventLoop, queues operations on an io_uring
+
+    The data of an operation is its future when the result of the
+    operation is the result of the future, and an _Operation otherwise.
+    Either way the ring resolves it in dispatch_completions.
+
+    The timers of the loop are in a TimerWheel, their events are the timers
+    that expired while waiting.
+
+    Where the kernel lacks an operation or feature, the proactor falls back
+    to what it has, as told by capabilities().
+    """
+
+    def __init__(self, ring, timers=None, *, register_ring_fd=False):
+        self._loop = None
+        self._ring = ring
+        self._timers = timers
+        self._caps = capabilities()
+        self._register_ring_fd = register_ring_fd
+        # Thread the ring is bound to, see _bind
+        self._thread = None
+        self._thread_bound = False
+        # Other threads post wakeups into the ring through a ring of their
+        # own, as the waiting loop holds the submission side of its ring
+        self._waker = Ring(4) if self._caps.msg_ring else None
+        self._wakeup_posted = False
+        # Listener fd => _MultishotAccept of a serving listener
+        self._acceptors = {}
+        # Sockets the loop owns go into a table of registered files, set
+        # up with the first one; fd => (socket, FixedFile) of each
+        self._files = None
+        self._fixed = {} if self._caps.fixed_files else None
+        # Without EXT_ARG a wait with a timeout waits on the ring fd instead
+        self._poller = None
+        if not self._caps.ext_arg:
+            self._poller = select.poll()
+            self._poller.register(ring.fd, select.POLLIN)
+
+    def _check_closed(self):
+        if self._ring is None:
+            raise RuntimeError("UringProactor is closed")
+
+    def __repr__(self):
+        if self._ring is None:
+            info = ["closed"]
+        else:
+            info = ["pending#=%s" % len(self._ring.pending())]
+        return "<%s %s>" % (self.__class__.__name__, " ".join(info))
+
+    def set_loop(self, loop):
+        self._loop = loop
+
+    def select(self, timeout=None):
+        """Submit the queued operations and wait up to timeout seconds
+
+        The wait ends at the latest at the next deadline of the timer
+        wheel, which the kernel arms along with the wait, so the timers
+        never need a timeout of their own on the ring. Completions resolve
+        their futures right away, the timers due are returned as events.
+        """
+        timers = self._timers
+        if timers is None:
+            return self._poll(timeout)
+        if timeout != 0 and timers:
+            deadline = timers.next_deadline()
+            wait = min(max(0, deadline - self._loop.time()), _MAX_TIMEOUT)
+            timeout = wait if timeout is None else min(timeout, wait)
+        self._poll(timeout)
+        if not timers:
+            return []
+        return timers.expire(self._loop.time() + self._loop._clock_resolution)
+
+    def _queue(self, prep, *args):
+        try:
+            user_data = prep(*args)
+        except RuntimeError:
+            # The submission queue is full, flush it and try once more
+            self._ring.submit()
+            user_data = prep(*args)
+        if not self._loop.is_running():
+            # No poll is coming to submit it until the loop runs again
+            self._bind()
+            self._ring.submit()
+        return user_data
+
+    def _register(self, prep, args, callback=None, obj=None, *, on_drop=None):
+        """Queue an operation and return its future
+
+        Without a callback the result of the operation is the result of
+        the future, as set by the ring itself.
+        """
+        self._check_closed()
+        fut = _UringFuture(self, loop=self._loop)
+        if callback is None:
+            fut._keep = obj
+            fut._user_data = self._queue(prep, *args, fut)
+        else:
+            self._requeue(fut, prep, args, callback, obj, on_drop)
+        return fut
+
+    def _requeue(self, fut, prep, args, callback, obj=None, on_drop=None):
+        """Queue another operation that resolves fut, e.g. the rest of a
+        short write. Returns _PENDING to be returned by the callback.
+        """
+        op = _Operation(self, fut, prep, args, callback, obj, on_drop)
+        fut._user_data = self._queue(prep, *args, op)
+        return _PENDING
+
+    def _bind(self):
+        """Bind the ring to the thread using it first
+
+        A ring set up disabled is enabled here; with SINGLE_ISSUER only
+        this thread can submit to it from then on. The ring fd is
+        registered with the thread, which saves a lookup in each
+        io_uring_enter but leaves other threads unable to enter the ring.
+        """
+        thread = threading.get_ident()
+        if self._thread is not None:
+            if self._thread_bound and thread != self._thread:
+                raise RuntimeError(
+                    "The ring of this loop is bound to the thread that used it "
+                    "first, set it up with flags=0 and register_ring_fd=False "
+                    "to move the loop between threads"
+                )
+            return
+        ring = self._ring
+        self._thread = thread
+        self._thread_bound = bool(ring.flags & _THREAD_BOUND)
+        if ring.flags & ring_flags.RING_SETUP_R_DISABLED:
+            ring.enable()
+        if self._register_ring_fd and self._caps.register_ring_fd:
+            try:
+                ring.register_ring_fd()
+            except RuntimeError:
+                # Out of the 16 slots of the thread
+                pass
+            else:
+                self._thread_bound = True
+
+    def _install(self, sock):
+        """Install a socket the loop owns in the registered file table
+
+        Operations on it name its slot from then on, which spares the
+        kernel the file reference counting of each. It stays a plain
+        descriptor if the table is full or can't be set up, e.g. on a ring
+        with a table of its own.
+        """
+        if self._fixed is None or self._ring is None:
+            return
+        if self._files is None:
+            size = resource.getrlimit(resource.RLIMIT_NOFILE)[0]
+            if size == resource.RLIM_INFINITY or size > _FILE_TABLE_SIZE:
+                size = _FILE_TABLE_SIZE
+            try:
+                self._files = FileTable(self._ring, size)
+            except RuntimeError:
+                self._fixed = None
+                return
+        try:
+            slot = self._files.install(sock.fileno())
+        except (OSError, RuntimeError):
+            return
+        self._fixed[sock.fileno()] = (sock, slot)
+
+    def _uninstall(self, sock):
+        """Take sock out of the file table before it is closed, its slot
+        would keep it open
+        """
+        if not self._fixed:
+            return
+        entry = self._fixed.get(sock.fileno())
+        if entry is not None and entry[0] is sock:
+            del self._fixed[sock.fileno()]
+            try:
+                self._files.remove(entry[1])
+            except RuntimeError:
+                # The slot is lost, the socket closes with the ring
+                pass
+
+    def _file(self, conn):
+        """What operations on conn name: its FixedFile if the loop installed
+        it, its descriptor otherwise
+        """
+        fd = conn.fileno()
+        if self._fixed:
+            entry = self._fixed.get(fd)
+            if entry is not None and entry[0] is conn:
+                return entry[1]
+        return fd
+
+    def _cancel(self, user_data):
+        if self._ring is not None:
+            self._queue(self._ring.cancel, user_data)
+
+    def _cancel_fd(self, conn, futs):
+        """Cancel the futures of operations on conn, which is closing
+
+        A single cancellation by descriptor stops every operation on it,
+        rather than one per future. It has to be submitted before conn is
+        closed, or it could hit a new file with the same number; the close
+        of a transport comes a loop iteration later.
+        """
+        futs = [fut for fut in futs if fut is not None and not fut.done()]
+        if self._ring is not None and len(futs) > 1 and self._caps.cancel_fd:
+            self._queue(self._ring.cancel_fd, self._file(conn))
+            for fut in futs:
+                fut._user_data = None
+        for fut in futs:
+            fut.cancel()
+
+    def wakeup(self):
+        """Wake up the loop waiting in select, from any thread
+
+        An IORING_OP_MSG_RING posts an empty completion straight into the
+        ring. Only one is posted until the loop woke up. Returns False if
+        the kernel can't do that, before Linux 5.18.
+        """
+        waker, ring = self._waker, self._ring
+        if waker is None or ring is None:
+            return False
+        if self._wakeup_posted:
+            return True
+        self._wakeup_posted = True
+        try:
+            waker.msg_ring(ring)
+        except RuntimeError:
+            # E.g. a ring of another process after a fork
+            self._waker = None
+            self._wakeup_posted = False
+            return False
+        return True
+
+    def _poll(self, timeout=None):
+        ring = self._ring
+        if self._poller is None or not timeout:
+            ring.submit_and_wait_timeout(0 if timeout == 0 else 1, timeout)
+        elif not ring.submit_and_wait_timeout(0):
+            # Before Linux 5.11 liburing would queue a timeout operation for
+            # the timeout of the wait, which completes after every wait that
+            # ended earlier. Polling the ring fd costs nothing on the ring.
+            self._poller.poll(math.ceil(timeout * 1e3))
+        # Callbacks scheduled from now on need another wakeup, the ones
+        # before it run in this iteration
+        self._wakeup_posted = False
+        # What is left over is ready right away for the next poll
+        ring.dispatch_completions(_DISPATCH_BATCH)
+        return []
+
+    def _recv(self, conn, view, flags, callback):
+        if isinstance(conn, socket.socket):
+            args = (self._file(conn), view, flags)
+            return self._register(self._ring.prep_recv, args, callback, view)
+        args = (conn.fileno(), view, -1)
+        return self._register(self._ring.prep_read, args, callback, view)
+
+    def recv(self, conn, nbytes, flags=0):
+        def finish_recv(res, cqe_flags, view):
+            return bytes(view[:res])
+
+        return self._recv(conn, memoryview(bytearray(nbytes)), flags, finish_recv)
+
+    def recv_into(self, conn, buf, flags=0):
+        # The view also keeps buf from being resized while the kernel fills it
+        view = memoryview(buf)
+        if isinstance(conn, socket.socket):
+            args = (self._file(conn), view, flags)
+            return self._register(self._ring.prep_recv, args, obj=view)
+
+        def finish_recv(res, cqe_flags, view):
+            return res
+
+        return self._recv(conn, view, flags, finish_recv)
+
+    def send(self, conn, buf, flags=0):
+        """Write all of buf, queueing the rest again after a short write"""
+        if isinstance(conn, socket.socket):
+            # The kernel retries partial sends on stream sockets itself
+            fd = self._file(conn)
+            prep, extra = self._ring.prep_send, (flags | socket.MSG_WAITALL,)
+        else:
+            fd = conn.fileno()
+            prep, extra = self._ring.prep_write, (-1,)
+        view = memoryview(buf).cast("B")
+        nbytes = len(view)
+
+        def finish_send(res, cqe_flags, view):
+            if res < len(view):
+                rest = view[res:]
+                return self._requeue(fut, prep, (fd, rest, *extra), finish_send, rest)
+            return nbytes
+
+        fut = self._register(prep, (fd, view, *extra), finish_send, view)
+        return fut
+
+    def send_zc(self, conn, buf, flags=0):
+        """Send all of buf without copying it to the socket buffers
+
+        The future has a released future, done once the kernel doesn't read
+        buf anymore.
+        """
+        self._check_closed()
+        fut = _UringFuture(self, loop=self._loop)
+        view = memoryview(buf).cast("B")
+        flags |= socket.MSG_WAITALL
+        op = _ZeroCopySend(self, fut, self._file(conn), view, flags)
+        fut.released = op.released
+        op.queue()
+        return fut
+
+    def _when_ready(self, conn, events, func):
+        """Call func once conn is ready for events, as long as it would block
+
+        Used for datagrams, whose addresses the ring doesn't carry.
+        """
+        args = (conn.fileno(), events)
+
+        def finish_poll(res, cqe_flags, obj):
+            try:
+                return func()
+            except (BlockingIOError, InterruptedError):
+                return self._requeue(fut, self._ring.prep_poll_add, args, finish_poll)
+
+        fut = self._register(self._ring.prep_poll_add, args, finish_poll)
+        return fut
+
+    def recvfrom(self, conn, nbytes, flags=0):
+        return self._when_ready(
+            conn, select.POLLIN, lambda: conn.recvfrom(nbytes, flags)
+        )
+
+    def recvfrom_into(self, conn, buf, nbytes=0, flags=0):
+        return self._when_ready(
+            conn, select.POLLIN, lambda: conn.recvfrom_into(buf, nbytes, flags)
+        )
+
+    def sendto(self, conn, buf, flags=0, addr=None):
+        if addr is None:
+            return self._when_ready(
+                conn, select.POLLOUT, lambda: conn.send(buf, flags)
+            )
+        return self._when_ready(
+            conn, select.POLLOUT, lambda: conn.sendto(buf, flags, addr)
+        )
+
+    def accept(self, listener):
+        acceptor = self._acceptors.get(listener.fileno())
+        if acceptor is not None and acceptor.listener is listener:
+            return acceptor.accept()
+
+        def finish_accept(res, cqe_flags, obj):
+            return _accepted(res)
+
+        flags = socket.SOCK_CLOEXEC | socket.SOCK_NONBLOCK
+        args = (self._file(listener), flags)
+        return self._register(
+            self._ring.prep_accept, args, finish_accept, on_drop=os.close
+        )
+
+    def connect(self, conn, address):
+        def finish_connect(res, cqe_flags, obj):
+            return None
+
+        args = (conn.fileno(), address)
+        return self._register(self._ring.prep_connect, args, finish_connect)
+
+    def poll(self, conn, events):
+        args = (conn if isinstance(conn, int) else conn.fileno(), events)
+        return self._register(self._ring.prep_poll_add, args)
+
+    def file_open(self, path, flags, mode, dir_fd):
+        args = (dir_fd, path, flags | os.O_CLOEXEC, mode)
+        return self._register(self._ring.prep_openat, args)
+
+    def file_read(self, fd, size, offset):
+        def finish_read(res, cqe_flags, view):
+            return bytes(view[:res])
+
+        view = memoryview(bytearray(size))
+        args = (fd, view, offset)
+        return self._register(self._ring.prep_read, args, finish_read, view)
+
+    def file_readinto(self, fd, buf, offset):
+        view = memoryview(buf)
+        return self._register(self._ring.prep_read, (fd, view, offset), obj=view)
+
+    def file_write(self, fd, buf, offset):
+        view = memoryview(buf)
+        return self._register(self._ring.prep_write, (fd, view, offset), obj=view)
+
+    def file_fsync(self, fd, flags):
+        return self._register(self._ring.prep_fsync, (fd, flags))
+
+    def file_fallocate(self, fd, mode, offset, length):
+        return self._register(self._ring.prep_fallocate, (fd, mode, offset, length))
+
+    def file_statx(self, dir_fd, path, flags, mask):
+        def finish_statx(res, cqe_flags, buf):
+            return _stat_result(buf)
+
+        buf = bytearray(_STATX_SIZE)
+        args = (dir_fd, path, flags, mask, buf)
+        return self._register(self._ring.prep_statx, args, finish_statx, buf)
+
+    def file_close(self, fd):
+        return self._register(self._ring.prep_close, (fd,))
+
+    async def _splice(self, src, offset, dst, count, wait_src, file=None):
+        """Move count bytes from src to dst, or all of them up to EOF if count
+        is None, and return how many were moved
+
+        The payload never leaves the kernel: it is spliced into a pipe and
+        from there into dst by a chain, so both happen in one submit. The
+        chain is hard linked, as a soft link would cancel the splice into
+        dst after any short splice into the pipe; that one doesn't wait on
+        the pipe instead and fails with EAGAIN if nothing came in. A short
+        splice into dst leaves the rest in the pipe for the next round.
+        Sockets are polled first, the splices would not wait. file is
+        seeked past what was moved, even if that fails midway.
+        """
+        ring = self._ring
+        start = offset
+        moved = 0
+        rfd, wfd = os.pipe2(os.O_CLOEXEC)
+        try:
+            size = fcntl.fcntl(wfd, fcntl.F_GETPIPE_SZ)
+            queued = 0
+            while count is None or moved < count:
+                chain = self.chain(hard=True)
+                if queued:
+                    chain.add(ring.prep_poll_add, dst, select.POLLOUT)
+                else:
+                    nbytes = size if count is None else min(size, count - moved)
+                    if wait_src:
+                        chain.add(ring.prep_poll_add, src, select.POLLIN)
+                    chain.add(ring.prep_splice, src, offset, wfd, -1, nbytes)
+                chain.add(
+                    ring.prep_splice,
+                    rfd,
+                    -1,
+                    dst,
+                    -1,
+                    queued or nbytes,
+                    os.SPLICE_F_NONBLOCK,
+                )
+                *_, res_in, res_out = await chain.submit()
+
+                if not queued:
+                    if res_in == 0:
+                        break  # EOF
+                    if res_in > 0:
+                        queued = res_in
+                        if offset >= 0:
+                            offset += res_in
+                    elif res_in not in (-errno.EAGAIN, -errno.EINTR):
+                        raise OSError(-res_in, os.strerror(-res_in))
+                if res_out > 0:
+                    queued -= res_out
+                    moved += res_out
+                elif res_out not in (-errno.ECANCELED, -errno.EAGAIN, -errno.EINTR):
+                    raise OSError(-res_out, os.strerror(-res_out))
+            return moved
+        finally:
+            os.close(rfd)
+            os.close(wfd)
+            if file is not None and moved:
+                file.seek(start + moved)
+
+    def sendfile(self, sock, file, offset, count):
+        fd = file.fileno()
+        return self._splice(fd, offset, sock.fileno(), count, False, file)
+
+    def relay(self, src, dst, nbytes=None):
+        if not self._caps.splice:
+            return self._copy(src, dst, nbytes)
+        return self._splice(src.fileno(), -1, dst.fileno(), nbytes, True)
+
+    async def _copy(self, src, dst, nbytes):
+        """relay through a buffer, before IORING_OP_SPLICE in Linux 5.7"""
+        loop = self._loop
+        view = memoryview(bytearray(_COPY_SIZE))
+        moved = 0
+        while nbytes is None or moved < nbytes:
+            size = _COPY_SIZE if nbytes is None else min(_COPY_SIZE, nbytes - moved)
+            received = await loop.sock_recv_into(src, view[:size])
+            if not received:
+                break  # EOF
+            await loop.sock_sendall(dst, view[:received])
+            moved += received
+        return moved
+
+    def chain(self, hard=False):
+        self._check_closed()
+        return UringChain(self, hard)
+
+    def _serve(self, listener):
+        """Accept the connections of a serving listener from its slot in
+        the file table, with a multishot accept where the kernel has it
+        (Linux 5.19)
+        """
+        self._install(listener)
+        if self._caps.multishot_accept:
+            acceptor = _MultishotAccept(self, listener)
+            self._acceptors[listener.fileno()] = acceptor
+
+    def _stop_serving(self, obj):
+        # The loop cancels the pending accept of obj and closes it, the
+        # cancellation is submitted with the next poll
+        acceptor = self._acceptors.pop(obj.fileno(), None)
+        if acceptor is not None and acceptor.listener is obj:
+            acceptor.stop()
+        self._uninstall(obj)
+
+    def close(self):
+        if self._ring is None:
+            # already closed
+            return
+        self._bind()
+        for acceptor in self._acceptors.values():
+            acceptor.stop()
+        self._acceptors.clear()
+
+        # Cancel remaining registered operations and wait for their
+        # completions, the kernel may still write to their buffers.
+        pending = self._ring.pending()
+        cancel_all = len(pending) > 1 and self._caps.cancel_fd
+        if cancel_all:
+            self._queue(self._ring.cancel_all)
+        for user_data, data in pending:
+            if isinstance(data, futures.Future):
+                fut = data
+            else:
+                # Handlers without a future of their own, e.g. accepts
+                fut = getattr(data, "fut", None)
+            if cancel_all:
+                if isinstance(fut, _UringFuture):
+                    fut._user_data = None
+                    fut.cancel()
+            elif fut is None or fut.done():
+                self._cancel(user_data)
+            else:
+                fut.cancel()
+
+        msg_update = 1.0
+        start_time = time.monotonic()
+        next_msg = start_time + msg_update
+        while self._ring.pending():
+            if next_msg <= time.monotonic():
+                logger.debug(
+                    "%r is running after closing for %.1f seconds",
+                    self,
+                    time.monotonic() - start_time,
+                )
+                next_msg = time.monotonic() + msg_update
+
+            self._poll(msg_update)
+
+        if self._files is not None:
+            # Closes the sockets still installed, unless they are open
+            # elsewhere too
+            try:
+                self._ring.unregister_files()
+            except RuntimeError:
+                pass
+            self._files = None
+        self._fixed = None
+        self._waker = None
+        self._poller = None
+        self._ring = None
+
+    def __del__(self):
+        self.close()
+
+
+class _UringSocketTransport(proactor_events._ProactorSocketTransport):
+    def __init__(self, loop, sock, *args, **kwargs):
+        # Its reads and writes go through its slot in the file table
+        loop._proactor._install(sock)
+        super().__init__(loop, sock, *args, **kwargs)
+
+    def _force_close(self, exc):
+        if not self._closing or not self._called_connection_lost:
+            # Both pending operations go with one cancellation
+            futs = (self._read_fut, self._write_fut)
+            self._loop._proactor._cancel_fd(self._sock, futs)
+        super()._force_close(exc)
+
+    def _call_connection_lost(self, exc):
+        if self._called_connection_lost:
+            return
+        try:
+            self._protocol.connection_lost(exc)
+        finally:
+            # The shutdown lets the peer see the end while a cancelled
+            # operation still holds the socket. Unlike on Windows it fails
+            # once the peer is gone.
+            try:
+                self._sock.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+            if self._loop._proactor is not None:
+                self._loop._proactor._uninstall(self._sock)
+            self._sock.close()
+            self._sock = None
+            server = self._server
+            if server is not None:
+                server._detach()
+                self._server = None
+            self._called_connection_lost = True
+
+
+class _UringWritePipeTransport(proactor_events._ProactorBaseWritePipeTransport):
+    """Write end of a pipe, closed once its reader goes away
+
+    Unlike a Windows pipe it can't be read to notice that, a poll waits
+    for the error or hangup instead.
+    """
+
+    def __init__(self, *args, **kw):
+        super().__init__(*args, **kw)
+        self._read_fut = self._loop._proactor.poll(self._sock, 0)
+        self._read_fut.add_done_callback(self._pipe_closed)
+
+    def _pipe_closed(self, fut):
+        if fut.cancelled():
+            # the transport has been closed
+            return
+        if self._closing:
+            assert self._read_fut is None
+            return
+        assert fut is self._read_fut, (fut, self._read_fut)
+        self._read_fut = None
+        if self._write_fut is not None:
+            self._force_close(BrokenPipeError())
+        else:
+            self.close()
+
+
+class UringIOEventLoop(proactor_events.BaseProactorEventLoop):
+    """asyncio equivalent loop based on uring_io
+
+    Ready callbacks run between submissions, and the loop blocks in
+    Ring.submit_and_wait_timeout with the deadline of the next timer as its
+    timeout.
+
+    ring runs the loop on an existing Ring instead of a new one, e.g. a ring
+    of a RingGroup with a loop per worker thread. Work handed off to it with
+    RingGroup.hand_off is called with (res, flags) by the loop.
+
+    Timers live in a TimerWheel with O(1) call_at and cancel instead of a
+    heap. They run at the first millisecond tick at or after their deadline;
+    timer_slack rounds deadlines up to a multiple of it so that timers close
+    to each other run together, at the cost of running up to that late.
+
+    Without flags the ring is set up with the fastest of SINGLE_ISSUER,
+    DEFER_TASKRUN and COOP_TASKRUN the kernel supports, and its fd is
+    registered unless register_ring_fd is False. Both bind the ring to the
+    thread that first runs the loop, which then has to close it too; pass
+    flags=0 and register_ring_fd=False for a loop moving between threads.
+
+    The loop runs on Linux 5.6 and later and uses what the kernel offers,
+    see capabilities(): servers accept with one multishot accept per
+    listener from Linux 5.19 on, and sendfile and relay splice from 5.7 on.
+    Without that they accept one connection at a time and copy the data.
+    From Linux 6.0 on the sockets of its transports and servers are
+    installed in a registered file table of the ring.
+    """
 
     def __init__(
-        entries,
+        self,
+        entries=256,
+        *,
+        sq_entries=0,
+        cq_entries=0,
+        flags=None,
+        sq_thread_cpu=0,
+        sq_thread_idle=0,
+        features=0,
+        wq_fd=0,
+        ring=None,
+        timer_slack=0,
+        register_ring_fd=None,
+    ):
+        if ring is None:
+            if flags is None:
+                flags = _default_setup_flags()
+                if flags & _THREAD_BOUND:
+                    # Bound to the thread running the loop rather than this one
+                    flags |= ring_flags.RING_SETUP_R_DISABLED
+            if register_ring_fd is None:
+                register_ring_fd = True
+            ring = Ring(
+                entries,
+                sq_entries=sq_entries,
+                cq_entries=cq_entries,
+                flags=flags,
+                sq_thread_cpu=sq_thread_cpu,
+                sq_thread_idle=sq_thread_idle,
+                features=features,
+                wq_fd=wq_fd,
+            )
+        self._ring = ring
+        self._timers = TimerWheel(self.time(), slack=timer_slack)
+        proactor = UringProactor(
+            self._ring, self._timers, register_ring_fd=bool(register_ring_fd)
+        )
+        super().__init__(proactor)
+        self._signal_handlers = {}
+        # fd => (handle, future of its poll)
+        self._readers = {}
+        self._writers = {}
+
+    # Signals arrive through the self pipe as on the Unix selector loop, and
+    # Unix sockets and subprocesses only need the transports of this loop
+    add_signal_handler = _UnixLoop.add_signal_handler
+    remove_signal_handler = _UnixLoop.remove_signal_handler
+    _handle_signal = _UnixLoop._handle_signal
+    _check_signal = _UnixLoop._check_signal
+    _process_self_data = _UnixLoop._process_self_data
+    create_unix_connection = _UnixLoop.create_unix_connection
+    create_unix_server = _UnixLoop.create_unix_server
+    _make_subprocess_transport = _UnixLoop._make_subprocess_transport
+    _child_watcher_callback = _UnixLoop._child_watcher_callback
+
+    def _watch(self, watchers, fd, events, handle):
+        """Run handle each time fd is ready for events, until it is removed
+
+        A one shot poll is queued again before each run, so the callback
+        sees level triggered readiness like with a selector.
+        """
+
+        def ready(fut):
+            if watchers.get(fd, (None,))[0] is not handle:
+                return
+            if fut.exception() is not None:
+                # e.g. the descriptor has been closed meanwhile
+                del watchers[fd]
+                return
+            self._watch(watchers, fd, events, handle)
+            handle._run()
+
+        fut = self._proactor.poll(fd, events)
+        fut.add_done_callback(ready)
+        watchers[fd] = (handle, fut)
+
+    def _unwatch(self, watchers, fd):
+        entry = watchers.pop(fd, None)
+        if entry is None:
+            return False
+        handle, fut = entry
+        handle.cancel()
+        fut.cancel()
+        return True
+
+    def _add_reader(self, fd, callback, *args):
+        self._check_closed()
+        self._unwatch(self._readers, fd)
+        handle = events.Handle(callback, args, self, None)
+        self._watch(self._readers, fd, select.POLLIN, handle)
+        return handle
+
+    def _remove_reader(self, fd):
+        if self.is_closed():
+            return False
+        return self._unwatch(self._readers, fd)
+
+    def _add_writer(self, fd, callback, *args):
+        self._check_closed()
+        self._unwatch(self._writers, fd)
+        handle = events.Handle(callback, args, self, None)
+        self._watch(self._writers, fd, select.POLLOUT, handle)
+        return handle
+
+    def _remove_writer(self, fd):
+        if self.is_closed():
+            return False
+        return self._unwatch(self._writers, fd)
+
+    def add_reader(self, fd, callback, *args):
+        """Add a reader callback."""
+        return self._add_reader(selectors._fileobj_to_fd(fd), callback, *args)
+
+    def remove_reader(self, fd):
+        """Remove a reader callback."""
+        return self._remove_reader(selectors._fileobj_to_fd(fd))
+
+    def add_writer(self, fd, callback, *args):
+        """Add a writer callback."""
+        return self._add_writer(selectors._fileobj_to_fd(fd), callback, *args)
+
+    def remove_writer(self, fd):
+        """Remove a writer callback."""
+        return self._remove_writer(selectors._fileobj_to_fd(fd))
+
+    def call_at(self, when, callback, *args, context=None):
+        if when is None:
+            raise TypeError("when cannot be None")
+        self._check_closed()
+        if self._debug:
+            self._check_thread()
+            self._check_callback(callback, "call_at")
+        timer = _WheelTimerHandle(when, callback, args, self, context)
+        if timer._source_traceback:
+            del timer._source_traceback[-1]
+        timer._timer_id = self._timers.add(when, timer)
+        timer._scheduled = True
+        return timer
+
+    def _timer_handle_cancelled(self, handle):
+        # Out of the wheel right away, there is no heap to clean up later
+        if handle._scheduled:
+            self._timers.remove(handle._timer_id)
+            handle._scheduled = False
+
+    def _process_events(self, event_list):
+        # The events of the proactor are the timers that expired
+        for handle in event_list:
+            handle._scheduled = False
+            self._ready.append(handle)
+
+    def _write_to_self(self):
+        # call_soon_threadsafe posts a completion into the ring instead of
+        # a byte through the self pipe, which the loop had to read back.
+        # Signals still come through the pipe.
+        proactor = self._proactor
+        if proactor is None or not proactor.wakeup():
+            super()._write_to_self()
+
+    def _loop_self_reading(self, f=None):
+        if f is not None and not f.cancelled() and f.exception() is None:
+            self._process_self_data(f.result())
+        super()._loop_self_reading(f)
+
+    def run_forever(self):
+        if self._proactor is not None:
+            self._proactor._bind()
+        try:
+            assert self._self_reading_future is None
+            self.call_soon(self._loop_self_reading)
+            super().run_forever()
+        finally:
+            if self._self_reading_future is not None:
+                # Its cancelled recv completes on the next poll, at the
+                # latest when the proactor is closed
+                self._self_reading_future.cancel()
+                self._self_reading_future = None
+
+    def _start_serving(self, protocol_factory, sock, *args, **kwargs):
+        self._proactor._serve(sock)
+        super()._start_serving(protocol_factory, sock, *args, **kwargs)
+
+    async def _sock_sendfile_native(self, sock, file, offset, count):
+        if not self._proactor._caps.splice:
+            # sock_sendfile copies the file through sock_sendall instead
+            raise exceptions.SendfileNotAvailableError("no IORING_OP_SPLICE")
+        return await super()._sock_sendfile_native(sock, file, offset, count)
+
+    def _make_socket_transport(
+        self, sock, protocol, waiter=None, extra=None, server=None
+    ):
+        return _UringSocketTransport(self, sock, protocol, waiter, extra, server)
+
+    def _make_ssl_transport(
+        self,
+        rawsock,
+        protocol,
+        sslcontext,
+        waiter=None,
         *,
-        sq_entries,
-        cq_entries,
-        flags,
-        sq_thread_cpu,
-        sq_thread_idle,
-        features,
-        wq_fd
+        server_side=False,
+        server_hostname=None,
+        extra=None,
+        server=None,
+        ssl_handshake_timeout=None,
+        ssl_shutdown_timeout=None,
     ):
-        super().__init__()
-        self._ring = Ring(
-            entries=entries,
-            sq_entries=sq_entries,
-            cq_entries=cq_entries,
-            flags=flags,
-            sq_thread_cpu=sq_thread_cpu,
-            sq_thread_idle=sq_thread_idle,
-            features=features,
-            wq_fd=wq_fd,
+        ssl_protocol = sslproto.SSLProtocol(
+            self,
+            protocol,
+            sslcontext,
+            waiter,
+            server_side,
+            server_hostname,
+            ssl_handshake_timeout=ssl_handshake_timeout,
+            ssl_shutdown_timeout=ssl_shutdown_timeout,
         )
-        self._running = False
+        _UringSocketTransport(self, rawsock, ssl_protocol, extra=extra, server=server)
+        return ssl_protocol._app_transport
+
+    def _make_write_pipe_transport(self, sock, protocol, waiter=None, extra=None):
+        return _UringWritePipeTransport(self, sock, protocol, waiter, extra)
+
+    async def sock_connect(self, sock, address):
+        # The ring only takes numeric addresses
+        if sock.family == socket.AF_INET or (
+            base_events._HAS_IPv6 and sock.family == socket.AF_INET6
+        ):
+            resolved = await self._ensure_resolved(
+                address,
+                family=sock.family,
+                type=sock.type,
+                proto=sock.proto,
+                loop=self,
+            )
+            _, _, _, _, address = resolved[0]
+        return await self._proactor.connect(sock, address)
+
+    async def file_open(self, path, flags=os.O_RDONLY, mode=0o644, *, dir_fd=None):
+        """Open path like os.open and return the file descriptor"""
+        if dir_fd is None:
+            dir_fd = ring_flags.AT_FDCWD
+        return await self._proactor.file_open(path, flags, mode, dir_fd)
+
+    async def file_read(self, fd, size, offset=-1):
+        """Read up to size bytes at offset, -1 reads at the file position
+
+        fd may also be a FixedFile of a FileTable of the ring.
+        """
+        return await self._proactor.file_read(fd, size, offset)
+
+    async def file_readinto(self, fd, buf, offset=-1):
+        """Read into buf at offset and return the number of bytes read"""
+        return await self._proactor.file_readinto(fd, buf, offset)
+
+    async def file_write(self, fd, buf, offset=-1):
+        """Write buf at offset and return the number of bytes written
+
+        A write can be short like os.pwrite, e.g. on a full disk.
+        """
+        return await self._proactor.file_write(fd, buf, offset)
+
+    async def file_fsync(self, fd, datasync=False):
+        flags = ring_flags.FSYNC_DATASYNC if datasync else 0
+        await self._proactor.file_fsync(fd, flags)
+
+    async def file_fallocate(self, fd, offset, length, mode=0):
+        """Allocate disk space like os.posix_fallocate, mode as fallocate(2)"""
+        await self._proactor.file_fallocate(fd, mode, offset, length)
+
+    async def file_statx(
+        self,
+        path,
+        *,
+        dir_fd=None,
+        follow_symlinks=True,
+        mask=ring_flags.STATX_BASIC_STATS,
+    ):
+        """Stat path, or the file descriptor path, into an os.stat_result"""
+        flags = 0 if follow_symlinks else ring_flags.AT_SYMLINK_NOFOLLOW
+        if isinstance(path, int):
+            dir_fd, path = path, ""
+            flags |= ring_flags.AT_EMPTY_PATH
+        elif dir_fd is None:
+            dir_fd = ring_flags.AT_FDCWD
+        return await self._proactor.file_statx(dir_fd, path, flags, mask)
+
+    async def file_close(self, fd):
+        await self._proactor.file_close(fd)
+
+    def chain(self, hard=False):
+        """Start an UringChain of operations linked in the kernel
+
+        E.g. a small file is read in a single iteration by a hard linked
+        chain of prep_openat_direct into a slot of a FileTable, then
+        prep_read and prep_close of that FixedFile. Hard links close the
+        file after a short read too.
+        """
+        return self._proactor.chain(hard)
+
+    async def sock_sendall_zc(self, sock, data):
+        """Send all of data without copying it to the socket buffers
+
+        Pays off for large payloads, from about 64KB on. data must not be
+        modified until the kernel released it: that is when the future
+        returned after the send is done. Before Linux 6.0 data is copied by
+        sock_sendall, and released right away.
+        """
+        if not self._proactor._caps.send_zc:
+            await self.sock_sendall(sock, data)
+            released = self.create_future()
+            released.set_result(None)
+            return released
+        fut = self._proactor.send_zc(sock, data)
+        await fut
+        return fut.released
+
+    async def relay(self, src, dst, nbytes=None):
+        """Move data from socket src to socket dst until src reaches EOF or
+        nbytes were moved, and return how many bytes were moved
+
+        The data is spliced on the ring and never copied to Python, or copied
+        through a buffer before Linux 5.7. dst isn't shut down at EOF.
+        """
+        return await self._proactor.relay(src, dst, nbytes)
+
+    def close(self):
+        if self._proactor is not None and not self.is_running():
+            # A ring bound to another thread fails here, before anything
+            # is closed
+            self._proactor._bind()
+        super().close()
+        self._timers.clear()
+        self._ring = None
+        if not sys.is_finalizing():
+            for sig in list(self._signal_handlers):
+                self.remove_signal_handler(sig)
+        else:
+            self._signal_handlers.clear()
+
 
-    def run_forever():
-        ...
+class EventLoopPolicy(unix_events.DefaultEventLoopPolicy):
+    """Event loop policy creating UringIOEventLoop instances"""
 
-    async def getaddrinfo():
-        ...
+    _loop_factory = UringIOEventLoop
@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 2021 Reza Mahdi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Provided buffer rings.
+ *
+ * A BufferRing owns one arena split in equally sized buffers and registers
+ * them with the kernel as a buffer group. Operations queued with buffer
+ * select pick a free buffer when data arrives, so idle connections don't
+ * hold any memory. The buffer id of a completion is turned into a
+ * memoryview over the arena by get(); the buffer goes back to the kernel
+ * once that view is released.
+ *
+ * Each buffer is owned by the kernel until a completion of an operation
+ * selecting from the pool reports it, then by the caller until it is viewed
+ * and released or recycled. Only such a completed buffer can be taken, so
+ * a buffer is never in the ring twice.
+ */
+
+#include <liburing.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "uring.h"
+
+extern PyTypeObject ring_type;
+
+/* Exporter of a single buffer of the arena, handed out in a memoryview */
+typedef struct {
+  PyObject_HEAD BufferRing *pool;
+  unsigned short bid;
+  Py_ssize_t len;
+} Buffer;
+
+static PyTypeObject buffer_type;
+
+enum {
+  BUFFER_KERNEL,    /* in the buffer ring, for the kernel to pick */
+  BUFFER_COMPLETED, /* reported by a completion, not taken yet */
+  BUFFER_LENT,      /* viewed through a Buffer */
+};
+
+/* Give a buffer back to the kernel */
+static void buffer_ring_recycle(BufferRing *pool, unsigned short bid) {
+  pool->state[bid] = BUFFER_KERNEL;
+  io_uring_buf_ring_add(pool->br, pool->arena + (size_t)bid * pool->size,
+                        pool->size, bid, io_uring_buf_ring_mask(pool->count),
+                        0);
+  io_uring_buf_ring_advance(pool->br, 1);
+}
+
+static int BufferGetBuffer(PyObject *self, Py_buffer *view, int flags) {
+  Buffer *buf = (Buffer *)self;
+  char *addr = buf->pool->arena + (size_t)buf->bid * buf->pool->size;
+  return PyBuffer_FillInfo(view, self, addr, buf->len, 0, flags);
+}
+
+static void BufferDestructor(PyObject *self) {
+  Buffer *buf = (Buffer *)self;
+  buffer_ring_recycle(buf->pool, buf->bid);
+  Py_DECREF(buf->pool);
+  Py_TYPE(self)->tp_free(self);
+}
+
+static PyBufferProcs buffer_as_buffer = {BufferGetBuffer, NULL};
+
+static PyTypeObject buffer_type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0) "_uring_io.Buffer", /* tp_name */
+    sizeof(Buffer),                   /* tp_basicsize */
+    0,                                /* tp_itemsize */
+    (destructor)BufferDestructor,     /* tp_dealloc */
+    0,                                /* tp_print */
+    0,                                /* tp_getattr */
+    0,                                /* tp_setattr */
+    0,                                /* tp_reserved */
+    0,                                /* tp_repr */
+    0,                                /* tp_as_number */
+    0,                                /* tp_as_sequence */
+    0,                                /* tp_as_mapping */
+    0,                                /* tp_hash */
+    0,                                /* tp_call */
+    0,                                /* tp_str */
+    0,                                /* tp_getattro */
+    0,                                /* tp_setattro */
+    &buffer_as_buffer,                /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,               /* tp_flags */
+    "Buffer of a BufferRing, recycled when released", /* tp_doc */
+};
+
+/////////////////////// BufferRing
+
+static char *buffer_ring_kwds[] = {"ring", "group", "count", "size", NULL};
+
+int BufferRingInit(PyObject *self, PyObject *args, PyObject *kwds) {
+  BufferRing *pool = (BufferRing *)self;
+  Ring *ring;
+  unsigned short group;
+  unsigned int count, size;
+  int err;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!HII", buffer_ring_kwds,
+                                   &ring_type, &ring, &group, &count, &size))
+    return -1;
+
+  if (pool->state != NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "BufferRing is already set up");
+    return -1;
+  }
+  if (count == 0 || count > 32768 || (count & (count - 1)) != 0) {
+    PyErr_SetString(PyExc_ValueError,
+                    "count must be a power of 2 of at most 32768");
+    return -1;
+  }
+  if (size == 0) {
+    PyErr_SetString(PyExc_ValueError, "size must be positive");
+    return -1;
+  }
+
+  pool->group = group;
+  pool->count = count;
+  pool->size = size;
+  /* BUFFER_KERNEL is 0 */
+  pool->state = PyMem_Calloc(count, 1);
+  if (pool->state == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  pool->arena = mmap(NULL, (size_t)count * size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (pool->arena == MAP_FAILED) {
+    pool->arena = NULL;
+    PyErr_SetFromErrno(PyExc_OSError);
+    return -1;
+  }
+
+  pool->br = io_uring_setup_buf_ring(&ring->ring, count, group, 0, &err);
+  if (pool->br == NULL) {
+    PyErr_SetString(PyExc_RuntimeError, strerror(-err));
+    return -1;
+  }
+
+  Py_INCREF(ring);
+  pool->ring = ring;
+
+  unsigned int mask = io_uring_buf_ring_mask(count);
+  for (unsigned int bid = 0; bid < count; bid++)
+    io_uring_buf_ring_add(pool->br, pool->arena + (size_t)bid * size, size,
+                          bid, mask, bid);
+  io_uring_buf_ring_advance(pool->br, count);
+  return 0;
+}
+
+/*
+ * The completion entry reports a buffer selected from the pool held by its
+ * operation, which the caller owns from now on. Called as completions are
+ * taken from the CQ.
+ */
+void buffer_ring_completed(Ring *ring, struct io_uring_cqe *entry) {
+  if (!(entry->flags & IORING_CQE_F_BUFFER)) return;
+
+  token_slot *slot = token_slot_of(&ring->tokens, entry->user_data);
+  if (slot == NULL || slot->keep == NULL ||
+      !PyObject_TypeCheck(slot->keep, &buffer_ring_type))
+    return;
+  BufferRing *pool = (BufferRing *)slot->keep;
+  unsigned int bid = entry->flags >> IORING_CQE_BUFFER_SHIFT;
+  if (bid < pool->count && pool->state[bid] == BUFFER_KERNEL)
+    pool->state[bid] = BUFFER_COMPLETED;
+}
+
+/* The caller owns buffer bid, or an error is set */
+static int buffer_ring_check(BufferRing *pool, unsigned short bid) {
+  if (bid >= pool->count) {
+    PyErr_Format(PyExc_IndexError, "no buffer with id %u", bid);
+    return -1;
+  }
+  if (pool->state[bid] == BUFFER_LENT) {
+    PyErr_Format(PyExc_ValueError, "buffer %u is still viewed", bid);
+    return -1;
+  }
+  if (pool->state[bid] != BUFFER_COMPLETED) {
+    PyErr_Format(PyExc_ValueError, "buffer %u is owned by the kernel", bid);
+    return -1;
+  }
+  return 0;
+}
+
+/* Take the buffer of a completion as a memoryview of its first nbytes */
+PyObject *BufferRingGet(PyObject *self, PyObject *args) {
+  BufferRing *pool = (BufferRing *)self;
+  unsigned short bid;
+  Py_ssize_t nbytes = -1;
+
+  if (!PyArg_ParseTuple(args, "H|n:get", &bid, &nbytes)) return NULL;
+  if (buffer_ring_check(pool, bid) < 0) return NULL;
+  if (nbytes < 0 || nbytes > pool->size) nbytes = pool->size;
+
+  Buffer *buf = PyObject_New(Buffer, &buffer_type);
+  if (buf == NULL) return NULL;
+  Py_INCREF(pool);
+  buf->pool = pool;
+  buf->bid = bid;
+  buf->len = nbytes;
+  pool->state[bid] = BUFFER_LENT;
+
+  /* the memoryview holds the only reference to buf */
+  PyObject *view = PyMemoryView_FromObject((PyObject *)buf);
+  Py_DECREF(buf);
+  return view;
+}
+
+/* Give a buffer back without taking a view of it */
+PyObject *BufferRingRecycle(PyObject *self, PyObject *args) {
+  BufferRing *pool = (BufferRing *)self;
+  unsigned short bid;
+
+  if (!PyArg_ParseTuple(args, "H:recycle", &bid)) return NULL;
+  if (buffer_ring_check(pool, bid) < 0) return NULL;
+
+  buffer_ring_recycle(pool, bid);
+  Py_RETURN_NONE;
+}
+
+void BufferRingDestructor(PyObject *self) {
+  BufferRing *pool = (BufferRing *)self;
+  if (pool->br != NULL)
+    io_uring_free_buf_ring(&pool->ring->ring, pool->br, pool->count,
+                           pool->group);
+  if (pool->arena != NULL)
+    munmap(pool->arena, (size_t)pool->count * pool->size);
+  PyMem_Free(pool->state);
+  Py_XDECREF(pool->ring);
+  Py_TYPE(self)->tp_free(self);
+}
+
+static PyMemberDef buffer_ring_members[] = {
+    {"group", T_USHORT, offsetof(BufferRing, group), READONLY,
+     "Buffer group id to select from"},
+    {"count", T_UINT, offsetof(BufferRing, count), READONLY,
+     "Number of buffers"},
+    {"size", T_UINT, offsetof(BufferRing, size), READONLY,
+     "Size of each buffer"},
+    {NULL, 0, 0, 0, NULL}};
+
+static PyMethodDef buffer_ring_methods[] = {
+    {"get", BufferRingGet, METH_VARARGS,
+     "get(bid, nbytes=-1)\n\n"
+     "Memoryview of the first nbytes of buffer bid, as reported by\n"
+     "CQE.buffer_id. The buffer is recycled once the view is released"},
+    {"recycle", BufferRingRecycle, METH_VARARGS,
+     "recycle(bid)\n\nGive buffer bid back to the kernel without a view. Only\n"
+     "a buffer reported by a completion and not given back yet can be"},
+    {NULL, NULL, 0, NULL}};
+
+PyTypeObject buffer_ring_type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0) "_uring_io.BufferRing", /* tp_name */
+    sizeof(BufferRing),                   /* tp_basicsize */
+    0,                                    /* tp_itemsize */
+    (destructor)BufferRingDestructor,     /* tp_dealloc */
+    0,                                    /* tp_print */
+    0,                                    /* tp_getattr */
+    0,                                    /* tp_setattr */
+    0,                                    /* tp_reserved */
+    0,                                    /* tp_repr */
+    0,                                    /* tp_as_number */
+    0,                                    /* tp_as_sequence */
+    0,                                    /* tp_as_mapping */
+    0,                                    /* tp_hash */
+    0,                                    /* tp_call */
+    0,                                    /* tp_str */
+    0,                                    /* tp_getattro */
+    0,                                    /* tp_setattro */
+    0,                                    /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                   /* tp_flags */
+    "Pool of provided buffers for buffer select", /* tp_doc */
+    (traverseproc)NULL,                   /* tp_traverse */
+    (inquiry)NULL,                        /* tp_clear */
+    0,                                    /* tp_richcompare */
+    0,                                    /* tp_weaklistoffset */
+    0,                                    /* tp_iter */
+    0,                                    /* tp_iternext */
+    buffer_ring_methods,                  /* tp_methods */
+    buffer_ring_members,                  /* tp_members */
+    0,                                    /* tp_getset */
+    0,                                    /* tp_base */
+    0,                                    /* tp_dict */
+    0,                                    /* tp_descr_get */
+    0,                                    /* tp_descr_set */
+    0,                                    /* tp_dictoffset */
+    BufferRingInit,                       /* tp_init */
+    PyType_GenericAlloc,                  /* tp_alloc */
+    PyType_GenericNew,                    /* tp_new */
+};
+
+extern void register_buffer_ring(PyObject *mod) {
+  if (PyType_Ready(&buffer_type) < 0) return;
+  if (PyType_Ready(&buffer_ring_type) < 0) return;
+  Py_INCREF(&buffer_ring_type);
+  if (PyModule_AddObject(mod, "BufferRing", (PyObject *)&buffer_ring_type) < 0)
+    Py_DECREF(&buffer_ring_type);
+}
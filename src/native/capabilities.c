@@ -0,0 +1,356 @@
+/*
+ * Copyright (c) 2021 Reza Mahdi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * What the running kernel supports, detected once per process.
+ *
+ * A throwaway ring gives the features field of its setup and the opcode
+ * probe, and rings set up disabled with each of the newer setup flags tell
+ * which of those the kernel takes. Abilities that have neither an opcode nor
+ * a feature bit of their own, such as multishot accept or cancelling by
+ * descriptor, are derived from an opcode added in the same release.
+ */
+
+#include <liburing.h>
+#include <errno.h>
+#include <liburing/io_uring.h>
+#include <string.h>
+#include <sys/utsname.h>
+
+#include "uring.h"
+
+#define CAPS_OPS 256
+
+typedef struct {
+  PyObject_HEAD PyObject *kernel; /* release string of uname */
+  int available;                  /* a ring can be set up at all */
+  int error;                      /* errno of the setup otherwise */
+  int probed;                     /* the opcode probe worked, Linux 5.6 */
+  unsigned int features;          /* IORING_FEAT_* of a ring */
+  unsigned int setup_flags;       /* IORING_SETUP_* the kernel accepts */
+  int last_op;
+  unsigned char ops[CAPS_OPS];
+} Capabilities;
+
+static PyTypeObject capabilities_type;
+
+static Capabilities *caps_cached;
+
+/* Setup flags to try, each with the ones it depends on */
+static const unsigned int caps_setup_flags[] = {
+    IORING_SETUP_SUBMIT_ALL,
+    IORING_SETUP_COOP_TASKRUN,
+    IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG,
+    IORING_SETUP_SINGLE_ISSUER,
+    IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+};
+
+static int caps_try_setup(unsigned int flags) {
+  struct io_uring ring;
+  struct io_uring_params params;
+
+  memset(&params, 0, sizeof(params));
+  params.flags = flags | IORING_SETUP_R_DISABLED;
+  if (io_uring_queue_init_params(1, &ring, &params) < 0) return 0;
+  io_uring_queue_exit(&ring);
+  return 1;
+}
+
+static void caps_detect(Capabilities *caps) {
+  struct io_uring ring;
+  struct io_uring_params params;
+
+  memset(&params, 0, sizeof(params));
+  int err = io_uring_queue_init_params(2, &ring, &params);
+  if (err < 0) {
+    /* ENOSYS before Linux 5.1, EPERM when disabled by sysctl or seccomp */
+    caps->error = -err;
+    return;
+  }
+  caps->available = 1;
+  caps->features = params.features;
+
+  struct io_uring_probe *probe = io_uring_get_probe_ring(&ring);
+  if (probe != NULL) {
+    caps->probed = 1;
+    caps->last_op = probe->last_op;
+    for (int op = 0; op <= probe->last_op && op < CAPS_OPS; op++)
+      caps->ops[op] = io_uring_opcode_supported(probe, op);
+    io_uring_free_probe(probe);
+  }
+  io_uring_queue_exit(&ring);
+
+  for (size_t i = 0; i < sizeof(caps_setup_flags) / sizeof(unsigned int); i++)
+    if (caps_try_setup(caps_setup_flags[i]))
+      caps->setup_flags |= caps_setup_flags[i];
+}
+
+/* The capabilities of this kernel, detected on the first call, borrowed */
+static Capabilities *caps_get(void) {
+  if (caps_cached == NULL) {
+    Capabilities *caps = PyObject_New(Capabilities, &capabilities_type);
+    if (caps == NULL) return NULL;
+    caps->available = caps->error = caps->probed = 0;
+    caps->features = caps->setup_flags = 0;
+    caps->last_op = -1;
+    memset(caps->ops, 0, sizeof(caps->ops));
+
+    struct utsname name;
+    caps->kernel = PyUnicode_FromString(uname(&name) == 0 ? name.release : "");
+    if (caps->kernel == NULL) {
+      Py_DECREF(caps);
+      return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS;
+    caps_detect(caps);
+    Py_END_ALLOW_THREADS;
+
+    if (caps_cached == NULL)
+      caps_cached = caps;
+    else
+      /* Another thread got there while this one probed */
+      Py_DECREF(caps);
+  }
+  return caps_cached;
+}
+
+PyObject *capabilities(PyObject *self, PyObject *args) {
+  (void)self;
+  (void)args;
+  Capabilities *caps = caps_get();
+  if (caps == NULL) return NULL;
+  Py_INCREF(caps);
+  return (PyObject *)caps;
+}
+
+/* io_uring with a working opcode probe, Linux 5.6 */
+PyObject *capabilities_supported(PyObject *self, PyObject *args) {
+  (void)self;
+  (void)args;
+  Capabilities *caps = caps_get();
+  if (caps == NULL) return NULL;
+  return PyBool_FromLong(caps->available && caps->probed);
+}
+
+PyObject *capabilities_probe(PyObject *self, PyObject *args) {
+  (void)self;
+  (void)args;
+  Capabilities *caps = caps_get();
+  if (caps == NULL) return NULL;
+  if (!caps->probed) {
+    PyErr_SetString(PyExc_RuntimeError,
+                    caps->available ? strerror(EINVAL) : strerror(caps->error));
+    return NULL;
+  }
+  return PyLong_FromLong(caps->last_op);
+}
+
+static int caps_op(Capabilities *caps, long op) {
+  return op >= 0 && op < CAPS_OPS && caps->ops[op];
+}
+
+PyObject *CapabilitiesSupports(PyObject *self, PyObject *args) {
+  long op;
+  if (!PyArg_ParseTuple(args, "l:supports", &op)) return NULL;
+  return PyBool_FromLong(caps_op((Capabilities *)self, op));
+}
+
+PyObject *capabilities_opcode_supported(PyObject *self, PyObject *args) {
+  (void)self;
+  long op;
+  if (!PyArg_ParseTuple(args, "l", &op)) return NULL;
+  Capabilities *caps = caps_get();
+  if (caps == NULL) return NULL;
+  return PyBool_FromLong(caps_op(caps, op));
+}
+
+/* Abilities derived from a feature bit or an opcode, by getset closure */
+enum {
+  CAPS_EXT_ARG,
+  CAPS_CQE_SKIP,
+  CAPS_FAST_POLL,
+  CAPS_MSG_RING,
+  CAPS_REGISTER_RING_FD,
+  CAPS_MULTISHOT_ACCEPT,
+  CAPS_CANCEL_FD,
+  CAPS_BUFFER_RING,
+  CAPS_MULTISHOT_RECV,
+  CAPS_SEND_ZC,
+  CAPS_FIXED_FILES,
+  CAPS_SPLICE,
+};
+
+static PyObject *CapabilitiesGetAbility(PyObject *self, void *closure) {
+  Capabilities *caps = (Capabilities *)self;
+  int result = 0;
+
+  switch ((int)(intptr_t)closure) {
+    case CAPS_EXT_ARG:
+      result = caps->features & IORING_FEAT_EXT_ARG;
+      break;
+    case CAPS_CQE_SKIP:
+      result = caps->features & IORING_FEAT_CQE_SKIP;
+      break;
+    case CAPS_FAST_POLL:
+      result = caps->features & IORING_FEAT_FAST_POLL;
+      break;
+    case CAPS_MSG_RING:
+    case CAPS_REGISTER_RING_FD:
+      /* Both came with Linux 5.18 */
+      result = caps_op(caps, IORING_OP_MSG_RING);
+      break;
+    case CAPS_MULTISHOT_ACCEPT:
+    case CAPS_CANCEL_FD:
+    case CAPS_BUFFER_RING:
+      /* All came with IORING_OP_SOCKET in Linux 5.19 */
+      result = caps_op(caps, IORING_OP_SOCKET);
+      break;
+    case CAPS_MULTISHOT_RECV:
+    case CAPS_SEND_ZC:
+    case CAPS_FIXED_FILES:
+      /* All came with Linux 6.0 */
+      result = caps_op(caps, IORING_OP_SEND_ZC);
+      break;
+    case CAPS_SPLICE:
+      result = caps_op(caps, IORING_OP_SPLICE);
+      break;
+  }
+  return PyBool_FromLong(result);
+}
+
+static PyObject *CapabilitiesGetAvailable(PyObject *self, void *closure) {
+  (void)closure;
+  return PyBool_FromLong(((Capabilities *)self)->available);
+}
+
+static PyObject *CapabilitiesRepr(PyObject *self) {
+  Capabilities *caps = (Capabilities *)self;
+  if (!caps->available)
+    return PyUnicode_FromFormat("<Capabilities kernel=%U unavailable: %s>",
+                                caps->kernel, strerror(caps->error));
+  return PyUnicode_FromFormat(
+      "<Capabilities kernel=%U last_op=%d features=0x%x setup_flags=0x%x>",
+      caps->kernel, caps->last_op, caps->features, caps->setup_flags);
+}
+
+void CapabilitiesDestructor(PyObject *self) {
+  Py_XDECREF(((Capabilities *)self)->kernel);
+  Py_TYPE(self)->tp_free(self);
+}
+
+#define CAPS_ABILITY(name, ability, doc) \
+  {name, CapabilitiesGetAbility, NULL, doc, (void *)(intptr_t)(ability)}
+
+static PyGetSetDef capabilities_getset[] = {
+    {"available", CapabilitiesGetAvailable, NULL,
+     "Whether a ring can be set up at all", NULL},
+    CAPS_ABILITY("ext_arg", CAPS_EXT_ARG,
+                 "Waits take their timeout directly, Linux 5.11"),
+    CAPS_ABILITY("cqe_skip", CAPS_CQE_SKIP,
+                 "SQE_CQE_SKIP_SUCCESS is honoured, Linux 5.17"),
+    CAPS_ABILITY("fast_poll", CAPS_FAST_POLL,
+                 "Socket operations poll internally, Linux 5.7"),
+    CAPS_ABILITY("msg_ring", CAPS_MSG_RING, "OP_MSG_RING, Linux 5.18"),
+    CAPS_ABILITY("register_ring_fd", CAPS_REGISTER_RING_FD,
+                 "Ring.register_ring_fd, Linux 5.18"),
+    CAPS_ABILITY("multishot_accept", CAPS_MULTISHOT_ACCEPT,
+                 "prep_multishot_accept, Linux 5.19"),
+    CAPS_ABILITY("cancel_fd", CAPS_CANCEL_FD,
+                 "ASYNC_CANCEL_FD, _ANY and _ALL, Linux 5.19"),
+    CAPS_ABILITY("buffer_ring", CAPS_BUFFER_RING, "BufferRing, Linux 5.19"),
+    CAPS_ABILITY("multishot_recv", CAPS_MULTISHOT_RECV,
+                 "prep_recv_multishot, Linux 6.0"),
+    CAPS_ABILITY("send_zc", CAPS_SEND_ZC, "OP_SEND_ZC, Linux 6.0"),
+    CAPS_ABILITY("fixed_files", CAPS_FIXED_FILES,
+                 "Sparse file tables, cancelled by slot, Linux 6.0"),
+    CAPS_ABILITY("splice", CAPS_SPLICE, "OP_SPLICE, Linux 5.7"),
+    {NULL, NULL, NULL, NULL, NULL}};
+
+static PyMemberDef capabilities_members[] = {
+    {"kernel", T_OBJECT, offsetof(Capabilities, kernel), READONLY,
+     "Release of the running kernel"},
+    {"error", T_INT, offsetof(Capabilities, error), READONLY,
+     "errno of setting up a ring when it is not available"},
+    {"probed", T_BOOL, offsetof(Capabilities, probed), READONLY,
+     "Whether the kernel answers the opcode probe, Linux 5.6"},
+    {"features", T_UINT, offsetof(Capabilities, features), READONLY,
+     "IORING_FEAT_* flags of a ring"},
+    {"setup_flags", T_UINT, offsetof(Capabilities, setup_flags), READONLY,
+     "RING_SETUP_* flags of Linux 5.18 and later the kernel accepts"},
+    {"last_op", T_INT, offsetof(Capabilities, last_op), READONLY,
+     "Last opcode the kernel knows, -1 without a probe"},
+    {NULL, 0, 0, 0, NULL}};
+
+static PyMethodDef capabilities_methods[] = {
+    {"supports", CapabilitiesSupports, METH_VARARGS,
+     "supports(opcode)\n\nWhether the kernel supports opcode"},
+    {NULL, NULL, 0, NULL}};
+
+static PyTypeObject capabilities_type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0) "_uring_io.Capabilities", /* tp_name */
+    sizeof(Capabilities),                /* tp_basicsize */
+    0,                                   /* tp_itemsize */
+    (destructor)CapabilitiesDestructor,  /* tp_dealloc */
+    0,                                   /* tp_print */
+    0,                                   /* tp_getattr */
+    0,                                   /* tp_setattr */
+    0,                                   /* tp_reserved */
+    CapabilitiesRepr,                    /* tp_repr */
+    0,                                   /* tp_as_number */
+    0,                                   /* tp_as_sequence */
+    0,                                   /* tp_as_mapping */
+    0,                                   /* tp_hash */
+    0,                                   /* tp_call */
+    0,                                   /* tp_str */
+    0,                                   /* tp_getattro */
+    0,                                   /* tp_setattro */
+    0,                                   /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                  /* tp_flags */
+    "What the running kernel supports, as returned by capabilities().\n"
+    "Computed once per process", /* tp_doc */
+    (traverseproc)NULL,                  /* tp_traverse */
+    (inquiry)NULL,                       /* tp_clear */
+    0,                                   /* tp_richcompare */
+    0,                                   /* tp_weaklistoffset */
+    0,                                   /* tp_iter */
+    0,                                   /* tp_iternext */
+    capabilities_methods,                /* tp_methods */
+    capabilities_members,                /* tp_members */
+    capabilities_getset,                 /* tp_getset */
+    0,                                   /* tp_base */
+    0,                                   /* tp_dict */
+    0,                                   /* tp_descr_get */
+    0,                                   /* tp_descr_set */
+    0,                                   /* tp_dictoffset */
+    0,                                   /* tp_init */
+    0,                                   /* tp_alloc */
+    0,                                   /* tp_new */
+};
+
+extern void register_capabilities(PyObject *mod) {
+  if (PyType_Ready(&capabilities_type) < 0) return;
+  Py_INCREF(&capabilities_type);
+  if (PyModule_AddObject(mod, "Capabilities",
+                         (PyObject *)&capabilities_type) < 0)
+    Py_DECREF(&capabilities_type);
+}
@@ -0,0 +1,322 @@
+/*
+ * Copyright (c) 2021 Reza Mahdi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * Linked operation chains.
+ *
+ * A Chain collects operations like submit_batch does and queues them as one
+ * linked sequence: each entry only starts once the one before it completed.
+ * With soft links a failed or short step ends the chain and the steps after
+ * it complete with -ECANCELED, hard links carry on regardless. A link
+ * timeout limits the step added right before it.
+ *
+ * The entries of a chain have to be adjacent in the SQ and reach the kernel
+ * in a single submit, so the sq_lock is held across all of them.
+ */
+
+#include <liburing.h>
+#include <string.h>
+
+#include "uring.h"
+
+typedef struct {
+  PyObject_HEAD Ring *ring;
+  PyObject *steps; /* list of (opcode, prep_args, data) */
+  char hard;
+} Chain;
+
+static PyTypeObject chain_type;
+
+/* New empty chain of ring */
+PyObject *chain_new(Ring *ring, int hard) {
+  Chain *chain = PyObject_New(Chain, &chain_type);
+  if (chain == NULL) return NULL;
+
+  chain->steps = PyList_New(0);
+  if (chain->steps == NULL) {
+    chain->ring = NULL;
+    Py_DECREF(chain);
+    return NULL;
+  }
+  chain->ring = ring;
+  Py_INCREF(ring);
+  chain->hard = hard;
+  return (PyObject *)chain;
+}
+
+static void ChainDestructor(PyObject *self) {
+  Chain *chain = (Chain *)self;
+  Py_XDECREF(chain->steps);
+  Py_XDECREF(chain->ring);
+  Py_TYPE(self)->tp_free(self);
+}
+
+/* Helper of a step, given by opcode or as a prep_* method of the ring */
+static prep_fn chain_prep(Chain *chain, PyObject *op) {
+  prep_fn prep;
+
+  if (PyLong_Check(op)) {
+    long opcode = PyLong_AsLong(op);
+    if (opcode == -1 && PyErr_Occurred()) return NULL;
+    prep = prep_for_opcode(opcode);
+  } else {
+    prep = prep_for_method(op, (PyObject *)chain->ring);
+  }
+  if (prep == NULL && !PyErr_Occurred())
+    PyErr_Format(PyExc_ValueError, "no prep helper for %R", op);
+  return prep;
+}
+
+static int chain_append(Chain *chain, PyObject *op, PyObject *args,
+                        PyObject *data) {
+  if (chain_prep(chain, op) == NULL) return -1;
+
+  PyObject *step = PyTuple_Pack(3, op, args, data);
+  if (step == NULL) return -1;
+  int err = PyList_Append(chain->steps, step);
+  Py_DECREF(step);
+  return err;
+}
+
+/* Add a step, returns the chain for more calls */
+static PyObject *ChainAdd(PyObject *self, PyObject *args, PyObject *kwds) {
+  Chain *chain = (Chain *)self;
+  PyObject *data = Py_None;
+
+  if (kwds != NULL && PyDict_GET_SIZE(kwds) > 0) {
+    data = PyDict_GetItemString(kwds, "data");
+    if (data == NULL || PyDict_GET_SIZE(kwds) > 1) {
+      PyErr_SetString(PyExc_TypeError, "add() only takes data as keyword");
+      return NULL;
+    }
+  }
+  if (PyTuple_GET_SIZE(args) < 1) {
+    PyErr_SetString(PyExc_TypeError, "add() missing the opcode");
+    return NULL;
+  }
+
+  PyObject *prep_args = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args));
+  if (prep_args == NULL) return NULL;
+  int err = chain_append(chain, PyTuple_GET_ITEM(args, 0), prep_args, data);
+  Py_DECREF(prep_args);
+  if (err < 0) return NULL;
+
+  Py_INCREF(self);
+  return self;
+}
+
+/* Limit the step added last, returns the chain for more calls */
+static PyObject *ChainLinkTimeout(PyObject *self, PyObject *args,
+                                  PyObject *kwds) {
+  static char *kwlist[] = {"seconds", "data", NULL};
+  Chain *chain = (Chain *)self;
+  PyObject *seconds, *data = Py_None;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O:link_timeout", kwlist,
+                                   &seconds, &data))
+    return NULL;
+
+  Py_ssize_t count = PyList_GET_SIZE(chain->steps);
+  PyObject *last = NULL;
+  if (count > 0)
+    last = PyTuple_GET_ITEM(PyList_GET_ITEM(chain->steps, count - 1), 0);
+  if (last == NULL ||
+      chain_prep(chain, last) == prep_for_opcode(IORING_OP_LINK_TIMEOUT)) {
+    PyErr_SetString(PyExc_ValueError, "link timeout needs a step to limit");
+    return NULL;
+  }
+
+  PyObject *op = PyLong_FromLong(IORING_OP_LINK_TIMEOUT);
+  PyObject *prep_args = PyTuple_Pack(1, seconds);
+  int err = op == NULL || prep_args == NULL
+                ? -1
+                : chain_append(chain, op, prep_args, data);
+  Py_XDECREF(op);
+  Py_XDECREF(prep_args);
+  if (err < 0) return NULL;
+
+  Py_INCREF(self);
+  return self;
+}
+
+/*
+ * Prepare all steps while holding the sq_lock. Returns 0 with the user_data
+ * of each step in uds, or -1 with nothing left queued.
+ */
+static int chain_fill(Chain *chain, Py_ssize_t count, __u64 *uds) {
+  Ring *ring = chain->ring;
+  struct io_uring_sq *sq = &ring->ring.sq;
+  unsigned int tail = sq->sqe_tail;
+  unsigned char link = chain->hard ? IOSQE_IO_HARDLINK : IOSQE_IO_LINK;
+  Py_ssize_t i;
+
+  for (i = 0; i < count; i++) {
+    PyObject *step = PyList_GET_ITEM(chain->steps, i);
+    PyObject *data = PyTuple_GET_ITEM(step, 2);
+    prep_fn prep = chain_prep(chain, PyTuple_GET_ITEM(step, 0));
+
+    if (prep == NULL || prep(ring, PyTuple_GET_ITEM(step, 1), &uds[i])) break;
+
+    struct io_uring_sqe *sqe = &sq->sqes[(sq->sqe_tail - 1) & sq->ring_mask];
+    if (data != Py_None) {
+      /* The new token takes over the memory the prep pinned */
+      token_slot *slot = token_slot_of(&ring->tokens, uds[i]);
+      __u64 user_data;
+      int err = slot != NULL && slot->keep != NULL
+                    ? ring_user_data_keep(ring, data, slot->keep, &user_data)
+                    : ring_user_data(ring, data, &user_data);
+      if (err < 0) {
+        i++;
+        break;
+      }
+      ring_user_data_done(ring, uds[i]);
+      uds[i] = sqe->user_data = user_data;
+    }
+    if (i + 1 < count) sqe->flags |= link;
+  }
+
+  if (i == count) return 0;
+
+  /* Nothing was flushed to the kernel yet, take the entries back */
+  while (i-- > 0) ring_user_data_done(ring, uds[i]);
+  ring->stats.sqes_prepared -= sq->sqe_tail - tail;
+  sq->sqe_tail = tail;
+  if (!PyErr_Occurred()) ring_sq_full();
+  return -1;
+}
+
+/* Queue and submit all steps as one linked sequence */
+static PyObject *ChainSubmit(PyObject *self, PyObject *args) {
+  (void)args;
+  Chain *chain = (Chain *)self;
+  Ring *ring = chain->ring;
+  Py_ssize_t count = PyList_GET_SIZE(chain->steps);
+
+  if (count == 0) return PyList_New(0);
+  __u64 *uds = PyMem_Malloc(count * sizeof(__u64));
+  if (uds == NULL) return PyErr_NoMemory();
+
+  RING_LOCK(ring->sq_lock);
+  /* A chain cut in two would run as two independent sequences */
+  if (io_uring_sq_space_left(&ring->ring) < count) ring_submit_locked(ring);
+  if (io_uring_sq_space_left(&ring->ring) < count) {
+    ring->stats.sq_full++;
+    RING_UNLOCK(ring->sq_lock);
+    PyMem_Free(uds);
+    return ring_sq_full();
+  }
+
+  ring->sq_owner = PyThread_get_thread_ident();
+  int err = chain_fill(chain, count, uds);
+  ring->sq_owner = 0;
+  int ret = err ? 0 : ring_submit_locked(ring);
+  RING_UNLOCK(ring->sq_lock);
+
+  if (err) {
+    PyMem_Free(uds);
+    return NULL;
+  }
+  if (ret < 0) {
+    PyMem_Free(uds);
+    PyErr_SetString(PyExc_RuntimeError, strerror(-ret));
+    return NULL;
+  }
+
+  PyObject *result = PyList_New(count);
+  for (Py_ssize_t i = 0; result != NULL && i < count; i++) {
+    PyObject *user_data = PyLong_FromUnsignedLongLong(uds[i]);
+    if (user_data == NULL) Py_CLEAR(result);
+    else PyList_SET_ITEM(result, i, user_data);
+  }
+  PyMem_Free(uds);
+  if (PyList_SetSlice(chain->steps, 0, count, NULL) < 0) Py_CLEAR(result);
+  return result;
+}
+
+static Py_ssize_t ChainLength(PyObject *self) {
+  return PyList_GET_SIZE(((Chain *)self)->steps);
+}
+
+static PyMemberDef chain_members[] = {
+    {"hard", T_BOOL, offsetof(Chain, hard), READONLY,
+     "Whether the steps go on after a failed one"},
+    {NULL, 0, 0, 0, NULL}};
+
+static PyMethodDef chain_methods[] = {
+    {"add", (PyCFunction)(void (*)(void))ChainAdd,
+     METH_VARARGS | METH_KEYWORDS,
+     "add(op, *prep_args, data=None)\n\n"
+     "Add a step with the arguments of the prep_* method of op. op is an\n"
+     "opcode or a prep_* method of the ring, e.g. prep_openat_direct. data\n"
+     "is attached to the step. Returns the chain"},
+    {"link_timeout", (PyCFunction)(void (*)(void))ChainLinkTimeout,
+     METH_VARARGS | METH_KEYWORDS,
+     "link_timeout(seconds, data=None)\n\n"
+     "Cancel the step added last if it runs longer than seconds. The timeout\n"
+     "is a step of its own, completing with -ETIME once it fired and with\n"
+     "-ECANCELED otherwise. Returns the chain"},
+    {"submit", ChainSubmit, METH_NOARGS,
+     "submit()\n\n"
+     "Queue all steps as one linked sequence and submit it. Returns the\n"
+     "user_data of each step and leaves the chain empty for reuse"},
+    {NULL, NULL, 0, NULL}};
+
+static PySequenceMethods chain_as_sequence = {ChainLength};
+
+static PyTypeObject chain_type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0) "_uring_io.Chain", /* tp_name */
+    sizeof(Chain),                   /* tp_basicsize */
+    0,                               /* tp_itemsize */
+    (destructor)ChainDestructor,     /* tp_dealloc */
+    0,                               /* tp_print */
+    0,                               /* tp_getattr */
+    0,                               /* tp_setattr */
+    0,                               /* tp_reserved */
+    0,                               /* tp_repr */
+    0,                               /* tp_as_number */
+    &chain_as_sequence,              /* tp_as_sequence */
+    0,                               /* tp_as_mapping */
+    0,                               /* tp_hash */
+    0,                               /* tp_call */
+    0,                               /* tp_str */
+    0,                               /* tp_getattro */
+    0,                               /* tp_setattro */
+    0,                               /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,              /* tp_flags */
+    "Linked sequence of operations, see Ring.chain", /* tp_doc */
+    (traverseproc)NULL,              /* tp_traverse */
+    (inquiry)NULL,                   /* tp_clear */
+    0,                               /* tp_richcompare */
+    0,                               /* tp_weaklistoffset */
+    0,                               /* tp_iter */
+    0,                               /* tp_iternext */
+    chain_methods,                   /* tp_methods */
+    chain_members,                   /* tp_members */
+};
+
+extern void register_chain(PyObject *mod) {
+  if (PyType_Ready(&chain_type) < 0) return;
+  Py_INCREF(&chain_type);
+  if (PyModule_AddObject(mod, "Chain", (PyObject *)&chain_type) < 0)
+    Py_DECREF(&chain_type);
+}
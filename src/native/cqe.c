@@ -35,20 +35,45 @@ int CQEInit(PyObject *self, PyObject *args, PyObject *kwds) {
 PyObject *CQEGetData(PyObject *self, void *args) {
   (void)args;
   CQE *cqe = (CQE *)self;
-  Py_INCREF(cqe->entry->user_data);
-  return (PyObject *)(cqe->entry->user_data);
+  Py_INCREF(cqe->data);
+  return cqe->data;
+}
+
+PyObject *CQEGetUserData(PyObject *self, void *args) {
+  (void)args;
+  CQE *cqe = (CQE *)self;
+  return PyLong_FromUnsignedLongLong(cqe->entry.user_data);
 }
 
 PyObject *CQEGetResult(PyObject *self, void *args) {
   (void)args;
   CQE *cqe = (CQE *)self;
-  return PyLong_FromLong(cqe->entry->res);
+  return PyLong_FromLong(cqe->entry.res);
 }
 
 PyObject *CQEGetFlags(PyObject *self, void *args) {
   (void)args;
   CQE *cqe = (CQE *)self;
-  return PyLong_FromLong(cqe->entry->flags);
+  return PyLong_FromLong(cqe->entry.flags);
+}
+
+PyObject *CQEGetBufferId(PyObject *self, void *args) {
+  (void)args;
+  CQE *cqe = (CQE *)self;
+  if (!(cqe->entry.flags & IORING_CQE_F_BUFFER)) Py_RETURN_NONE;
+  return PyLong_FromLong(cqe->entry.flags >> IORING_CQE_BUFFER_SHIFT);
+}
+
+PyObject *CQEGetMore(PyObject *self, void *args) {
+  (void)args;
+  CQE *cqe = (CQE *)self;
+  return PyBool_FromLong(cqe->entry.flags & IORING_CQE_F_MORE);
+}
+
+PyObject *CQEGetNotif(PyObject *self, void *args) {
+  (void)args;
+  CQE *cqe = (CQE *)self;
+  return PyBool_FromLong(cqe->entry.flags & IORING_CQE_F_NOTIF);
 }
 
 int CQESetter(PyObject *self, PyObject *val, void *enc) {
@@ -61,13 +86,25 @@ int CQESetter(PyObject *self, PyObject *val, void *enc) {
 
 void CQEDestructor(void *self) {
   CQE *cqe = (CQE *)self;
-  Py_DECREF(cqe->entry->user_data);
+  Py_XDECREF(cqe->data);
+  Py_XDECREF(cqe->ring);
+  Py_TYPE(cqe)->tp_free(self);
 }
 
 static PyGetSetDef cqe_getset[] = {
-    {"data", CQEGetData, CQESetter, "User data of CQE", NULL},
+    {"data", CQEGetData, CQESetter, "Object attached to the operation", NULL},
+    {"user_data", CQEGetUserData, CQESetter, "Raw 64-bit user data of CQE",
+     NULL},
     {"result", CQEGetResult, CQESetter, "Result of operation", NULL},
     {"flags", CQEGetFlags, CQESetter, "Flags of operation", NULL},
+    {"more", CQEGetMore, CQESetter,
+     "Whether the operation is going to post more completions", NULL},
+    {"notif", CQEGetNotif, CQESetter,
+     "Whether this is the notification that a zero copy send released its\n"
+     "buffer, rather than the result of an operation",
+     NULL},
+    {"buffer_id", CQEGetBufferId, CQESetter,
+     "Id of the selected provided buffer, None if there is none", NULL},
     {NULL, NULL, NULL, NULL, NULL}};
 
 static PyMethodDef cqe_methods[] = {{NULL, NULL, 0, NULL}};
@@ -112,7 +149,39 @@ PyTypeObject cqe_type = {
     NULL,                /* tp_new */
 };
 
+/*
+ * Wrap a completion of the ring in a new CQE object. The attached object is
+ * looked up right away, the token itself is only released by cqe_seen.
+ */
+PyObject *cqe_new(Ring *ring, struct io_uring_cqe *entry) {
+  PyObject *data;
+  if (TOKEN_CHECK(entry->user_data)) {
+    data = token_lookup(&ring->tokens, entry->user_data);
+    if (data == NULL) data = Py_None;
+    Py_INCREF(data);
+  } else {
+    data = PyLong_FromUnsignedLongLong(entry->user_data);
+    if (data == NULL) return NULL;
+  }
+
+  CQE *cqe = PyObject_New(CQE, &cqe_type);
+  if (cqe == NULL) {
+    Py_DECREF(data);
+    return NULL;
+  }
+
+  buffer_ring_completed(ring, entry);
+  cqe->entry = *entry;
+  cqe->data = data;
+  Py_INCREF(ring);
+  cqe->ring = ring;
+  cqe->slot = entry;
+  cqe->seen = 0;
+  return (PyObject *)cqe;
+}
+
 extern void register_cqe(PyObject *mod) {
+  if (PyType_Ready(&cqe_type) < 0) return;
   Py_INCREF(&cqe_type);
   if (PyModule_AddObject(mod, "CQE", (PyObject *)&cqe_type) < 0)
     Py_DECREF(&cqe_type);
@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2021 Reza Mahdi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Groups of rings, one per worker thread.
+ *
+ * A single ring has a single thread reaping its completions. A RingGroup sets
+ * up a ring per worker, optionally with its SQPOLL thread pinned to a CPU of
+ * its own, and hands work between them with IORING_OP_MSG_RING: the data of
+ * a hand off is attached to the target ring like the data of an operation,
+ * and the posted completion delivers it to whoever consumes that ring, e.g.
+ * a callable called with (res, flags) by dispatch_completions. res can carry
+ * a file descriptor such as an accepted connection.
+ *
+ * The data is attached to the target ring from the calling thread, which
+ * relies on the GIL to keep the token table consistent.
+ */
+
+#define _GNU_SOURCE 1
+#include <liburing.h>
+#include <sched.h>
+#include <string.h>
+
+#include "uring.h"
+
+extern PyTypeObject ring_type;
+
+enum { GROUP_ROUND_ROBIN, GROUP_LEAST_INFLIGHT };
+
+typedef struct {
+  PyObject_HEAD PyObject *rings; /* tuple of Ring */
+  PyObject *cpus;                /* tuple of CPU numbers or None */
+  Ring *courier; /* posts hand offs of threads without a ring of their own */
+  int policy;
+  unsigned int next; /* round robin position */
+} RingGroup;
+
+static PyTypeObject ring_group_type;
+
+/* New Ring(entries, **kwds) */
+static Ring *group_ring(unsigned int entries, PyObject *kwds) {
+  PyObject *args = Py_BuildValue("(I)", entries);
+  if (args == NULL) return NULL;
+  PyObject *ring = PyObject_Call((PyObject *)&ring_type, args, kwds);
+  Py_DECREF(args);
+  return (Ring *)ring;
+}
+
+/* Keyword arguments of the ring at index, NULL on error */
+static PyObject *group_ring_kwds(RingGroup *group, Py_ssize_t index,
+                                 unsigned int flags, int share_wq) {
+  unsigned int sq_thread_cpu = 0;
+  int wq_fd = 0;
+
+  if (group->cpus != Py_None && (flags & IORING_SETUP_SQPOLL)) {
+    flags |= IORING_SETUP_SQ_AFF;
+    PyObject *cpu = PyTuple_GET_ITEM(group->cpus, index);
+    sq_thread_cpu = PyLong_AsUnsignedLong(cpu);
+    if (PyErr_Occurred()) return NULL;
+  }
+  if (share_wq && index > 0) {
+    flags |= IORING_SETUP_ATTACH_WQ;
+    wq_fd = ((Ring *)PyTuple_GET_ITEM(group->rings, 0))->ring.ring_fd;
+  }
+  return Py_BuildValue("{sIsIsi}", "flags", flags, "sq_thread_cpu",
+                       sq_thread_cpu, "wq_fd", wq_fd);
+}
+
+static char *ring_group_kwds[] = {"count",    "entries", "flags", "cpus",
+                                  "share_wq", "policy",  NULL};
+
+int RingGroupInit(PyObject *self, PyObject *args, PyObject *kwds) {
+  RingGroup *group = (RingGroup *)self;
+  Py_ssize_t count;
+  unsigned int entries = 256, flags = 0;
+  PyObject *cpus = Py_None;
+  int share_wq = 0;
+  const char *policy = "round_robin";
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|I$IOps", ring_group_kwds,
+                                   &count, &entries, &flags, &cpus, &share_wq,
+                                   &policy))
+    return -1;
+
+  if (group->rings != NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "RingGroup is already set up");
+    return -1;
+  }
+  if (count < 1) {
+    PyErr_SetString(PyExc_ValueError, "count must be positive");
+    return -1;
+  }
+  if (strcmp(policy, "round_robin") == 0) {
+    group->policy = GROUP_ROUND_ROBIN;
+  } else if (strcmp(policy, "least_inflight") == 0) {
+    group->policy = GROUP_LEAST_INFLIGHT;
+  } else {
+    PyErr_Format(PyExc_ValueError, "unknown policy %s", policy);
+    return -1;
+  }
+
+  if (cpus == Py_None) {
+    Py_INCREF(cpus);
+  } else {
+    cpus = PySequence_Tuple(cpus);
+    if (cpus == NULL) return -1;
+    if (PyTuple_GET_SIZE(cpus) != count) {
+      Py_DECREF(cpus);
+      PyErr_SetString(PyExc_ValueError, "cpus must have a CPU per ring");
+      return -1;
+    }
+  }
+  group->cpus = cpus;
+
+  group->rings = PyTuple_New(count);
+  if (group->rings == NULL) return -1;
+  for (Py_ssize_t i = 0; i < count; i++) {
+    PyObject *ring_kwds = group_ring_kwds(group, i, flags, share_wq);
+    if (ring_kwds == NULL) return -1;
+    Ring *ring = group_ring(entries, ring_kwds);
+    Py_DECREF(ring_kwds);
+    if (ring == NULL) return -1;
+    PyTuple_SET_ITEM(group->rings, i, (PyObject *)ring);
+  }
+
+  group->courier = group_ring(8, NULL);
+  return group->courier == NULL ? -1 : 0;
+}
+
+/* Index of the ring the next hand off goes to */
+static Py_ssize_t group_pick(RingGroup *group) {
+  Py_ssize_t count = PyTuple_GET_SIZE(group->rings);
+  Py_ssize_t start = group->next++ % count;
+
+  if (group->policy == GROUP_ROUND_ROBIN) return start;
+
+  /* Ties go round robin too, so idle rings share the load */
+  Py_ssize_t best = start;
+  for (Py_ssize_t i = 1; i < count; i++) {
+    Py_ssize_t index = (start + i) % count;
+    Ring *ring = (Ring *)PyTuple_GET_ITEM(group->rings, index);
+    Ring *best_ring = (Ring *)PyTuple_GET_ITEM(group->rings, best);
+    if (ring->tokens.used < best_ring->tokens.used) best = index;
+  }
+  return best;
+}
+
+static int group_check(RingGroup *group) {
+  if (group->rings == NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "RingGroup is not set up");
+    return -1;
+  }
+  return 0;
+}
+
+PyObject *RingGroupPick(PyObject *self, PyObject *args) {
+  (void)args;
+  RingGroup *group = (RingGroup *)self;
+  if (group_check(group) < 0) return NULL;
+  return PyLong_FromSsize_t(group_pick(group));
+}
+
+static char *ring_group_hand_off_kwds[] = {"data", "res", "target", "source",
+                                           NULL};
+
+/*
+ * Attach data to a ring of the group and post a completion of res for it
+ * there. The posting goes through source, a ring the calling thread owns,
+ * or the courier ring of the group.
+ */
+PyObject *RingGroupHandOff(PyObject *self, PyObject *args, PyObject *kwds) {
+  RingGroup *group = (RingGroup *)self;
+  PyObject *data;
+  int res = 0;
+  PyObject *target_obj = Py_None, *source = Py_None;
+  Py_ssize_t target = -1;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|i$OO:hand_off",
+                                   ring_group_hand_off_kwds, &data, &res,
+                                   &target_obj, &source))
+    return NULL;
+  if (group_check(group) < 0) return NULL;
+  if (source != Py_None && !PyObject_TypeCheck(source, &ring_type)) {
+    PyErr_SetString(PyExc_TypeError, "source must be a Ring");
+    return NULL;
+  }
+
+  if (target_obj == Py_None) {
+    target = group_pick(group);
+  } else {
+    target = PyLong_AsSsize_t(target_obj);
+    if (target == -1 && PyErr_Occurred()) return NULL;
+  }
+  if (target < 0 || target >= PyTuple_GET_SIZE(group->rings)) {
+    PyErr_SetString(PyExc_IndexError, "target out of range");
+    return NULL;
+  }
+
+  Ring *dest = (Ring *)PyTuple_GET_ITEM(group->rings, target);
+  Ring *via = source == Py_None ? group->courier : (Ring *)source;
+  __u64 user_data;
+  if (ring_user_data(dest, data, &user_data) < 0) return NULL;
+  if (ring_msg_ring(via, dest->ring.ring_fd, 0, res, user_data) < 0) {
+    ring_user_data_done(dest, user_data);
+    return NULL;
+  }
+  return PyLong_FromSsize_t(target);
+}
+
+/* Pin the calling thread to the CPU of ring index */
+PyObject *RingGroupPin(PyObject *self, PyObject *args) {
+  RingGroup *group = (RingGroup *)self;
+  Py_ssize_t index;
+
+  if (!PyArg_ParseTuple(args, "n:pin", &index)) return NULL;
+  if (group_check(group) < 0) return NULL;
+  if (group->cpus == Py_None) {
+    PyErr_SetString(PyExc_ValueError, "RingGroup has no cpus");
+    return NULL;
+  }
+  if (index < 0 || index >= PyTuple_GET_SIZE(group->cpus)) {
+    PyErr_SetString(PyExc_IndexError, "index out of range");
+    return NULL;
+  }
+
+  long cpu = PyLong_AsLong(PyTuple_GET_ITEM(group->cpus, index));
+  if (cpu == -1 && PyErr_Occurred()) return NULL;
+  if (cpu < 0 || cpu >= CPU_SETSIZE) {
+    PyErr_Format(PyExc_ValueError, "invalid CPU %ld", cpu);
+    return NULL;
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) < 0)
+    return PyErr_SetFromErrno(PyExc_OSError);
+  Py_RETURN_NONE;
+}
+
+static Py_ssize_t RingGroupLength(PyObject *self) {
+  RingGroup *group = (RingGroup *)self;
+  return group->rings ? PyTuple_GET_SIZE(group->rings) : 0;
+}
+
+static PyObject *RingGroupItem(PyObject *self, Py_ssize_t index) {
+  RingGroup *group = (RingGroup *)self;
+  if (group->rings == NULL || index < 0 ||
+      index >= PyTuple_GET_SIZE(group->rings)) {
+    PyErr_SetString(PyExc_IndexError, "ring index out of range");
+    return NULL;
+  }
+  PyObject *ring = PyTuple_GET_ITEM(group->rings, index);
+  Py_INCREF(ring);
+  return ring;
+}
+
+static PyObject *RingGroupGetPolicy(PyObject *self, void *closure) {
+  (void)closure;
+  return PyUnicode_FromString(((RingGroup *)self)->policy == GROUP_ROUND_ROBIN
+                                  ? "round_robin"
+                                  : "least_inflight");
+}
+
+void RingGroupDestructor(PyObject *self) {
+  RingGroup *group = (RingGroup *)self;
+  Py_XDECREF(group->rings);
+  Py_XDECREF(group->cpus);
+  Py_XDECREF(group->courier);
+  Py_TYPE(self)->tp_free(self);
+}
+
+static PyMemberDef ring_group_members[] = {
+    {"rings", T_OBJECT, offsetof(RingGroup, rings), READONLY,
+     "Tuple of the rings"},
+    {"cpus", T_OBJECT, offsetof(RingGroup, cpus), READONLY,
+     "CPU of each ring, or None"},
+    {NULL, 0, 0, 0, NULL}};
+
+static PyGetSetDef ring_group_getset[] = {
+    {"policy", RingGroupGetPolicy, NULL,
+     "How hand offs pick their ring, round_robin or least_inflight", NULL},
+    {NULL, NULL, NULL, NULL, NULL}};
+
+static PyMethodDef ring_group_methods[] = {
+    {"pick", RingGroupPick, METH_NOARGS,
+     "pick()\n\n"
+     "Index of the ring the policy picks next: the next one in turn, or the\n"
+     "one with the fewest operations in flight"},
+    {"hand_off", (PyCFunction)(void (*)(void))RingGroupHandOff,
+     METH_VARARGS | METH_KEYWORDS,
+     "hand_off(data, res=0, *, target=None, source=None)\n\n"
+     "Attach data to the ring target, or the one the policy picks, and post\n"
+     "a completion of res for it there through IORING_OP_MSG_RING. source\n"
+     "is a ring the calling thread owns to post it with. Returns the index\n"
+     "of the ring"},
+    {"pin", RingGroupPin, METH_VARARGS,
+     "pin(index)\n\nPin the calling thread to the CPU of ring index"},
+    {NULL, NULL, 0, NULL}};
+
+static PySequenceMethods ring_group_as_sequence = {
+    RingGroupLength, /* sq_length */
+    0,               /* sq_concat */
+    0,               /* sq_repeat */
+    RingGroupItem,   /* sq_item */
+};
+
+static PyTypeObject ring_group_type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0) "_uring_io.RingGroup", /* tp_name */
+    sizeof(RingGroup),                   /* tp_basicsize */
+    0,                                   /* tp_itemsize */
+    (destructor)RingGroupDestructor,     /* tp_dealloc */
+    0,                                   /* tp_print */
+    0,                                   /* tp_getattr */
+    0,                                   /* tp_setattr */
+    0,                                   /* tp_reserved */
+    0,                                   /* tp_repr */
+    0,                                   /* tp_as_number */
+    &ring_group_as_sequence,             /* tp_as_sequence */
+    0,                                   /* tp_as_mapping */
+    0,                                   /* tp_hash */
+    0,                                   /* tp_call */
+    0,                                   /* tp_str */
+    0,                                   /* tp_getattro */
+    0,                                   /* tp_setattro */
+    0,                                   /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                  /* tp_flags */
+    "RingGroup(count, entries=256, *, flags=0, cpus=None, share_wq=False,\n"
+    "          policy='round_robin')\n\n"
+    "A ring per worker thread with work handed between them. With SQPOLL in\n"
+    "flags the poller of each ring is bound to its CPU in cpus, share_wq\n"
+    "attaches the rings to the async backend of the first one", /* tp_doc */
+    (traverseproc)NULL,                  /* tp_traverse */
+    (inquiry)NULL,                       /* tp_clear */
+    0,                                   /* tp_richcompare */
+    0,                                   /* tp_weaklistoffset */
+    0,                                   /* tp_iter */
+    0,                                   /* tp_iternext */
+    ring_group_methods,                  /* tp_methods */
+    ring_group_members,                  /* tp_members */
+    ring_group_getset,                   /* tp_getset */
+    0,                                   /* tp_base */
+    0,                                   /* tp_dict */
+    0,                                   /* tp_descr_get */
+    0,                                   /* tp_descr_set */
+    0,                                   /* tp_dictoffset */
+    RingGroupInit,                       /* tp_init */
+    PyType_GenericAlloc,                 /* tp_alloc */
+    PyType_GenericNew,                   /* tp_new */
+};
+
+extern void register_group(PyObject *mod) {
+  if (PyType_Ready(&ring_group_type) < 0) return;
+  Py_INCREF(&ring_group_type);
+  if (PyModule_AddObject(mod, "RingGroup", (PyObject *)&ring_group_type) < 0)
+    Py_DECREF(&ring_group_type);
+}
@@ -22,46 +22,20 @@
 
 #include <liburing.h>
 #include <liburing/io_uring.h>
-#include <stdio.h>
-#include <sys/utsname.h>
+#include <fcntl.h>
+#include <linux/stat.h>
 
 #include "uring.h"
 
-static PyObject *supported(PyObject *self, PyObject *args) {
-  (void)self;
-  (void)args;
-
-  struct utsname name;
-  uname(&name);
-  unsigned int major;
-  unsigned int minor;
-  unsigned int patch;
-  sscanf(name.release, "%d.%d.%d", &major, &minor, &patch);
-
-  if (major < 5 && minor < 6) return PyBool_FromLong(0);
-  return PyBool_FromLong(1);
-}
-
-static PyObject *probe(PyObject *self, PyObject *args) {
-  struct io_uring_probe *pr = io_uring_get_probe();
-
-  return PyLong_FromLong(pr->last_op);
-}
-
-static PyObject *probe_oc(PyObject *self, PyObject *args) {
-  struct io_uring_probe *pr = io_uring_get_probe();
-  int opcode;
-  if (!PyArg_ParseTuple(args, "I", &opcode)) return NULL;
-
-  return PyBool_FromLong(io_uring_opcode_supported(pr, opcode));
-}
-
 static PyMethodDef methods[] = {
-    {"supported", (PyCFunction)supported, METH_NOARGS,
+    {"supported", (PyCFunction)capabilities_supported, METH_NOARGS,
      "Checks whether uring_io is supported or not"},
-    {"probe", (PyCFunction)probe, METH_NOARGS, "Probe supported opcodes"},
-    {"opcode_supported", (PyCFunction)probe_oc, METH_VARARGS,
-     "Checks whether opcode is supported"},
+    {"probe", (PyCFunction)capabilities_probe, METH_NOARGS,
+     "Last opcode the kernel supports"},
+    {"opcode_supported", (PyCFunction)capabilities_opcode_supported,
+     METH_VARARGS, "Checks whether opcode is supported"},
+    {"capabilities", (PyCFunction)capabilities, METH_NOARGS,
+     "capabilities()\n\nWhat the running kernel supports, detected once"},
     {NULL, NULL, 0, NULL},
 };
 
@@ -75,6 +49,16 @@ PyMODINIT_FUNC PyInit__uring_io(void) {
   register_ring(mod);
   register_sqe(mod);
   register_cqe(mod);
+  register_fixed_file(mod);
+  register_buffer_ring(mod);
+  register_chain(mod);
+  register_stats(mod);
+  register_group(mod);
+  register_timer_wheel(mod);
+  register_capabilities(mod);
+  PyModule_AddIntConstant(mod, "SQE_SIZE", sizeof(struct io_uring_sqe));
+  PyModule_AddIntConstant(mod, "CQE_SIZE", sizeof(cqe_record));
+  PyModule_AddStringConstant(mod, "CQE_FORMAT", "QiHH");
 
   PyObject *flags_mod = PyModule_New("flags");
   PyObject *opcodes_mod = PyModule_New("opcodes");
@@ -85,6 +69,40 @@ PyMODINIT_FUNC PyInit__uring_io(void) {
   PyModule_AddIntConstant(flags_mod, "SQE_IO_HARDLINK", IOSQE_IO_HARDLINK);
   PyModule_AddIntConstant(flags_mod, "SQE_ASYNC", IOSQE_ASYNC);
   PyModule_AddIntConstant(flags_mod, "SQE_BUFFER_SELECT", IOSQE_BUFFER_SELECT);
+  PyModule_AddIntConstant(flags_mod, "SQE_CQE_SKIP_SUCCESS",
+                          IOSQE_CQE_SKIP_SUCCESS);
+
+  PyModule_AddIntConstant(flags_mod, "ASYNC_CANCEL_ALL",
+                          IORING_ASYNC_CANCEL_ALL);
+  PyModule_AddIntConstant(flags_mod, "ASYNC_CANCEL_FD", IORING_ASYNC_CANCEL_FD);
+  PyModule_AddIntConstant(flags_mod, "ASYNC_CANCEL_ANY",
+                          IORING_ASYNC_CANCEL_ANY);
+  PyModule_AddIntConstant(flags_mod, "ASYNC_CANCEL_FD_FIXED",
+                          IORING_ASYNC_CANCEL_FD_FIXED);
+
+  PyModule_AddIntConstant(flags_mod, "FSYNC_DATASYNC", IORING_FSYNC_DATASYNC);
+  PyModule_AddIntConstant(flags_mod, "TIMEOUT_ABS", IORING_TIMEOUT_ABS);
+  PyModule_AddIntConstant(flags_mod, "AT_FDCWD", AT_FDCWD);
+  PyModule_AddIntConstant(flags_mod, "AT_EMPTY_PATH", AT_EMPTY_PATH);
+  PyModule_AddIntConstant(flags_mod, "AT_SYMLINK_NOFOLLOW",
+                          AT_SYMLINK_NOFOLLOW);
+  PyModule_AddIntConstant(flags_mod, "STATX_BASIC_STATS", STATX_BASIC_STATS);
+  PyModule_AddIntConstant(flags_mod, "CQE_F_BUFFER", IORING_CQE_F_BUFFER);
+  PyModule_AddIntConstant(flags_mod, "CQE_F_MORE", IORING_CQE_F_MORE);
+  PyModule_AddIntConstant(flags_mod, "CQE_F_NOTIF", IORING_CQE_F_NOTIF);
+  PyModule_AddIntConstant(flags_mod, "SEND_ZC_REPORT_USAGE",
+                          IORING_SEND_ZC_REPORT_USAGE);
+  PyModule_AddIntConstant(flags_mod, "NOTIF_USAGE_ZC_COPIED",
+                          IORING_NOTIF_USAGE_ZC_COPIED);
+  PyModule_AddIntConstant(flags_mod, "CQE_F_SOCK_NONEMPTY",
+                          IORING_CQE_F_SOCK_NONEMPTY);
+  PyModule_AddIntConstant(flags_mod, "FILE_INDEX_ALLOC",
+                          IORING_FILE_INDEX_ALLOC);
+
+  PyModule_AddIntConstant(flags_mod, "FEAT_NODROP", IORING_FEAT_NODROP);
+  PyModule_AddIntConstant(flags_mod, "FEAT_FAST_POLL", IORING_FEAT_FAST_POLL);
+  PyModule_AddIntConstant(flags_mod, "FEAT_EXT_ARG", IORING_FEAT_EXT_ARG);
+  PyModule_AddIntConstant(flags_mod, "FEAT_CQE_SKIP", IORING_FEAT_CQE_SKIP);
 
   PyModule_AddIntConstant(flags_mod, "RING_SETUP_IOPOLL", IORING_SETUP_IOPOLL);
   PyModule_AddIntConstant(flags_mod, "RING_SETUP_SQPOLL", IORING_SETUP_SQPOLL);
@@ -92,9 +110,19 @@ PyMODINIT_FUNC PyInit__uring_io(void) {
   PyModule_AddIntConstant(flags_mod, "RING_SETUP_CQSIZE", IORING_SETUP_CQSIZE);
   PyModule_AddIntConstant(flags_mod, "RING_SETUP_CLAMP", IORING_SETUP_CLAMP);
   PyModule_AddIntConstant(flags_mod, "RING_SETUP_ATTACH_WQ",
-                          IOSQE_BUFFER_SELECT);
+                          IORING_SETUP_ATTACH_WQ);
   PyModule_AddIntConstant(flags_mod, "RING_SETUP_R_DISABLED",
                           IORING_SETUP_R_DISABLED);
+  PyModule_AddIntConstant(flags_mod, "RING_SETUP_SUBMIT_ALL",
+                          IORING_SETUP_SUBMIT_ALL);
+  PyModule_AddIntConstant(flags_mod, "RING_SETUP_COOP_TASKRUN",
+                          IORING_SETUP_COOP_TASKRUN);
+  PyModule_AddIntConstant(flags_mod, "RING_SETUP_TASKRUN_FLAG",
+                          IORING_SETUP_TASKRUN_FLAG);
+  PyModule_AddIntConstant(flags_mod, "RING_SETUP_SINGLE_ISSUER",
+                          IORING_SETUP_SINGLE_ISSUER);
+  PyModule_AddIntConstant(flags_mod, "RING_SETUP_DEFER_TASKRUN",
+                          IORING_SETUP_DEFER_TASKRUN);
 
   PyModule_AddIntConstant(opcodes_mod, "OP_NOP", IORING_OP_NOP);
   PyModule_AddIntConstant(opcodes_mod, "OP_READV", IORING_OP_READV);
@@ -141,6 +169,10 @@ PyMODINIT_FUNC PyInit__uring_io(void) {
   PyModule_AddIntConstant(opcodes_mod, "OP_RENAMEAT", IORING_OP_RENAMEAT);
   PyModule_AddIntConstant(opcodes_mod, "OP_ULINKAT", IORING_OP_UNLINKAT);
   PyModule_AddIntConstant(opcodes_mod, "OP_MKDIRAT", IORING_OP_MKDIRAT);
+  PyModule_AddIntConstant(opcodes_mod, "OP_SOCKET", IORING_OP_SOCKET);
+  PyModule_AddIntConstant(opcodes_mod, "OP_SEND_ZC", IORING_OP_SEND_ZC);
+  PyModule_AddIntConstant(opcodes_mod, "OP_SENDMSG_ZC", IORING_OP_SENDMSG_ZC);
+  PyModule_AddIntConstant(opcodes_mod, "OP_MSG_RING", IORING_OP_MSG_RING);
   PyModule_AddIntConstant(opcodes_mod, "OP_LAST", IORING_OP_LAST);
 
   PyModule_AddObject(mod, "opcodes", opcodes_mod);
@@ -0,0 +1,1279 @@
+/*
+ * Copyright (c) 2021 Reza Mahdi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Native prep helpers of Ring.
+ *
+ * Every helper parses its arguments first and only then reserves and fills
+ * an SQE, so a bad argument never leaves a half prepared entry in the queue.
+ * Buffers are passed to the kernel by address: they have to stay alive until
+ * the operation completes.
+ *
+ * The optional data argument is attached to the operation and comes back as
+ * CQE.data. Methods return the user_data put in the entry.
+ */
+
+#include <arpa/inet.h>
+#include <liburing.h>
+#include <liburing/io_uring.h>
+#include <linux/stat.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "uring.h"
+
+extern PyTypeObject ring_type;
+
+/* Convert the result of a prep helper to the value of its method */
+static PyObject *prep_result(int err, __u64 user_data) {
+  if (err < 0) return NULL;
+  if (err > 0) return ring_sq_full();
+  return PyLong_FromUnsignedLongLong(user_data);
+}
+
+/*
+ * A memoryview of a buffer the kernel uses until the operation completes.
+ * The token of the operation holds it until the final completion, which
+ * also keeps a bytearray from being resized under the kernel.
+ */
+static PyObject *pinned_view(PyObject *obj, int writable) {
+  PyObject *view = PyMemoryView_FromObject(obj);
+  if (view == NULL) return NULL;
+
+  Py_buffer *buf = PyMemoryView_GET_BUFFER(view);
+  if (!PyBuffer_IsContiguous(buf, 'C')) {
+    PyErr_SetString(PyExc_ValueError, "buffer must be contiguous");
+    Py_DECREF(view);
+    return NULL;
+  }
+  if (writable && buf->readonly) {
+    PyErr_SetString(PyExc_TypeError, "buffer must be writable");
+    Py_DECREF(view);
+    return NULL;
+  }
+  return view;
+}
+
+/* Argument converters of pinned_view, for buffers read and written */
+static int view_converter_of(PyObject *obj, PyObject **view, int writable) {
+  if (obj == NULL) {
+    /* cleanup, a later argument failed to parse */
+    Py_CLEAR(*view);
+    return 1;
+  }
+  *view = pinned_view(obj, writable);
+  return *view == NULL ? 0 : Py_CLEANUP_SUPPORTED;
+}
+
+static int view_converter(PyObject *obj, void *ptr) {
+  return view_converter_of(obj, ptr, 0);
+}
+
+static int writable_view_converter(PyObject *obj, void *ptr) {
+  return view_converter_of(obj, ptr, 1);
+}
+
+/*
+ * Fill an array of iovecs from a sequence of buffers. The array is returned
+ * as a bytes object in a tuple with the pinned views of the buffers, which
+ * keeps both alive until the final completion of the operation.
+ */
+static PyObject *iovecs_from_sequence(PyObject *buffers, int writable,
+                                      unsigned int *nr,
+                                      struct iovec **iovecs) {
+  PyObject *seq = PySequence_Fast(buffers, "buffers must be a sequence");
+  if (seq == NULL) return NULL;
+
+  Py_ssize_t count = PySequence_Fast_GET_SIZE(seq);
+  PyObject *keep = PyTuple_New(2);
+  PyObject *vecs =
+      PyBytes_FromStringAndSize(NULL, count * sizeof(struct iovec));
+  PyObject *views = PyTuple_New(count);
+  if (keep == NULL || vecs == NULL || views == NULL) {
+    Py_XDECREF(keep);
+    Py_XDECREF(vecs);
+    Py_XDECREF(views);
+    Py_DECREF(seq);
+    return NULL;
+  }
+  PyTuple_SET_ITEM(keep, 0, vecs);
+  PyTuple_SET_ITEM(keep, 1, views);
+
+  struct iovec *iov = (struct iovec *)PyBytes_AS_STRING(vecs);
+  for (Py_ssize_t i = 0; i < count; i++) {
+    PyObject *view = pinned_view(PySequence_Fast_GET_ITEM(seq, i), writable);
+    if (view == NULL) {
+      Py_DECREF(keep);
+      Py_DECREF(seq);
+      return NULL;
+    }
+    PyTuple_SET_ITEM(views, i, view);
+    iov[i].iov_base = PyMemoryView_GET_BUFFER(view)->buf;
+    iov[i].iov_len = PyMemoryView_GET_BUFFER(view)->len;
+  }
+
+  Py_DECREF(seq);
+  *nr = (unsigned int)count;
+  *iovecs = iov;
+  return keep;
+}
+
+/* File argument of a helper: a descriptor or a slot of the file table */
+typedef struct {
+  int fd;
+  unsigned int flags; /* IOSQE_FIXED_FILE for a FixedFile */
+} prep_fd;
+
+static int fd_converter(PyObject *obj, void *ptr) {
+  prep_fd *file = ptr;
+  long fd = PyLong_AsLong(obj);
+
+  if (fd == -1 && PyErr_Occurred()) return 0;
+  if (fd < 0 || fd > INT_MAX) {
+    PyErr_SetString(PyExc_ValueError, "invalid file descriptor");
+    return 0;
+  }
+  file->fd = fd;
+  file->flags =
+      PyObject_TypeCheck(obj, &fixed_file_type) ? IOSQE_FIXED_FILE : 0;
+  return 1;
+}
+
+/* Target of IORING_OP_MSG_RING: a Ring, its descriptor or its FixedFile */
+static int ring_fd_converter(PyObject *obj, void *ptr) {
+  prep_fd *file = ptr;
+
+  if (PyObject_TypeCheck(obj, &ring_type)) {
+    file->fd = ((Ring *)obj)->ring.ring_fd;
+    file->flags = 0;
+    return 1;
+  }
+  return fd_converter(obj, ptr);
+}
+
+/*
+ * Destination of a read: a writable buffer or a BufferRing to select from.
+ * keep is the pinned view of the buffer or the pool, held by the token of
+ * the operation.
+ */
+typedef struct {
+  PyObject *keep;
+  void *buf;
+  size_t len;
+  BufferRing *pool;
+} prep_dest;
+
+static int dest_converter(PyObject *obj, void *ptr) {
+  prep_dest *dest = ptr;
+
+  if (obj == NULL) {
+    /* cleanup, a later argument failed to parse */
+    Py_CLEAR(dest->keep);
+    return 1;
+  }
+
+  if (PyObject_TypeCheck(obj, &buffer_ring_type)) {
+    dest->pool = (BufferRing *)obj;
+    if (dest->pool->state == NULL) {
+      PyErr_SetString(PyExc_ValueError, "BufferRing is not set up");
+      return 0;
+    }
+    Py_INCREF(obj);
+    dest->keep = obj;
+    dest->buf = NULL;
+    dest->len = dest->pool->size;
+    return Py_CLEANUP_SUPPORTED;
+  }
+
+  dest->pool = NULL;
+  dest->keep = pinned_view(obj, 1);
+  if (dest->keep == NULL) return 0;
+  dest->buf = PyMemoryView_GET_BUFFER(dest->keep)->buf;
+  dest->len = PyMemoryView_GET_BUFFER(dest->keep)->len;
+  return Py_CLEANUP_SUPPORTED;
+}
+
+/* Let the kernel pick the buffer if the destination is a BufferRing */
+static void dest_select(struct io_uring_sqe *sqe, prep_dest *dest) {
+  if (dest->pool == NULL) return;
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = dest->pool->group;
+}
+
+/*
+ * Family of a Python address for a socket that can't be asked, like a slot
+ * of the file table: a path is AF_UNIX, a host that parses as IPv4 is
+ * AF_INET and anything else AF_INET6.
+ */
+static int address_family(PyObject *address) {
+  if (!PyTuple_Check(address)) return AF_UNIX;
+  if (PyTuple_GET_SIZE(address) != 2) return AF_INET6;
+
+  const char *host = PyUnicode_Check(PyTuple_GET_ITEM(address, 0))
+                         ? PyUnicode_AsUTF8(PyTuple_GET_ITEM(address, 0))
+                         : NULL;
+  struct in_addr addr;
+  if (host == NULL) {
+    PyErr_Clear();
+    return AF_INET6;
+  }
+  return inet_pton(AF_INET, host, &addr) == 1 ? AF_INET : AF_INET6;
+}
+
+/*
+ * Build a sockaddr for the socket fd out of a Python address: a (host, port)
+ * tuple for AF_INET, (host, port[, flowinfo, scope_id]) for AF_INET6 and a
+ * path for AF_UNIX. Hosts have to be numeric, nothing is resolved here.
+ */
+static PyObject *sockaddr_from_address(prep_fd *fd, PyObject *address) {
+  int family;
+  socklen_t optlen = sizeof(family);
+
+  if (PyBytes_Check(address)) {
+    Py_INCREF(address);
+    return address;
+  }
+
+  if (fd->flags & IOSQE_FIXED_FILE)
+    family = address_family(address);
+  else if (getsockopt(fd->fd, SOL_SOCKET, SO_DOMAIN, &family, &optlen) < 0)
+    return PyErr_SetFromErrno(PyExc_OSError);
+
+  if (family == AF_INET) {
+    struct sockaddr_in sin = {.sin_family = AF_INET};
+    const char *host;
+    unsigned short port;
+    if (!PyArg_ParseTuple(address, "sH", &host, &port)) return NULL;
+    if (inet_pton(AF_INET, host, &sin.sin_addr) != 1) {
+      PyErr_Format(PyExc_ValueError, "'%s' is not a numeric IPv4 address",
+                   host);
+      return NULL;
+    }
+    sin.sin_port = htons(port);
+    return PyBytes_FromStringAndSize((char *)&sin, sizeof(sin));
+  }
+
+  if (family == AF_INET6) {
+    struct sockaddr_in6 sin6 = {.sin6_family = AF_INET6};
+    const char *host;
+    unsigned short port;
+    unsigned int flowinfo = 0, scope_id = 0;
+    if (!PyArg_ParseTuple(address, "sH|II", &host, &port, &flowinfo,
+                          &scope_id))
+      return NULL;
+    if (inet_pton(AF_INET6, host, &sin6.sin6_addr) != 1) {
+      PyErr_Format(PyExc_ValueError, "'%s' is not a numeric IPv6 address",
+                   host);
+      return NULL;
+    }
+    sin6.sin6_port = htons(port);
+    sin6.sin6_flowinfo = htonl(flowinfo);
+    sin6.sin6_scope_id = scope_id;
+    return PyBytes_FromStringAndSize((char *)&sin6, sizeof(sin6));
+  }
+
+  if (family == AF_UNIX) {
+    struct sockaddr_un sun = {.sun_family = AF_UNIX};
+    PyObject *path;
+    if (!PyUnicode_FSConverter(address, &path)) return NULL;
+    Py_ssize_t len = PyBytes_GET_SIZE(path);
+    if ((size_t)len >= sizeof(sun.sun_path)) {
+      Py_DECREF(path);
+      PyErr_SetString(PyExc_OSError, "AF_UNIX path too long");
+      return NULL;
+    }
+    memcpy(sun.sun_path, PyBytes_AS_STRING(path), len);
+    Py_DECREF(path);
+    return PyBytes_FromStringAndSize(
+        (char *)&sun, offsetof(struct sockaddr_un, sun_path) + len + 1);
+  }
+
+  PyErr_Format(PyExc_OSError, "unsupported address family %d", family);
+  return NULL;
+}
+
+/*
+ * Reserve an SQE once the arguments of a helper are checked. data becomes
+ * the user_data of the entry first, so a failure leaves the queue untouched.
+ * Returns the SQE with sq_lock held, or NULL with *err set to -1 on error
+ * and 1 if the SQ is full.
+ */
+static struct io_uring_sqe *prep_begin(Ring *ring, PyObject *keep,
+                                       PyObject *data, __u64 *user_data,
+                                       int *err) {
+  if (ring_user_data(ring, data, user_data) < 0) {
+    *err = -1;
+    return NULL;
+  }
+
+  struct io_uring_sqe *sqe = ring_sqe_begin(ring, keep);
+  if (sqe == NULL) {
+    ring_user_data_done(ring, *user_data);
+    *err = 1;
+  }
+  return sqe;
+}
+
+/*
+ * Like prep_begin for an operation on memory the kernel uses until its
+ * final completion. pinned is held by the token of data until then.
+ */
+static struct io_uring_sqe *prep_begin_pinned(Ring *ring, PyObject *keep,
+                                              PyObject *pinned,
+                                              PyObject *data,
+                                              __u64 *user_data, int *err) {
+  if (ring_user_data_keep(ring, data, pinned, user_data) < 0) {
+    *err = -1;
+    return NULL;
+  }
+
+  struct io_uring_sqe *sqe = ring_sqe_begin(ring, keep);
+  if (sqe == NULL) {
+    ring_user_data_done(ring, *user_data);
+    *err = 1;
+  }
+  return sqe;
+}
+
+/* Each helper returns 0 on success, -1 on error and 1 if the SQ is full */
+
+static int prep_nop(Ring *ring, PyObject *args, __u64 *user_data) {
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "|O:prep_nop", &data)) return -1;
+
+  int err;
+  struct io_uring_sqe *sqe = prep_begin(ring, NULL, data, user_data, &err);
+  if (sqe == NULL) return err;
+  io_uring_prep_nop(sqe);
+  sqe->user_data = *user_data;
+  ring_sqe_end(ring);
+  return 0;
+}
+
+static int prep_read(Ring *ring, PyObject *args, __u64 *user_data) {
+  prep_fd fd;
+  prep_dest dest;
+  unsigned long long offset;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "O&O&K|O:prep_read", fd_converter, &fd,
+                        dest_converter, &dest, &offset, &data))
+    return -1;
+
+  int err;
+  struct io_uring_sqe *sqe =
+      prep_begin_pinned(ring, NULL, dest.keep, data, user_data, &err);
+  if (sqe != NULL) {
+    io_uring_prep_read(sqe, fd.fd, dest.buf, dest.len, offset);
+    dest_select(sqe, &dest);
+    sqe->flags |= fd.flags;
+    sqe->user_data = *user_data;
+    ring_sqe_end(ring);
+  }
+  dest_converter(NULL, &dest);
+  return sqe == NULL ? err : 0;
+}
+
+static int prep_write(Ring *ring, PyObject *args, __u64 *user_data) {
+  prep_fd fd;
+  PyObject *view = NULL;
+  unsigned long long offset;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "O&O&K|O:prep_write", fd_converter, &fd,
+                        view_converter, &view, &offset, &data))
+    return -1;
+
+  int err;
+  Py_buffer *buf = PyMemoryView_GET_BUFFER(view);
+  struct io_uring_sqe *sqe =
+      prep_begin_pinned(ring, NULL, view, data, user_data, &err);
+  if (sqe != NULL) {
+    io_uring_prep_write(sqe, fd.fd, buf->buf, buf->len, offset);
+    sqe->flags |= fd.flags;
+    sqe->user_data = *user_data;
+    ring_sqe_end(ring);
+  }
+  Py_DECREF(view);
+  return sqe == NULL ? err : 0;
+}
+
+static int prep_vectored(Ring *ring, PyObject *args, __u64 *user_data,
+                         int opcode) {
+  prep_fd fd;
+  PyObject *buffers;
+  unsigned long long offset;
+  PyObject *data = NULL;
+  unsigned int nr;
+  if (!PyArg_ParseTuple(args, "O&OK|O", fd_converter, &fd, &buffers, &offset,
+                        &data))
+    return -1;
+
+  struct iovec *iov;
+  PyObject *keep =
+      iovecs_from_sequence(buffers, opcode == IORING_OP_READV, &nr, &iov);
+  if (keep == NULL) return -1;
+
+  int err;
+  struct io_uring_sqe *sqe =
+      prep_begin_pinned(ring, NULL, keep, data, user_data, &err);
+  Py_DECREF(keep);
+  if (sqe == NULL) return err;
+  io_uring_prep_rw(opcode, sqe, fd.fd, iov, nr, offset);
+  sqe->flags |= fd.flags;
+  sqe->user_data = *user_data;
+  ring_sqe_end(ring);
+  return 0;
+}
+
+static int prep_readv(Ring *ring, PyObject *args, __u64 *user_data) {
+  return prep_vectored(ring, args, user_data, IORING_OP_READV);
+}
+
+static int prep_writev(Ring *ring, PyObject *args, __u64 *user_data) {
+  return prep_vectored(ring, args, user_data, IORING_OP_WRITEV);
+}
+
+static int prep_send(Ring *ring, PyObject *args, __u64 *user_data) {
+  prep_fd fd;
+  int flags = 0;
+  PyObject *view = NULL;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "O&O&|iO:prep_send", fd_converter, &fd,
+                        view_converter, &view, &flags, &data))
+    return -1;
+
+  int err;
+  Py_buffer *buf = PyMemoryView_GET_BUFFER(view);
+  struct io_uring_sqe *sqe =
+      prep_begin_pinned(ring, NULL, view, data, user_data, &err);
+  if (sqe != NULL) {
+    io_uring_prep_send(sqe, fd.fd, buf->buf, buf->len, flags);
+    sqe->flags |= fd.flags;
+    sqe->user_data = *user_data;
+    ring_sqe_end(ring);
+  }
+  Py_DECREF(view);
+  return sqe == NULL ? err : 0;
+}
+
+/*
+ * Zero copy send. The kernel reads buf until a second completion with
+ * CQE_F_NOTIF, posted after the one with the result, so a memoryview of buf
+ * is held until then. The first completion has CQE_F_MORE set when the
+ * notification is coming, which some early failures don't.
+ */
+static int prep_send_zc(Ring *ring, PyObject *args, __u64 *user_data) {
+  prep_fd fd;
+  int flags = 0;
+  unsigned int zc_flags = 0;
+  PyObject *obj;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "O&O|iIO:prep_send_zc", fd_converter, &fd, &obj,
+                        &flags, &zc_flags, &data))
+    return -1;
+
+  PyObject *view = pinned_view(obj, 0);
+  if (view == NULL) return -1;
+  Py_buffer *buf = PyMemoryView_GET_BUFFER(view);
+
+  int err;
+  struct io_uring_sqe *sqe =
+      prep_begin_pinned(ring, NULL, view, data, user_data, &err);
+  Py_DECREF(view);
+  if (sqe == NULL) return err;
+  io_uring_prep_send_zc(sqe, fd.fd, buf->buf, buf->len, flags, zc_flags);
+  sqe->flags |= fd.flags;
+  sqe->user_data = *user_data;
+  ring_sqe_end(ring);
+  return 0;
+}
+
+/* Zero copy send out of a registered buffer, held until its notification */
+static int prep_send_zc_fixed(Ring *ring, PyObject *args, __u64 *user_data) {
+  prep_fd fd;
+  unsigned int index, zc_flags = 0;
+  Py_ssize_t nbytes = 0, buf_offset = 0;
+  int flags = 0;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "O&I|nniIO:prep_send_zc_fixed", fd_converter,
+                        &fd, &index, &nbytes, &buf_offset, &flags, &zc_flags,
+                        &data))
+    return -1;
+
+  if (index >= ring->nr_buffers || ring->buffers[index] == NULL) {
+    PyErr_Format(PyExc_IndexError, "no registered buffer at index %u", index);
+    return -1;
+  }
+  /* The view stays with the operation if the slot is updated meanwhile */
+  PyObject *keep = ring->buffers[index];
+  Py_buffer *view = PyMemoryView_GET_BUFFER(keep);
+  if (buf_offset < 0 || nbytes < 0 || buf_offset > view->len ||
+      nbytes > view->len - buf_offset) {
+    PyErr_SetString(PyExc_ValueError, "range out of registered buffer");
+    return -1;
+  }
+  if (nbytes == 0) nbytes = view->len - buf_offset;
+
+  int err;
+  struct io_uring_sqe *sqe =
+      prep_begin_pinned(ring, NULL, keep, data, user_data, &err);
+  if (sqe == NULL) return err;
+  io_uring_prep_send_zc_fixed(sqe, fd.fd, (char *)view->buf + buf_offset,
+                              nbytes, flags, zc_flags, index);
+  sqe->flags |= fd.flags;
+  sqe->user_data = *user_data;
+  ring_sqe_end(ring);
+  return 0;
+}
+
+static int prep_recv(Ring *ring, PyObject *args, __u64 *user_data) {
+  prep_fd fd;
+  prep_dest dest;
+  int flags = 0;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "O&O&|iO:prep_recv", fd_converter, &fd,
+                        dest_converter, &dest, &flags, &data))
+    return -1;
+
+  int err;
+  struct io_uring_sqe *sqe =
+      prep_begin_pinned(ring, NULL, dest.keep, data, user_data, &err);
+  if (sqe != NULL) {
+    io_uring_prep_recv(sqe, fd.fd, dest.buf, dest.len, flags);
+    dest_select(sqe, &dest);
+    sqe->flags |= fd.flags;
+    sqe->user_data = *user_data;
+    ring_sqe_end(ring);
+  }
+  dest_converter(NULL, &dest);
+  return sqe == NULL ? err : 0;
+}
+
+/* Receive until cancelled or out of buffers, each into a buffer of pool */
+static int prep_recv_multishot(Ring *ring, PyObject *args,
+                               __u64 *user_data) {
+  prep_fd fd;
+  BufferRing *pool;
+  int flags = 0;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "O&O!|iO:prep_recv_multishot", fd_converter,
+                        &fd, &buffer_ring_type, &pool, &flags, &data))
+    return -1;
+  if (pool->state == NULL) {
+    PyErr_SetString(PyExc_ValueError, "BufferRing is not set up");
+    return -1;
+  }
+
+  int err;
+  struct io_uring_sqe *sqe =
+      prep_begin_pinned(ring, NULL, (PyObject *)pool, data, user_data, &err);
+  if (sqe == NULL) return err;
+  io_uring_prep_recv_multishot(sqe, fd.fd, NULL, 0, flags);
+  sqe->flags |= fd.flags | IOSQE_BUFFER_SELECT;
+  sqe->buf_group = pool->group;
+  sqe->user_data = *user_data;
+  ring_sqe_end(ring);
+  return 0;
+}
+
+static int prep_accept(Ring *ring, PyObject *args, __u64 *user_data) {
+  prep_fd fd;
+  int flags = 0;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "O&|iO:prep_accept", fd_converter, &fd, &flags,
+                        &data))
+    return -1;
+
+  int err;
+  struct io_uring_sqe *sqe = prep_begin(ring, NULL, data, user_data, &err);
+  if (sqe == NULL) return err;
+  io_uring_prep_accept(sqe, fd.fd, NULL, NULL, flags);
+  sqe->flags |= fd.flags;
+  sqe->user_data = *user_data;
+  ring_sqe_end(ring);
+  return 0;
+}
+
+/*
+ * Accept connections until cancelled, one completion each. Unless direct,
+ * the results are plain descriptors; direct ones go into slots of the file
+ * table the kernel picks.
+ */
+static int prep_multishot_accept(Ring *ring, PyObject *args,
+                                 __u64 *user_data) {
+  prep_fd fd;
+  int flags = 0, direct = 0;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "O&|ipO:prep_multishot_accept", fd_converter,
+                        &fd, &flags, &direct, &data))
+    return -1;
+
+  int err;
+  struct io_uring_sqe *sqe = prep_begin(ring, NULL, data, user_data, &err);
+  if (sqe == NULL) return err;
+  if (direct)
+    io_uring_prep_multishot_accept_direct(sqe, fd.fd, NULL, NULL, flags);
+  else
+    io_uring_prep_multishot_accept(sqe, fd.fd, NULL, NULL, flags);
+  sqe->flags |= fd.flags;
+  sqe->user_data = *user_data;
+  ring_sqe_end(ring);
+  return 0;
+}
+
+/* Accept straight into a slot of the file table, FILE_INDEX_ALLOC picks one */
+static int prep_accept_direct(Ring *ring, PyObject *args, __u64 *user_data) {
+  prep_fd fd;
+  int flags = 0;
+  unsigned int file_index = IORING_FILE_INDEX_ALLOC;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "O&|iIO:prep_accept_direct", fd_converter, &fd,
+                        &flags, &file_index, &data))
+    return -1;
+
+  int err;
+  struct io_uring_sqe *sqe = prep_begin(ring, NULL, data, user_data, &err);
+  if (sqe == NULL) return err;
+  io_uring_prep_accept_direct(sqe, fd.fd, NULL, NULL, flags, file_index);
+  sqe->flags |= fd.flags;
+  sqe->user_data = *user_data;
+  ring_sqe_end(ring);
+  return 0;
+}
+
+static int prep_connect(Ring *ring, PyObject *args, __u64 *user_data) {
+  prep_fd fd;
+  PyObject *address;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "O&O|O:prep_connect", fd_converter, &fd,
+                        &address, &data))
+    return -1;
+
+  PyObject *addr = sockaddr_from_address(&fd, address);
+  if (addr == NULL) return -1;
+
+  int err;
+  struct io_uring_sqe *sqe = prep_begin(ring, addr, data, user_data, &err);
+  Py_DECREF(addr);
+  if (sqe == NULL) return err;
+  io_uring_prep_connect(sqe, fd.fd,
+                        (struct sockaddr *)PyBytes_AS_STRING(addr),
+                        PyBytes_GET_SIZE(addr));
+  sqe->flags |= fd.flags;
+  sqe->user_data = *user_data;
+  ring_sqe_end(ring);
+  return 0;
+}
+
+static int prep_timeout(Ring *ring, PyObject *args, __u64 *user_data) {
+  double seconds;
+  unsigned int count = 0, flags = 0;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "d|IIO:prep_timeout", &seconds, &count, &flags,
+                        &data))
+    return -1;
+  if (seconds < 0) {
+    PyErr_SetString(PyExc_ValueError, "timeout must be non-negative");
+    return -1;
+  }
+
+  PyObject *tsobj =
+      PyBytes_FromStringAndSize(NULL, sizeof(struct __kernel_timespec));
+  if (tsobj == NULL) return -1;
+  struct __kernel_timespec *ts =
+      (struct __kernel_timespec *)PyBytes_AS_STRING(tsobj);
+  ts->tv_sec = (long long)seconds;
+  ts->tv_nsec = (long long)((seconds - (double)ts->tv_sec) * 1e9);
+
+  int err;
+  struct io_uring_sqe *sqe = prep_begin(ring, tsobj, data, user_data, &err);
+  Py_DECREF(tsobj);
+  if (sqe == NULL) return err;
+  io_uring_prep_timeout(sqe, ts, count, flags);
+  sqe->user_data = *user_data;
+  ring_sqe_end(ring);
+  return 0;
+}
+
+/*
+ * Time limit of the operation linked right before it, which is cancelled
+ * with -ECANCELED once the timeout fires with -ETIME.
+ */
+static int prep_link_timeout(Ring *ring, PyObject *args, __u64 *user_data) {
+  double seconds;
+  unsigned int flags = 0;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "d|IO:prep_link_timeout", &seconds, &flags,
+                        &data))
+    return -1;
+  if (seconds < 0) {
+    PyErr_SetString(PyExc_ValueError, "timeout must be non-negative");
+    return -1;
+  }
+
+  PyObject *tsobj =
+      PyBytes_FromStringAndSize(NULL, sizeof(struct __kernel_timespec));
+  if (tsobj == NULL) return -1;
+  struct __kernel_timespec *ts =
+      (struct __kernel_timespec *)PyBytes_AS_STRING(tsobj);
+  ts->tv_sec = (long long)seconds;
+  ts->tv_nsec = (long long)((seconds - (double)ts->tv_sec) * 1e9);
+
+  int err;
+  struct io_uring_sqe *sqe = prep_begin(ring, tsobj, data, user_data, &err);
+  Py_DECREF(tsobj);
+  if (sqe == NULL) return err;
+  io_uring_prep_link_timeout(sqe, ts, flags);
+  sqe->user_data = *user_data;
+  ring_sqe_end(ring);
+  return 0;
+}
+
+/*
+ * Post a completion with res and msg_data as user_data to the ring target.
+ * The operation itself completes on this ring as usual.
+ */
+static int prep_msg_ring(Ring *ring, PyObject *args, __u64 *user_data) {
+  prep_fd target;
+  int res;
+  unsigned long long msg_data;
+  unsigned int flags = 0;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "O&iK|IO:prep_msg_ring", ring_fd_converter,
+                        &target, &res, &msg_data, &flags, &data))
+    return -1;
+
+  int err;
+  struct io_uring_sqe *sqe = prep_begin(ring, NULL, data, user_data, &err);
+  if (sqe == NULL) return err;
+  io_uring_prep_msg_ring(sqe, target.fd, (unsigned int)res, msg_data, flags);
+  sqe->flags |= target.flags;
+  sqe->user_data = *user_data;
+  ring_sqe_end(ring);
+  return 0;
+}
+
+/*
+ * Post a completion to the ring fd right away, e.g. to wake up the thread
+ * waiting on it. Any thread may call it while another one waits on this
+ * ring. The entry skips its own completion when it succeeds, so there is
+ * nothing to consume here unless it failed. Returns 0, or -1 with an
+ * exception set.
+ */
+int ring_msg_ring(Ring *ring, int fd, unsigned int sqe_flags, int res,
+                  __u64 msg_data) {
+  struct io_uring_sqe *sqe = ring_sqe_begin(ring, NULL);
+  if (sqe == NULL) {
+    ring_sq_full();
+    return -1;
+  }
+  /* Reserved user_data that no other entry of the ring can carry */
+  __u64 user_data = TOKEN_FLAG |
+                    (__u64)(ring->msg_seq++ & 0x7fffffffu) << 32 |
+                    TOKEN_RESERVED;
+  io_uring_prep_msg_ring(sqe, fd, (unsigned int)res, msg_data, 0);
+  sqe->flags |= sqe_flags | IOSQE_CQE_SKIP_SUCCESS;
+  sqe->user_data = user_data;
+  int ret = ring_submit_locked(ring);
+  ring_sqe_end(ring);
+
+  /*
+   * Submitting issues MSG_RING inline, so a failure is posted by now. The
+   * SQPOLL thread may issue it later instead, then a failure reaches the
+   * consumer as a completion without data.
+   */
+  if (ret >= 0) {
+    RING_LOCK(ring->cq_lock);
+    if (!ring_cq_take(ring, user_data, &ret)) ret = 0;
+    RING_UNLOCK(ring->cq_lock);
+  }
+
+  if (ret < 0) {
+    PyErr_SetString(PyExc_RuntimeError, strerror(-ret));
+    return -1;
+  }
+  return 0;
+}
+
+PyObject *RingMsgRing(PyObject *self, PyObject *args) {
+  prep_fd target;
+  int res = 0;
+  unsigned long long msg_data = 0;
+  if (!PyArg_ParseTuple(args, "O&|iK:msg_ring", ring_fd_converter, &target,
+                        &res, &msg_data))
+    return NULL;
+
+  if (ring_msg_ring((Ring *)self, target.fd, target.flags, res, msg_data) < 0)
+    return NULL;
+  Py_RETURN_NONE;
+}
+
+/* Cancel the operation queued with user_data target */
+static int prep_cancel(Ring *ring, PyObject *args, __u64 *user_data) {
+  unsigned long long target;
+  int flags = 0;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "K|iO:prep_cancel", &target, &flags, &data))
+    return -1;
+
+  int err;
+  struct io_uring_sqe *sqe = prep_begin(ring, NULL, data, user_data, &err);
+  if (sqe == NULL) return err;
+  io_uring_prep_cancel64(sqe, target, flags);
+  sqe->user_data = *user_data;
+  ring_sqe_end(ring);
+  return 0;
+}
+
+/* Cancel the operations on fd, all of them unless flags say otherwise */
+static int prep_cancel_fd(Ring *ring, PyObject *args, __u64 *user_data) {
+  prep_fd fd;
+  unsigned int flags = IORING_ASYNC_CANCEL_ALL;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "O&|IO:prep_cancel_fd", fd_converter, &fd,
+                        &flags, &data))
+    return -1;
+
+  int err;
+  struct io_uring_sqe *sqe = prep_begin(ring, NULL, data, user_data, &err);
+  if (sqe == NULL) return err;
+  io_uring_prep_cancel_fd(sqe, fd.fd, flags);
+  if (fd.flags & IOSQE_FIXED_FILE)
+    sqe->cancel_flags |= IORING_ASYNC_CANCEL_FD_FIXED;
+  sqe->user_data = *user_data;
+  ring_sqe_end(ring);
+  return 0;
+}
+
+/*
+ * Queue a cancellation nobody waits for. Its completion is skipped when it
+ * succeeds, a failure comes back with user_data 0 and is ignored; either
+ * way the cancelled operations complete with -ECANCELED and release their
+ * data then. It goes with the next submission, so cancelling many
+ * operations at once costs a single system call.
+ */
+static PyObject *ring_cancel(Ring *ring, int fd, __u64 target,
+                             unsigned int flags) {
+  struct io_uring_sqe *sqe = ring_sqe_begin(ring, NULL);
+  if (sqe == NULL) return ring_sq_full();
+  if (flags & IORING_ASYNC_CANCEL_FD)
+    io_uring_prep_cancel_fd(sqe, fd, flags & ~IORING_ASYNC_CANCEL_FD);
+  else
+    io_uring_prep_cancel64(sqe, target, flags);
+  if (ring->ring.features & IORING_FEAT_CQE_SKIP)
+    sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+  sqe->user_data = 0;
+  ring_sqe_end(ring);
+  Py_RETURN_NONE;
+}
+
+static char *ring_cancel_kwds[] = {"target", "all", NULL};
+
+PyObject *RingCancel(PyObject *self, PyObject *args, PyObject *kwds) {
+  unsigned long long target;
+  int all = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "K|$p:cancel", ring_cancel_kwds,
+                                   &target, &all))
+    return NULL;
+  return ring_cancel((Ring *)self, -1, target,
+                     all ? IORING_ASYNC_CANCEL_ALL : 0);
+}
+
+PyObject *RingCancelFd(PyObject *self, PyObject *args) {
+  prep_fd fd;
+  if (!PyArg_ParseTuple(args, "O&:cancel_fd", fd_converter, &fd)) return NULL;
+
+  unsigned int flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  if (fd.flags & IOSQE_FIXED_FILE) flags |= IORING_ASYNC_CANCEL_FD_FIXED;
+  return ring_cancel((Ring *)self, fd.fd, 0, flags);
+}
+
+PyObject *RingCancelAll(PyObject *self, PyObject *args) {
+  (void)args;
+  return ring_cancel((Ring *)self, -1, 0,
+                     IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL);
+}
+
+static int prep_close(Ring *ring, PyObject *args, __u64 *user_data) {
+  prep_fd fd;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "O&|O:prep_close", fd_converter, &fd, &data))
+    return -1;
+
+  int err;
+  struct io_uring_sqe *sqe = prep_begin(ring, NULL, data, user_data, &err);
+  if (sqe == NULL) return err;
+  /* a slot of the file table is closed by clearing it */
+  if (fd.flags & IOSQE_FIXED_FILE)
+    io_uring_prep_close_direct(sqe, fd.fd);
+  else
+    io_uring_prep_close(sqe, fd.fd);
+  sqe->user_data = *user_data;
+  ring_sqe_end(ring);
+  return 0;
+}
+
+static int prep_openat(Ring *ring, PyObject *args, __u64 *user_data) {
+  int dfd, flags;
+  unsigned int mode = 0644;
+  PyObject *path;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "iO&i|IO:prep_openat", &dfd,
+                        PyUnicode_FSConverter, &path, &flags, &mode,
+                        &data))
+    return -1;
+
+  int err;
+  struct io_uring_sqe *sqe = prep_begin(ring, path, data, user_data, &err);
+  Py_DECREF(path);
+  if (sqe == NULL) return err;
+  io_uring_prep_openat(sqe, dfd, PyBytes_AS_STRING(path), flags, mode);
+  sqe->user_data = *user_data;
+  ring_sqe_end(ring);
+  return 0;
+}
+
+/* Open straight into a slot of the file table, FILE_INDEX_ALLOC picks one */
+static int prep_openat_direct(Ring *ring, PyObject *args, __u64 *user_data) {
+  int dfd, flags;
+  unsigned int mode = 0644, file_index = IORING_FILE_INDEX_ALLOC;
+  PyObject *path;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "iO&i|IIO:prep_openat_direct", &dfd,
+                        PyUnicode_FSConverter, &path, &flags, &mode,
+                        &file_index, &data))
+    return -1;
+
+  int err;
+  struct io_uring_sqe *sqe = prep_begin(ring, path, data, user_data, &err);
+  Py_DECREF(path);
+  if (sqe == NULL) return err;
+  io_uring_prep_openat_direct(sqe, dfd, PyBytes_AS_STRING(path), flags, mode,
+                              file_index);
+  sqe->user_data = *user_data;
+  ring_sqe_end(ring);
+  return 0;
+}
+
+static int prep_statx(Ring *ring, PyObject *args, __u64 *user_data) {
+  int dfd, flags;
+  unsigned int mask;
+  PyObject *path;
+  PyObject *view = NULL;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "iO&iIO&|O:prep_statx", &dfd,
+                        PyUnicode_FSConverter, &path, &flags, &mask,
+                        writable_view_converter, &view, &data))
+    return -1;
+
+  Py_buffer *buf = PyMemoryView_GET_BUFFER(view);
+  if ((size_t)buf->len < sizeof(struct statx)) {
+    PyErr_Format(PyExc_ValueError, "statx buffer must hold %zu bytes",
+                 sizeof(struct statx));
+    Py_DECREF(view);
+    Py_DECREF(path);
+    return -1;
+  }
+
+  /* Before 5.19 the kernel reads the path at issue, not at submit */
+  PyObject *pinned = PyTuple_Pack(2, view, path);
+  Py_DECREF(view);
+  Py_DECREF(path);
+  if (pinned == NULL) return -1;
+
+  int err;
+  struct io_uring_sqe *sqe =
+      prep_begin_pinned(ring, NULL, pinned, data, user_data, &err);
+  if (sqe != NULL) {
+    io_uring_prep_statx(sqe, dfd, PyBytes_AS_STRING(path), flags, mask,
+                        (struct statx *)buf->buf);
+    sqe->user_data = *user_data;
+    ring_sqe_end(ring);
+  }
+  Py_DECREF(pinned);
+  return sqe == NULL ? err : 0;
+}
+
+static int prep_fsync(Ring *ring, PyObject *args, __u64 *user_data) {
+  prep_fd fd;
+  unsigned int flags = 0;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "O&|IO:prep_fsync", fd_converter, &fd, &flags,
+                        &data))
+    return -1;
+
+  int err;
+  struct io_uring_sqe *sqe = prep_begin(ring, NULL, data, user_data, &err);
+  if (sqe == NULL) return err;
+  io_uring_prep_fsync(sqe, fd.fd, flags);
+  sqe->flags |= fd.flags;
+  sqe->user_data = *user_data;
+  ring_sqe_end(ring);
+  return 0;
+}
+
+/*
+ * Move nbytes from fd_in to fd_out without copying them to user space, one
+ * of the two has to be a pipe. An offset of -1 uses the file position, and
+ * has to be used for pipes and sockets.
+ */
+static int prep_splice(Ring *ring, PyObject *args, __u64 *user_data) {
+  prep_fd fd_in, fd_out;
+  long long off_in, off_out;
+  unsigned int nbytes, flags = 0;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "O&LO&LI|IO:prep_splice", fd_converter, &fd_in,
+                        &off_in, fd_converter, &fd_out, &off_out, &nbytes,
+                        &flags, &data))
+    return -1;
+
+  if (fd_in.flags & IOSQE_FIXED_FILE) flags |= SPLICE_F_FD_IN_FIXED;
+
+  int err;
+  struct io_uring_sqe *sqe = prep_begin(ring, NULL, data, user_data, &err);
+  if (sqe == NULL) return err;
+  io_uring_prep_splice(sqe, fd_in.fd, off_in, fd_out.fd, off_out, nbytes,
+                       flags);
+  sqe->flags |= fd_out.flags;
+  sqe->user_data = *user_data;
+  ring_sqe_end(ring);
+  return 0;
+}
+
+/* Duplicate nbytes of pipe fd_in into pipe fd_out without consuming them */
+static int prep_tee(Ring *ring, PyObject *args, __u64 *user_data) {
+  prep_fd fd_in, fd_out;
+  unsigned int nbytes, flags = 0;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "O&O&I|IO:prep_tee", fd_converter, &fd_in,
+                        fd_converter, &fd_out, &nbytes, &flags, &data))
+    return -1;
+
+  if (fd_in.flags & IOSQE_FIXED_FILE) flags |= SPLICE_F_FD_IN_FIXED;
+
+  int err;
+  struct io_uring_sqe *sqe = prep_begin(ring, NULL, data, user_data, &err);
+  if (sqe == NULL) return err;
+  io_uring_prep_tee(sqe, fd_in.fd, fd_out.fd, nbytes, flags);
+  sqe->flags |= fd_out.flags;
+  sqe->user_data = *user_data;
+  ring_sqe_end(ring);
+  return 0;
+}
+
+/* Allocate or punch length bytes at offset, mode as for fallocate(2) */
+static int prep_fallocate(Ring *ring, PyObject *args, __u64 *user_data) {
+  prep_fd fd;
+  int mode;
+  unsigned long long offset, length;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "O&iKK|O:prep_fallocate", fd_converter, &fd,
+                        &mode, &offset, &length, &data))
+    return -1;
+
+  int err;
+  struct io_uring_sqe *sqe = prep_begin(ring, NULL, data, user_data, &err);
+  if (sqe == NULL) return err;
+  io_uring_prep_fallocate(sqe, fd.fd, mode, offset, length);
+  sqe->flags |= fd.flags;
+  sqe->user_data = *user_data;
+  ring_sqe_end(ring);
+  return 0;
+}
+
+/* Wait for poll events on fd, errors and hangups are always reported */
+static int prep_poll_add(Ring *ring, PyObject *args, __u64 *user_data) {
+  prep_fd fd;
+  unsigned int mask;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "O&I|O:prep_poll_add", fd_converter, &fd, &mask,
+                        &data))
+    return -1;
+
+  int err;
+  struct io_uring_sqe *sqe = prep_begin(ring, NULL, data, user_data, &err);
+  if (sqe == NULL) return err;
+  io_uring_prep_poll_add(sqe, fd.fd, mask);
+  sqe->flags |= fd.flags;
+  sqe->user_data = *user_data;
+  ring_sqe_end(ring);
+  return 0;
+}
+
+static int prep_fixed(Ring *ring, PyObject *args, __u64 *user_data,
+                      int opcode) {
+  prep_fd fd;
+  unsigned int index;
+  unsigned long long offset;
+  Py_ssize_t nbytes = 0, buf_offset = 0;
+  PyObject *data = NULL;
+  if (!PyArg_ParseTuple(args, "O&IK|nnO", fd_converter, &fd, &index, &offset,
+                        &nbytes, &buf_offset, &data))
+    return -1;
+
+  if (index >= ring->nr_buffers || ring->buffers[index] == NULL) {
+    PyErr_Format(PyExc_IndexError, "no registered buffer at index %u", index);
+    return -1;
+  }
+  /* The view stays with the operation if the slot is updated meanwhile */
+  PyObject *keep = ring->buffers[index];
+  Py_buffer *view = PyMemoryView_GET_BUFFER(keep);
+  if (buf_offset < 0 || nbytes < 0 || buf_offset > view->len ||
+      nbytes > view->len - buf_offset) {
+    PyErr_SetString(PyExc_ValueError, "range out of registered buffer");
+    return -1;
+  }
+  if (nbytes == 0) nbytes = view->len - buf_offset;
+
+  int err;
+  struct io_uring_sqe *sqe =
+      prep_begin_pinned(ring, NULL, keep, data, user_data, &err);
+  if (sqe == NULL) return err;
+  io_uring_prep_rw(opcode, sqe, fd.fd, (char *)view->buf + buf_offset, nbytes,
+                   offset);
+  sqe->buf_index = index;
+  sqe->flags |= fd.flags;
+  sqe->user_data = *user_data;
+  ring_sqe_end(ring);
+  return 0;
+}
+
+static int prep_read_fixed(Ring *ring, PyObject *args, __u64 *user_data) {
+  return prep_fixed(ring, args, user_data, IORING_OP_READ_FIXED);
+}
+
+static int prep_write_fixed(Ring *ring, PyObject *args, __u64 *user_data) {
+  return prep_fixed(ring, args, user_data, IORING_OP_WRITE_FIXED);
+}
+
+/* Helpers by opcode, used for batches of operation tuples */
+static const prep_fn prep_table[IORING_OP_LAST] = {
+    [IORING_OP_NOP] = prep_nop,       [IORING_OP_READ] = prep_read,
+    [IORING_OP_WRITE] = prep_write,   [IORING_OP_READV] = prep_readv,
+    [IORING_OP_WRITEV] = prep_writev, [IORING_OP_SEND] = prep_send,
+    [IORING_OP_RECV] = prep_recv,     [IORING_OP_ACCEPT] = prep_accept,
+    [IORING_OP_CONNECT] = prep_connect, [IORING_OP_TIMEOUT] = prep_timeout,
+    [IORING_OP_CLOSE] = prep_close,   [IORING_OP_OPENAT] = prep_openat,
+    [IORING_OP_STATX] = prep_statx,   [IORING_OP_FSYNC] = prep_fsync,
+    [IORING_OP_FALLOCATE] = prep_fallocate,
+    [IORING_OP_SEND_ZC] = prep_send_zc,
+    [IORING_OP_SPLICE] = prep_splice,
+    [IORING_OP_TEE] = prep_tee,
+    [IORING_OP_POLL_ADD] = prep_poll_add,
+    [IORING_OP_ASYNC_CANCEL] = prep_cancel,
+    [IORING_OP_MSG_RING] = prep_msg_ring,
+    [IORING_OP_LINK_TIMEOUT] = prep_link_timeout,
+    [IORING_OP_READ_FIXED] = prep_read_fixed,
+    [IORING_OP_WRITE_FIXED] = prep_write_fixed,
+};
+
+prep_fn prep_for_opcode(long opcode) {
+  if (opcode < 0 || opcode >= IORING_OP_LAST) return NULL;
+  return prep_table[opcode];
+}
+
+#define PREP_METHOD(name, func)                          \
+  PyObject *name(PyObject *self, PyObject *args) {       \
+    __u64 user_data;                                     \
+    int err = func((Ring *)self, args, &user_data);      \
+    return prep_result(err, user_data);                  \
+  }
+
+PREP_METHOD(RingPrepNop, prep_nop)
+PREP_METHOD(RingPrepRead, prep_read)
+PREP_METHOD(RingPrepWrite, prep_write)
+PREP_METHOD(RingPrepReadv, prep_readv)
+PREP_METHOD(RingPrepWritev, prep_writev)
+PREP_METHOD(RingPrepSend, prep_send)
+PREP_METHOD(RingPrepSendZC, prep_send_zc)
+PREP_METHOD(RingPrepSendZCFixed, prep_send_zc_fixed)
+PREP_METHOD(RingPrepRecv, prep_recv)
+PREP_METHOD(RingPrepAccept, prep_accept)
+PREP_METHOD(RingPrepConnect, prep_connect)
+PREP_METHOD(RingPrepTimeout, prep_timeout)
+PREP_METHOD(RingPrepLinkTimeout, prep_link_timeout)
+PREP_METHOD(RingPrepCancel, prep_cancel)
+PREP_METHOD(RingPrepCancelFd, prep_cancel_fd)
+PREP_METHOD(RingPrepClose, prep_close)
+PREP_METHOD(RingPrepOpenat, prep_openat)
+PREP_METHOD(RingPrepStatx, prep_statx)
+PREP_METHOD(RingPrepFsync, prep_fsync)
+PREP_METHOD(RingPrepFallocate, prep_fallocate)
+PREP_METHOD(RingPrepSplice, prep_splice)
+PREP_METHOD(RingPrepTee, prep_tee)
+PREP_METHOD(RingPrepPollAdd, prep_poll_add)
+PREP_METHOD(RingPrepReadFixed, prep_read_fixed)
+PREP_METHOD(RingPrepAcceptDirect, prep_accept_direct)
+PREP_METHOD(RingPrepMultishotAccept, prep_multishot_accept)
+PREP_METHOD(RingPrepRecvMultishot, prep_recv_multishot)
+PREP_METHOD(RingPrepOpenatDirect, prep_openat_direct)
+PREP_METHOD(RingPrepWriteFixed, prep_write_fixed)
+PREP_METHOD(RingPrepMsgRing, prep_msg_ring)
+
+/* Helpers by prep_* method, for operations sharing an opcode with another */
+static const struct {
+  PyCFunction method;
+  prep_fn prep;
+} prep_methods[] = {
+    {RingPrepNop, prep_nop},
+    {RingPrepRead, prep_read},
+    {RingPrepWrite, prep_write},
+    {RingPrepReadv, prep_readv},
+    {RingPrepWritev, prep_writev},
+    {RingPrepSend, prep_send},
+    {RingPrepSendZC, prep_send_zc},
+    {RingPrepSendZCFixed, prep_send_zc_fixed},
+    {RingPrepRecv, prep_recv},
+    {RingPrepAccept, prep_accept},
+    {RingPrepConnect, prep_connect},
+    {RingPrepTimeout, prep_timeout},
+    {RingPrepLinkTimeout, prep_link_timeout},
+    {RingPrepCancel, prep_cancel},
+    {RingPrepCancelFd, prep_cancel_fd},
+    {RingPrepClose, prep_close},
+    {RingPrepOpenat, prep_openat},
+    {RingPrepStatx, prep_statx},
+    {RingPrepFsync, prep_fsync},
+    {RingPrepFallocate, prep_fallocate},
+    {RingPrepSplice, prep_splice},
+    {RingPrepTee, prep_tee},
+    {RingPrepPollAdd, prep_poll_add},
+    {RingPrepReadFixed, prep_read_fixed},
+    {RingPrepAcceptDirect, prep_accept_direct},
+    {RingPrepMultishotAccept, prep_multishot_accept},
+    {RingPrepRecvMultishot, prep_recv_multishot},
+    {RingPrepOpenatDirect, prep_openat_direct},
+    {RingPrepWriteFixed, prep_write_fixed},
+    {RingPrepMsgRing, prep_msg_ring},
+};
+
+prep_fn prep_for_method(PyObject *method, PyObject *ring) {
+  if (!PyCFunction_Check(method) || PyCFunction_GET_SELF(method) != ring)
+    return NULL;
+
+  PyCFunction func = PyCFunction_GET_FUNCTION(method);
+  for (size_t i = 0; i < sizeof(prep_methods) / sizeof(prep_methods[0]); i++)
+    if (prep_methods[i].method == func) return prep_methods[i].prep;
+  return NULL;
+}
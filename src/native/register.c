@@ -0,0 +1,475 @@
+/*
+ * Copyright (c) 2021 Reza Mahdi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Registration of resources with the ring.
+ *
+ * Registered buffers are pinned by the kernel once instead of on every
+ * operation. The ring holds a memoryview of each, and so does every fixed
+ * operation until its completion, so they can neither go away nor be
+ * resized while the kernel may access them, even after an update or
+ * unregistration.
+ *
+ * Registered files spare the kernel the file reference counting of every
+ * operation. Their slots are passed to the prep helpers as FixedFile.
+ */
+
+#include <errno.h>
+#include <liburing.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "uring.h"
+
+/* Release pinned buffer views and the array holding them */
+static void release_views(PyObject **views, Py_ssize_t count) {
+  for (Py_ssize_t i = 0; i < count; i++) Py_XDECREF(views[i]);
+  PyMem_Free(views);
+}
+
+/*
+ * Take a writable memoryview of every buffer of a sequence and describe it
+ * with an iovec. None leaves an empty slot. Returns the number of buffers
+ * or -1 on error.
+ */
+static Py_ssize_t pin_buffers(PyObject *buffers, PyObject ***views,
+                              struct iovec **iovecs) {
+  PyObject *seq = PySequence_Fast(buffers, "buffers must be a sequence");
+  if (seq == NULL) return -1;
+
+  Py_ssize_t count = PySequence_Fast_GET_SIZE(seq);
+  *views = PyMem_Calloc(count ? count : 1, sizeof(PyObject *));
+  *iovecs = PyMem_Calloc(count ? count : 1, sizeof(struct iovec));
+  if (*views == NULL || *iovecs == NULL) {
+    PyErr_NoMemory();
+    goto error;
+  }
+
+  for (Py_ssize_t i = 0; i < count; i++) {
+    PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+    if (item == Py_None) continue;
+    PyObject *view = PyMemoryView_FromObject(item);
+    if (view == NULL) goto error;
+    (*views)[i] = view;
+    Py_buffer *buf = PyMemoryView_GET_BUFFER(view);
+    if (buf->readonly || !PyBuffer_IsContiguous(buf, 'C')) {
+      PyErr_SetString(PyExc_TypeError,
+                      "buffer must be writable and contiguous");
+      goto error;
+    }
+    (*iovecs)[i].iov_base = buf->buf;
+    (*iovecs)[i].iov_len = buf->len;
+  }
+
+  Py_DECREF(seq);
+  return count;
+
+error:
+  if (*views != NULL) release_views(*views, count);
+  PyMem_Free(*iovecs);
+  Py_DECREF(seq);
+  return -1;
+}
+
+void ring_buffers_clear(Ring *ring) {
+  release_views(ring->buffers, ring->nr_buffers);
+  ring->buffers = NULL;
+  ring->nr_buffers = 0;
+}
+
+/* Register a list of buffers, or a number of empty slots, with the ring */
+PyObject *RingRegisterBuffers(PyObject *self, PyObject *args) {
+  Ring *ring = (Ring *)self;
+  PyObject *buffers;
+  PyObject **views;
+  struct iovec *iovecs = NULL;
+  Py_ssize_t count;
+  int err;
+
+  if (!PyArg_ParseTuple(args, "O:register_buffers", &buffers)) return NULL;
+
+  if (PyLong_Check(buffers)) {
+    count = PyLong_AsSsize_t(buffers);
+    if (count == -1 && PyErr_Occurred()) return NULL;
+    if (count < 1 || count > UINT_MAX) {
+      PyErr_SetString(PyExc_ValueError, "number of buffers out of range");
+      return NULL;
+    }
+    views = PyMem_Calloc(count, sizeof(PyObject *));
+    if (views == NULL) return PyErr_NoMemory();
+  } else {
+    count = pin_buffers(buffers, &views, &iovecs);
+    if (count < 0) return NULL;
+  }
+
+  /* sq_lock keeps registrations and submissions from interleaving */
+  RING_LOCK(ring->sq_lock);
+  if (ring->buffers != NULL) {
+    err = -EBUSY;
+  } else {
+    Py_BEGIN_ALLOW_THREADS;
+    if (iovecs == NULL)
+      err = io_uring_register_buffers_sparse(&ring->ring, count);
+    else
+      err = io_uring_register_buffers(&ring->ring, iovecs, count);
+    Py_END_ALLOW_THREADS;
+    if (err == 0) {
+      ring->buffers = views;
+      ring->nr_buffers = count;
+    }
+  }
+  RING_UNLOCK(ring->sq_lock);
+
+  PyMem_Free(iovecs);
+  if (err < 0) {
+    release_views(views, count);
+    PyErr_SetString(PyExc_RuntimeError, strerror(-err));
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+/* Replace registered buffers starting at slot offset */
+PyObject *RingUpdateBuffers(PyObject *self, PyObject *args) {
+  Ring *ring = (Ring *)self;
+  unsigned int offset;
+  PyObject *buffers;
+  PyObject **views;
+  struct iovec *iovecs;
+  int err;
+
+  if (!PyArg_ParseTuple(args, "IO:update_buffers", &offset, &buffers))
+    return NULL;
+
+  Py_ssize_t count = pin_buffers(buffers, &views, &iovecs);
+  if (count < 0) return NULL;
+
+  RING_LOCK(ring->sq_lock);
+  if (ring->buffers == NULL) {
+    err = -ENXIO;
+  } else if (offset > ring->nr_buffers ||
+             count > ring->nr_buffers - offset) {
+    err = -EINVAL;
+  } else {
+    Py_BEGIN_ALLOW_THREADS;
+    err = io_uring_register_buffers_update_tag(&ring->ring, offset, iovecs,
+                                               NULL, count);
+    Py_END_ALLOW_THREADS;
+    if (err >= 0) {
+      /* swap, so the replaced views are released below */
+      for (Py_ssize_t i = 0; i < count; i++) {
+        PyObject *old = ring->buffers[offset + i];
+        ring->buffers[offset + i] = views[i];
+        views[i] = old;
+      }
+    }
+  }
+  RING_UNLOCK(ring->sq_lock);
+
+  PyMem_Free(iovecs);
+  release_views(views, count);
+  if (err < 0) {
+    PyErr_SetString(PyExc_RuntimeError, strerror(-err));
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+/* Unregister all buffers and release them */
+PyObject *RingUnregisterBuffers(PyObject *self, PyObject *args) {
+  (void)args;
+  Ring *ring = (Ring *)self;
+  int err;
+
+  RING_LOCK(ring->sq_lock);
+  if (ring->buffers == NULL) {
+    err = -ENXIO;
+  } else {
+    Py_BEGIN_ALLOW_THREADS;
+    err = io_uring_unregister_buffers(&ring->ring);
+    Py_END_ALLOW_THREADS;
+    if (err == 0) ring_buffers_clear(ring);
+  }
+  RING_UNLOCK(ring->sq_lock);
+
+  if (err < 0) {
+    PyErr_SetString(PyExc_RuntimeError, strerror(-err));
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+/*
+ * Read a sequence of descriptors for the file table into a new array, -1
+ * leaves a slot empty. Returns the number of descriptors or -1 on error.
+ */
+static Py_ssize_t fds_from_sequence(PyObject *files, int **fds) {
+  PyObject *seq = PySequence_Fast(files, "files must be a sequence");
+  if (seq == NULL) return -1;
+
+  Py_ssize_t count = PySequence_Fast_GET_SIZE(seq);
+  *fds = PyMem_New(int, count ? count : 1);
+  if (*fds == NULL) {
+    Py_DECREF(seq);
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  for (Py_ssize_t i = 0; i < count; i++) {
+    PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+    long fd = PyLong_Check(item) ? PyLong_AsLong(item)
+                                 : PyObject_AsFileDescriptor(item);
+    if (fd == -1 && PyErr_Occurred()) goto error;
+    if (fd < -1 || fd > INT_MAX) {
+      PyErr_SetString(PyExc_ValueError, "invalid file descriptor");
+      goto error;
+    }
+    (*fds)[i] = fd;
+  }
+
+  Py_DECREF(seq);
+  return count;
+
+error:
+  PyMem_Free(*fds);
+  Py_DECREF(seq);
+  return -1;
+}
+
+/* Register a table of file descriptors, or of empty slots */
+PyObject *RingRegisterFiles(PyObject *self, PyObject *args) {
+  Ring *ring = (Ring *)self;
+  PyObject *files;
+  int *fds = NULL;
+  int err;
+
+  if (!PyArg_ParseTuple(args, "O:register_files", &files)) return NULL;
+
+  Py_ssize_t count;
+  if (PyLong_Check(files)) {
+    count = PyLong_AsSsize_t(files);
+    if (count == -1 && PyErr_Occurred()) return NULL;
+    if (count < 1 || count > UINT_MAX) {
+      PyErr_SetString(PyExc_ValueError, "number of files out of range");
+      return NULL;
+    }
+  } else {
+    count = fds_from_sequence(files, &fds);
+    if (count < 0) return NULL;
+  }
+
+  RING_LOCK(ring->sq_lock);
+  Py_BEGIN_ALLOW_THREADS;
+  if (fds == NULL)
+    err = io_uring_register_files_sparse(&ring->ring, count);
+  else
+    err = io_uring_register_files(&ring->ring, fds, count);
+  Py_END_ALLOW_THREADS;
+  RING_UNLOCK(ring->sq_lock);
+
+  PyMem_Free(fds);
+  if (err < 0) {
+    PyErr_SetString(PyExc_RuntimeError, strerror(-err));
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+/* Replace registered files starting at slot offset */
+PyObject *RingUpdateFiles(PyObject *self, PyObject *args) {
+  Ring *ring = (Ring *)self;
+  unsigned int offset;
+  PyObject *files;
+  int *fds;
+  int err;
+
+  if (!PyArg_ParseTuple(args, "IO:update_files", &offset, &files))
+    return NULL;
+
+  Py_ssize_t count = fds_from_sequence(files, &fds);
+  if (count < 0) return NULL;
+
+  RING_LOCK(ring->sq_lock);
+  Py_BEGIN_ALLOW_THREADS;
+  err = io_uring_register_files_update(&ring->ring, offset, fds, count);
+  Py_END_ALLOW_THREADS;
+  RING_UNLOCK(ring->sq_lock);
+
+  PyMem_Free(fds);
+  if (err < 0) {
+    PyErr_SetString(PyExc_RuntimeError, strerror(-err));
+    return NULL;
+  }
+  return PyLong_FromLong(err);
+}
+
+/* Unregister the file table */
+PyObject *RingUnregisterFiles(PyObject *self, PyObject *args) {
+  (void)args;
+  Ring *ring = (Ring *)self;
+  int err;
+
+  RING_LOCK(ring->sq_lock);
+  Py_BEGIN_ALLOW_THREADS;
+  err = io_uring_unregister_files(&ring->ring);
+  Py_END_ALLOW_THREADS;
+  RING_UNLOCK(ring->sq_lock);
+
+  if (err < 0) {
+    PyErr_SetString(PyExc_RuntimeError, strerror(-err));
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+/* Limit the slots the kernel picks for FILE_INDEX_ALLOC */
+PyObject *RingRegisterFileAllocRange(PyObject *self, PyObject *args) {
+  Ring *ring = (Ring *)self;
+  unsigned int offset, length;
+
+  if (!PyArg_ParseTuple(args, "II:register_file_alloc_range", &offset,
+                        &length))
+    return NULL;
+
+  int err = io_uring_register_file_alloc_range(&ring->ring, offset, length);
+  if (err < 0) {
+    PyErr_SetString(PyExc_RuntimeError, strerror(-err));
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+/*
+ * Have the kernel signal the eventfd fd for each posted completion, so
+ * another event loop can watch the ring by polling fd. With async_ only
+ * completions of operations that went async are signalled.
+ */
+PyObject *RingRegisterEventfd(PyObject *self, PyObject *args) {
+  Ring *ring = (Ring *)self;
+  int fd, async = 0;
+
+  if (!PyArg_ParseTuple(args, "i|p:register_eventfd", &fd, &async))
+    return NULL;
+
+  int err = async ? io_uring_register_eventfd_async(&ring->ring, fd)
+                  : io_uring_register_eventfd(&ring->ring, fd);
+  if (err < 0) {
+    PyErr_SetString(PyExc_RuntimeError, strerror(-err));
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+PyObject *RingUnregisterEventfd(PyObject *self, PyObject *args) {
+  (void)args;
+  Ring *ring = (Ring *)self;
+
+  int err = io_uring_unregister_eventfd(&ring->ring);
+  if (err < 0) {
+    PyErr_SetString(PyExc_RuntimeError, strerror(-err));
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+/*
+ * Register the ring fd with the calling thread, which then skips looking it
+ * up on every io_uring_enter. Only that thread may enter the ring afterwards,
+ * like a ring set up with RING_SETUP_SINGLE_ISSUER.
+ */
+PyObject *RingRegisterRingFd(PyObject *self, PyObject *args) {
+  (void)args;
+  Ring *ring = (Ring *)self;
+
+  int err = io_uring_register_ring_fd(&ring->ring);
+  if (err < 0) {
+    PyErr_SetString(PyExc_RuntimeError, strerror(-err));
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+PyObject *RingUnregisterRingFd(PyObject *self, PyObject *args) {
+  (void)args;
+  Ring *ring = (Ring *)self;
+
+  int err = io_uring_unregister_ring_fd(&ring->ring);
+  if (err < 0) {
+    PyErr_SetString(PyExc_RuntimeError, strerror(-err));
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+/*
+ * Enable a ring set up with RING_SETUP_R_DISABLED. With SINGLE_ISSUER the
+ * calling thread becomes the one submitting to it.
+ */
+PyObject *RingEnable(PyObject *self, PyObject *args) {
+  (void)args;
+  Ring *ring = (Ring *)self;
+
+  int err = io_uring_enable_rings(&ring->ring);
+  if (err < 0) {
+    PyErr_SetString(PyExc_RuntimeError, strerror(-err));
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+/////////////////////// FixedFile
+
+PyObject *FixedFileRepr(PyObject *self) {
+  return PyUnicode_FromFormat("FixedFile(%ld)", PyLong_AsLong(self));
+}
+
+PyTypeObject fixed_file_type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0) "_uring_io.FixedFile", /* tp_name */
+    0,                                  /* tp_basicsize */
+    0,                                  /* tp_itemsize */
+    0,                                  /* tp_dealloc */
+    0,                                  /* tp_print */
+    0,                                  /* tp_getattr */
+    0,                                  /* tp_setattr */
+    0,                                  /* tp_reserved */
+    (reprfunc)FixedFileRepr,            /* tp_repr */
+    0,                                  /* tp_as_number */
+    0,                                  /* tp_as_sequence */
+    0,                                  /* tp_as_mapping */
+    0,                                  /* tp_hash */
+    0,                                  /* tp_call */
+    0,                                  /* tp_str */
+    0,                                  /* tp_getattro */
+    0,                                  /* tp_setattro */
+    0,                                  /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                 /* tp_flags */
+    "Slot of the registered file table, usable wherever an fd is expected",
+    /* tp_doc */
+};
+
+extern void register_fixed_file(PyObject *mod) {
+  fixed_file_type.tp_base = &PyLong_Type;
+  if (PyType_Ready(&fixed_file_type) < 0) return;
+  Py_INCREF(&fixed_file_type);
+  if (PyModule_AddObject(mod, "FixedFile", (PyObject *)&fixed_file_type) < 0)
+    Py_DECREF(&fixed_file_type);
+}
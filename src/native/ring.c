@@ -53,37 +53,162 @@ int RingInit(PyObject *self, PyObject *args, PyObject *kwds) {
     return -1;
   }
 
+  /* entries is only set once the ring is actually set up */
+  if (ring->entries != NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "Ring is already set up");
+    return -1;
+  }
+
   if (params.sq_entries < 1) params.sq_entries = entries;
 
   if (params.cq_entries < 1) params.cq_entries = entries;
 
+  ring->sq_lock = PyThread_allocate_lock();
+  ring->cq_lock = PyThread_allocate_lock();
+  if (ring->sq_lock == NULL || ring->cq_lock == NULL) {
+    PyErr_NoMemory();
+    goto fail_locks;
+  }
+
   int err = io_uring_queue_init_params(entries, &ring->ring, &params);
   if (err != 0) {
-    Py_INCREF(self);
     PyErr_SetString(PyExc_RuntimeError, strerror(-err));
-    return -1;
+    goto fail_locks;
   }
+  ring->sqe_keep =
+      PyMem_Calloc(ring->ring.sq.ring_entries, sizeof(PyObject *));
+  if (ring->sqe_keep == NULL) {
+    PyErr_NoMemory();
+    goto fail_ring;
+  }
+  if (token_table_init(&ring->tokens, ring->ring.sq.ring_entries) < 0)
+    goto fail_keep;
   ring->entries = PyLong_FromLong(entries);
+  if (ring->entries == NULL) goto fail_tokens;
+  return 0;
+
+fail_tokens:
+  token_table_clear(&ring->tokens);
+fail_keep:
+  PyMem_Free(ring->sqe_keep);
+  ring->sqe_keep = NULL;
+fail_ring:
+  io_uring_queue_exit(&ring->ring);
+fail_locks:
+  if (ring->sq_lock != NULL) PyThread_free_lock(ring->sq_lock);
+  if (ring->cq_lock != NULL) PyThread_free_lock(ring->cq_lock);
+  ring->sq_lock = ring->cq_lock = NULL;
+  return -1;
+}
+
+/*
+ * Reserve the next SQE for a native prep helper. On success the sq_lock is
+ * held until the caller filled the entry and released it. keep is whatever
+ * the kernel dereferences while consuming the entry (iovecs, paths, ...); it
+ * lives until the slot comes around again, which the kernel only allows once
+ * it moved the SQ head past it.
+ */
+struct io_uring_sqe *ring_sqe_begin(Ring *ring, PyObject *keep) {
+  if (ring->sq_owner != PyThread_get_thread_ident())
+    RING_LOCK(ring->sq_lock);
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&ring->ring);
+
+  if (sqe == NULL) {
+    ring->stats.sq_full++;
+    ring_sqe_end(ring);
+    return NULL;
+  }
+  ring->stats.sqes_prepared++;
+
+  Py_XINCREF(keep);
+  Py_XSETREF(ring->sqe_keep[sqe - ring->ring.sq.sqes], keep);
+  return sqe;
+}
+
+/*
+ * Release the sq_lock taken by ring_sqe_begin. While a chain is prepared its
+ * thread owns the lock for all of its entries, see chain.c.
+ */
+void ring_sqe_end(Ring *ring) {
+  if (ring->sq_owner != PyThread_get_thread_ident())
+    RING_UNLOCK(ring->sq_lock);
+}
+
+/*
+ * Turn the object attached to an operation into its user_data. Integers
+ * below 2^63 are passed as they are, None is 0 and anything else is stored
+ * in the token table until its completion is consumed.
+ */
+int ring_user_data(Ring *ring, PyObject *data, __u64 *user_data) {
+  if (data == NULL || data == Py_None) {
+    *user_data = 0;
+    return 0;
+  }
+
+  if (PyLong_Check(data)) {
+    *user_data = PyLong_AsUnsignedLongLong(data);
+    if (*user_data == (__u64)-1 && PyErr_Occurred()) return -1;
+    if (TOKEN_CHECK(*user_data)) {
+      PyErr_SetString(PyExc_OverflowError, "user_data must be below 2**63");
+      return -1;
+    }
+    return 0;
+  }
+
+  *user_data = token_acquire(&ring->tokens, data);
+  return *user_data == 0 ? -1 : 0;
+}
+
+/*
+ * Like ring_user_data, but always takes a token, which also holds keep until
+ * the final completion of the operation. Integer data comes back as it is.
+ */
+int ring_user_data_keep(Ring *ring, PyObject *data, PyObject *keep,
+                        __u64 *user_data) {
+  *user_data = token_acquire(&ring->tokens, data ? data : Py_None);
+  if (*user_data == 0) return -1;
+  token_keep(&ring->tokens, *user_data, keep);
   return 0;
 }
 
+/* The operation of user_data is finished, drop the object it carries */
+void ring_user_data_done(Ring *ring, __u64 user_data) {
+  Py_XDECREF(token_release(&ring->tokens, user_data));
+}
+
+PyObject *ring_sq_full(void) {
+  PyErr_SetString(PyExc_RuntimeError, "Submission queue full");
+  return NULL;
+}
+
 /* Get a single SQE */
 PyObject *RingGetSQE(PyObject *self, PyObject *args) {
   (void)args;
   Ring *ring = (Ring *)self;
-  SQE *sqe = PyObject_New(SQE, &sqe_type);
-
-  struct io_uring_sqe *s = io_uring_get_sqe(&ring->ring);
 
-  if (s == NULL) {
-    PyErr_SetString(PyExc_RuntimeError, "Submission queue full");
-    return NULL;
-  }
+  /* A zeroed entry left behind by a failed allocation is a plain NOP */
+  struct io_uring_sqe *s = ring_sqe_begin(ring, NULL);
+  if (s == NULL) return ring_sq_full();
+  memset(s, 0, sizeof(*s));
+  ring_sqe_end(ring);
 
+  SQE *sqe = PyObject_New(SQE, &sqe_type);
+  if (sqe == NULL) return NULL;
   sqe->entry = s;
-  sqe->entry->user_data = (__u64)Py_None;
-  Py_INCREF(Py_None);
-  return PyObject_Init((PyObject *)sqe, &sqe_type);
+  sqe->ring = ring;
+  Py_INCREF(ring);
+  return (PyObject *)sqe;
+}
+
+/*
+ * Submit what is queued with the sq_lock held. An SQPOLL ring only enters
+ * the kernel when its poller thread went idle and has to be woken up, as
+ * long as the poller is awake it picks the new entries up by itself. Which
+ * of the two happened is counted in sq_wakeups and sq_skipped, see stats.c.
+ */
+int ring_submit_locked(Ring *ring) {
+  stats_submit(ring, 0);
+  return io_uring_submit(&ring->ring);
 }
 
 /* Submit a ring*/
@@ -91,154 +216,678 @@ PyObject *RingSubmit(PyObject *self, PyObject *args) {
   (void)args;
   Ring *ring = (Ring *)self;
 
-  int num = io_uring_submit(&ring->ring);
+  RING_LOCK(ring->sq_lock);
+  int num = ring_submit_locked(ring);
+  RING_UNLOCK(ring->sq_lock);
 
   return PyLong_FromLong(num);
 }
 
-/* Submit a ring and wait*/
+/* Fill SQEs from a buffer of packed struct io_uring_sqe records */
+static Py_ssize_t ring_fill_packed(Ring *ring, PyObject *ops) {
+  Py_buffer view;
+  Py_ssize_t accepted = 0;
+
+  if (PyObject_GetBuffer(ops, &view, PyBUF_SIMPLE)) return -1;
+  if (view.len % sizeof(struct io_uring_sqe)) {
+    PyErr_Format(PyExc_ValueError,
+                 "packed operations must be a multiple of %zu bytes",
+                 sizeof(struct io_uring_sqe));
+    PyBuffer_Release(&view);
+    return -1;
+  }
+
+  const struct io_uring_sqe *records = view.buf;
+  Py_ssize_t count = view.len / sizeof(struct io_uring_sqe);
+  /* A record carrying a token would release a slot it never took */
+  for (Py_ssize_t i = 0; i < count; i++) {
+    if (TOKEN_CHECK(records[i].user_data)) {
+      PyErr_Format(PyExc_OverflowError,
+                   "user_data of packed operation %zd must be below 2**63",
+                   i);
+      PyBuffer_Release(&view);
+      return -1;
+    }
+  }
+  for (; accepted < count; accepted++) {
+    struct io_uring_sqe *sqe = ring_sqe_begin(ring, NULL);
+    if (sqe == NULL) break;
+    memcpy(sqe, &records[accepted], sizeof(*sqe));
+    ring_sqe_end(ring);
+  }
+
+  PyBuffer_Release(&view);
+  return accepted;
+}
+
+/* Fill SQEs from a sequence of (opcode, *prep_args) tuples */
+static Py_ssize_t ring_fill_tuples(Ring *ring, PyObject *ops) {
+  PyObject *seq = PySequence_Fast(
+      ops, "operations must be a sequence of tuples or a packed buffer");
+  Py_ssize_t accepted = 0;
+
+  if (seq == NULL) return -1;
+
+  Py_ssize_t count = PySequence_Fast_GET_SIZE(seq);
+  for (; accepted < count; accepted++) {
+    PyObject *op = PySequence_Fast_GET_ITEM(seq, accepted);
+    if (!PyTuple_Check(op) || PyTuple_GET_SIZE(op) < 1) {
+      PyErr_Format(PyExc_TypeError,
+                   "operation must be an (opcode, ...) tuple. got '%s'",
+                   op->ob_type->tp_name);
+      break;
+    }
+
+    long opcode = PyLong_AsLong(PyTuple_GET_ITEM(op, 0));
+    if (opcode == -1 && PyErr_Occurred()) break;
+    prep_fn prep = prep_for_opcode(opcode);
+    if (prep == NULL) {
+      PyErr_Format(PyExc_ValueError, "no prep helper for opcode %ld", opcode);
+      break;
+    }
+
+    PyObject *prep_args = PyTuple_GetSlice(op, 1, PyTuple_GET_SIZE(op));
+    if (prep_args == NULL) break;
+    __u64 user_data;
+    int err = prep(ring, prep_args, &user_data);
+    Py_DECREF(prep_args);
+    if (err) break;
+  }
+
+  Py_DECREF(seq);
+  return PyErr_Occurred() ? -1 - accepted : accepted;
+}
+
+/*
+ * Prepare a whole batch of operations and submit them with a single
+ * io_uring_submit. Returns how many of them were accepted, which is less
+ * than len(ops) when the SQ filled up. On a malformed operation the ones
+ * before it are still submitted before the error is raised.
+ */
+PyObject *RingSubmitBatch(PyObject *self, PyObject *args) {
+  Ring *ring = (Ring *)self;
+  PyObject *ops;
+  Py_ssize_t accepted;
+
+  if (!PyArg_ParseTuple(args, "O:submit_batch", &ops)) return NULL;
+
+  if (PyObject_CheckBuffer(ops)) {
+    accepted = ring_fill_packed(ring, ops);
+    if (accepted < 0) return NULL;
+  } else {
+    accepted = ring_fill_tuples(ring, ops);
+  }
+
+  RING_LOCK(ring->sq_lock);
+  int ret = ring_submit_locked(ring);
+  RING_UNLOCK(ring->sq_lock);
+
+  if (accepted < 0) return NULL;
+  if (ret < 0) {
+    PyErr_SetString(PyExc_RuntimeError, strerror(-ret));
+    return NULL;
+  }
+
+  return PyLong_FromSsize_t(accepted);
+}
+
+/*
+ * Submit a ring and wait. Only the submission holds the sq_lock, the wait
+ * holds the cq_lock alone so that other threads keep queueing operations,
+ * including the ones that complete what this thread waits for.
+ */
 PyObject *RingSubmitAndWait(PyObject *self, PyObject *args) {
   Ring *ring = (Ring *)self;
+  struct io_uring_cqe *entry;
   unsigned int count;
+  int ret, err;
 
   if (!PyArg_ParseTuple(args, "I", &count)) return NULL;
 
-  int err = io_uring_submit_and_wait(&ring->ring, count);
+  RING_LOCK(ring->sq_lock);
+  ret = ring_submit_locked(ring);
+  RING_UNLOCK(ring->sq_lock);
+  if (ret < 0) {
+    PyErr_SetString(PyExc_RuntimeError, strerror(-ret));
+    return NULL;
+  }
 
-  if (err != 0) {
-    PyErr_SetString(PyExc_RuntimeError, strerror(-err));
+  if (count == 0) return PyLong_FromLong(ret);
+
+  RING_LOCK(ring->cq_lock);
+  stats_wait(ring, count);
+  do {
+    Py_BEGIN_ALLOW_THREADS;
+    err = io_uring_wait_cqe_nr(&ring->ring, &entry, count);
+    Py_END_ALLOW_THREADS;
+  } while (err == -EINTR && PyErr_CheckSignals() == 0);
+  RING_UNLOCK(ring->cq_lock);
+
+  if (err < 0) {
+    if (err != -EINTR) PyErr_SetString(PyExc_RuntimeError, strerror(-err));
     return NULL;
   }
 
-  Py_RETURN_NONE;
+  return PyLong_FromLong(ret);
+}
+
+/*
+ * Submit and wait for wait_nr completions, giving up after timeout seconds
+ * (None waits indefinitely). The timeout is armed by the kernel along with
+ * the wait, no separate timer is involved. Returns the number of completions
+ * ready, which is less than wait_nr if the wait timed out or got interrupted
+ * by a signal.
+ *
+ * The wait holds the cq_lock alone, so other threads keep submitting while
+ * the loop sleeps. Before IORING_FEAT_EXT_ARG liburing queues a timeout SQE
+ * for the wait, then the sq_lock is held throughout.
+ */
+PyObject *RingSubmitAndWaitTimeout(PyObject *self, PyObject *args) {
+  Ring *ring = (Ring *)self;
+  struct io_uring_cqe *entry;
+  struct __kernel_timespec ts, *tsp = NULL;
+  unsigned int wait_nr;
+  PyObject *timeout = Py_None;
+  int ret;
+
+  if (!PyArg_ParseTuple(args, "I|O:submit_and_wait_timeout", &wait_nr,
+                        &timeout))
+    return NULL;
+
+  if (timeout != Py_None) {
+    double seconds = PyFloat_AsDouble(timeout);
+    if (seconds == -1.0 && PyErr_Occurred()) return NULL;
+    if (seconds < 0) {
+      PyErr_SetString(PyExc_ValueError, "timeout must be non-negative");
+      return NULL;
+    }
+    ts.tv_sec = (long long)seconds;
+    ts.tv_nsec = (long long)((seconds - (double)ts.tv_sec) * 1e9);
+    tsp = &ts;
+  }
+
+  int sq_held = tsp != NULL && !(ring->ring.features & IORING_FEAT_EXT_ARG);
+  RING_LOCK(ring->sq_lock);
+  ret = ring_submit_locked(ring);
+  if (!sq_held) RING_UNLOCK(ring->sq_lock);
+  if (ret < 0) {
+    if (sq_held) RING_UNLOCK(ring->sq_lock);
+    PyErr_SetString(PyExc_RuntimeError, strerror(-ret));
+    return NULL;
+  }
+
+  RING_LOCK(ring->cq_lock);
+  ret = 0;
+  if (wait_nr > 0) {
+    stats_wait(ring, wait_nr);
+    Py_BEGIN_ALLOW_THREADS;
+    ret = io_uring_wait_cqes(&ring->ring, &entry, wait_nr, tsp, NULL);
+    Py_END_ALLOW_THREADS;
+  }
+  unsigned int ready = io_uring_cq_ready(&ring->ring);
+  RING_UNLOCK(ring->cq_lock);
+  if (sq_held) RING_UNLOCK(ring->sq_lock);
+
+  if (ret == -EINTR) {
+    if (PyErr_CheckSignals() < 0) return NULL;
+  } else if (ret < 0 && ret != -ETIME && ret != -EAGAIN) {
+    PyErr_SetString(PyExc_RuntimeError, strerror(-ret));
+    return NULL;
+  }
+
+  return PyLong_FromUnsignedLong(ready);
 }
 
 /* Wait for a completation */
 PyObject *RingWaitForCQE(PyObject *self, PyObject *args) {
   (void)args;
   Ring *ring = (Ring *)self;
-  CQE *cqe = PyObject_New(CQE, &cqe_type);
-  cqe->entry=NULL;
-  PyObject_Init((PyObject *)cqe, &cqe_type);
+  struct io_uring_cqe *entry = NULL;
+  int err;
 
-  int err = io_uring_wait_cqe(&ring->ring, &cqe->entry);
-  if (err != 0) {
-    PyErr_SetString(PyExc_RuntimeError, strerror(-err));
+  RING_LOCK(ring->cq_lock);
+  stats_wait(ring, 1);
+  do {
+    Py_BEGIN_ALLOW_THREADS;
+    err = io_uring_wait_cqe(&ring->ring, &entry);
+    Py_END_ALLOW_THREADS;
+  } while (err == -EINTR && PyErr_CheckSignals() == 0);
+  RING_UNLOCK(ring->cq_lock);
+
+  if (err < 0) {
+    if (err != -EINTR) PyErr_SetString(PyExc_RuntimeError, strerror(-err));
     return NULL;
   }
 
-  if(cqe->entry == NULL) {
+  if (entry == NULL) {
     Py_RETURN_NONE;
   }
 
-  return (PyObject *)cqe;
+  return cqe_new(ring, entry);
 }
 
 /* Wait for a specific count of complementations */
 PyObject *RingWaitForCQENr(PyObject *self, PyObject *args) {
   Ring *ring = (Ring *)self;
-  struct io_uring_cqe *cqe_list;
+  struct io_uring_cqe *entry;
+  struct io_uring_cqe **cqe_list;
   unsigned int count;
+  int err;
 
   if (!PyArg_ParseTuple(args, "I", &count)) return NULL;
-  if (!io_uring_wait_cqe_nr(&ring->ring, &cqe_list, count)) {
-    PyErr_BadArgument();
+
+  cqe_list = PyMem_New(struct io_uring_cqe *, count ? count : 1);
+  if (cqe_list == NULL) return PyErr_NoMemory();
+
+  RING_LOCK(ring->cq_lock);
+  stats_wait(ring, count);
+  do {
+    Py_BEGIN_ALLOW_THREADS;
+    err = io_uring_wait_cqe_nr(&ring->ring, &entry, count);
+    Py_END_ALLOW_THREADS;
+  } while (err == -EINTR && PyErr_CheckSignals() == 0);
+  if (err >= 0) count = io_uring_peek_batch_cqe(&ring->ring, cqe_list, count);
+  RING_UNLOCK(ring->cq_lock);
+
+  if (err < 0) {
+    PyMem_Free(cqe_list);
+    if (err != -EINTR) PyErr_SetString(PyExc_RuntimeError, strerror(-err));
     return NULL;
   }
 
   PyObject *list = PyList_New(count);
-  for (int i = 0; i < count; i++) {
-    CQE *cqe = PyObject_New(CQE, &cqe_type);
-    PyObject_Init((PyObject *)cqe, &cqe_type);
-    cqe->entry = &cqe_list[i];
-    PyList_SetItem(list, i, (PyObject *)cqe);
+  for (unsigned int i = 0; list != NULL && i < count; i++) {
+    PyObject *cqe = cqe_new(ring, cqe_list[i]);
+    if (cqe == NULL) Py_CLEAR(list);
+    else PyList_SET_ITEM(list, i, cqe);
   }
+  PyMem_Free(cqe_list);
   return list;
 }
 
 /* Wait for a specific count of complementations with a timeout */
 PyObject *RingWaitForCQETO(PyObject *self, PyObject *args) {
   Ring *ring = (Ring *)self;
-  CQE *cqe = PyObject_New(CQE, &cqe_type);
-  PyObject_Init((PyObject *)cqe, &cqe_type);
-  struct __kernel_timespec ts = {.tv_nsec = 0, .tv_sec = 0};
+  struct io_uring_cqe *entry = NULL;
+  unsigned int sec, nsec;
+  int err;
+
+  if (!PyArg_ParseTuple(args, "II", &sec, &nsec)) return NULL;
 
-  cqe->entry = NULL;
+  struct __kernel_timespec ts = {.tv_sec = sec, .tv_nsec = nsec};
 
-  if (!PyArg_ParseTuple(args, "II", &ts.tv_sec, &ts.tv_nsec)) return NULL;
+  RING_LOCK(ring->cq_lock);
+  stats_wait(ring, 1);
+  do {
+    Py_BEGIN_ALLOW_THREADS;
+    err = io_uring_wait_cqe_timeout(&ring->ring, &entry, &ts);
+    Py_END_ALLOW_THREADS;
+  } while (err == -EINTR && PyErr_CheckSignals() == 0);
+  RING_UNLOCK(ring->cq_lock);
 
-  if (!io_uring_wait_cqe_timeout(&ring->ring, &cqe->entry, &ts)) {
-    PyErr_BadArgument();
+  if (err == -ETIME) Py_RETURN_NONE;
+
+  if (err < 0) {
+    if (err != -EINTR) PyErr_SetString(PyExc_RuntimeError, strerror(-err));
     return NULL;
   }
 
-  if (cqe->entry == NULL) {
-    Py_DECREF(cqe);
+  if (entry == NULL) {
     Py_RETURN_NONE;
   }
 
-  return (PyObject *)cqe;
+  return cqe_new(ring, entry);
 }
 
 /* Peek a single complementation from CQ */
 PyObject *RingPeekCQE(PyObject *self, PyObject *args) {
   (void)args;
   Ring *ring = (Ring *)self;
-  CQE *cqe = PyObject_New(CQE, &cqe_type);
-  PyObject_Init((PyObject *)cqe, &cqe_type);
-
-  cqe->entry = NULL;
+  struct io_uring_cqe *entry = NULL;
 
-  int err = io_uring_peek_cqe(&ring->ring, &cqe->entry);
+  RING_LOCK(ring->cq_lock);
+  int err = io_uring_peek_cqe(&ring->ring, &entry);
+  RING_UNLOCK(ring->cq_lock);
 
-  if (err != 0) {
+  if (err != 0 && err != -EAGAIN) {
     PyErr_SetString(PyExc_RuntimeError, strerror(-err));
     return NULL;
   }
 
-  if (cqe->entry == NULL) {
-    Py_DECREF(cqe);
-    Py_RETURN_NONE;
-  }
+  if (entry == NULL) Py_RETURN_NONE;
 
-  return (PyObject *)cqe;
+  return cqe_new(ring, entry);
 }
 
 /* Peek a batch of complementations from CQ */
 PyObject *RingPeekCQEBatch(PyObject *self, PyObject *args) {
   Ring *ring = (Ring *)self;
-  struct io_uring_cqe *cqe_list;
+  struct io_uring_cqe **cqe_list;
   unsigned int count;
 
   if (!PyArg_ParseTuple(args, "I", &count)) return NULL;
-  count = io_uring_peek_batch_cqe(&ring->ring, &cqe_list, count);
+
+  cqe_list = PyMem_New(struct io_uring_cqe *, count ? count : 1);
+  if (cqe_list == NULL) return PyErr_NoMemory();
+
+  RING_LOCK(ring->cq_lock);
+  count = io_uring_peek_batch_cqe(&ring->ring, cqe_list, count);
+  RING_UNLOCK(ring->cq_lock);
 
   PyObject *list = PyList_New(count);
-  for (int i = 0; i < count; i++) {
-    CQE *cqe = PyObject_New(CQE, &cqe_type);
-    PyObject_Init((PyObject *)cqe, &cqe_type);
-    cqe->entry = &cqe_list[i];
-    PyList_SetItem(list, i, (PyObject *)cqe);
+  for (unsigned int i = 0; list != NULL && i < count; i++) {
+    PyObject *cqe = cqe_new(ring, cqe_list[i]);
+    if (cqe == NULL) Py_CLEAR(list);
+    else PyList_SET_ITEM(list, i, cqe);
   }
+  PyMem_Free(cqe_list);
   return list;
 }
 
-/* Signals the ring that this complementation is checked */
+/* Copy up to capacity ready completions into records and mark them seen */
+static unsigned int ring_reap(Ring *ring, cqe_record *records,
+                              size_t capacity) {
+  struct io_uring_cqe *entry;
+  unsigned int head, count = 0;
+
+  RING_LOCK(ring->cq_lock);
+  __u64 now = ring->stats.latency ? stats_now() : 0;
+  io_uring_for_each_cqe(&ring->ring, head, entry) {
+    if (count == capacity) break;
+    stats_complete(ring, entry->user_data, now);
+    buffer_ring_completed(ring, entry);
+    records[count].user_data = entry->user_data;
+    records[count].res = entry->res;
+    records[count].flags = entry->flags & 0xffff;
+    records[count].buffer_id = entry->flags >> IORING_CQE_BUFFER_SHIFT;
+    count++;
+  }
+  io_uring_cq_advance(&ring->ring, count);
+  RING_UNLOCK(ring->cq_lock);
+  return count;
+}
+
+/*
+ * Object attached to a reaped completion as a new reference, or NULL. The
+ * token of multishot operations stays until their final completion.
+ */
+static PyObject *ring_record_data(Ring *ring, cqe_record *record) {
+  PyObject *obj;
+  if (record->flags & IORING_CQE_F_MORE) {
+    obj = token_lookup(&ring->tokens, record->user_data);
+    Py_XINCREF(obj);
+  } else {
+    obj = token_release(&ring->tokens, record->user_data);
+  }
+  return obj;
+}
+
+/*
+ * Copy ready completions into a writable buffer of cqe_record entries and
+ * mark them all seen with a single CQ head update. No Python object is
+ * created per completion. Finished operations give their token back; when
+ * data is a list it receives the object of every record, None for raw user
+ * data.
+ */
+PyObject *RingHarvestCQEs(PyObject *self, PyObject *args) {
+  Ring *ring = (Ring *)self;
+  Py_buffer view;
+  PyObject *data = Py_None;
+
+  if (!PyArg_ParseTuple(args, "w*|O:harvest_cqes", &view, &data)) return NULL;
+  if (data != Py_None && !PyList_Check(data)) {
+    PyBuffer_Release(&view);
+    PyErr_Format(PyExc_TypeError, "data must be a 'list'. got '%s'",
+                 data->ob_type->tp_name);
+    return NULL;
+  }
+
+  cqe_record *records = view.buf;
+  unsigned int count = ring_reap(ring, records, view.len / sizeof(cqe_record));
+
+  /* Released outside of the lock, dropping an object may run any code */
+  if (data != Py_None && PyList_SetSlice(data, 0, PY_SSIZE_T_MAX, NULL) < 0)
+    data = Py_None;
+  for (unsigned int i = 0; i < count; i++) {
+    PyObject *obj = ring_record_data(ring, &records[i]);
+    if (data != Py_None && PyList_Append(data, obj ? obj : Py_None) < 0)
+      data = Py_None;
+    Py_XDECREF(obj);
+  }
+
+  PyBuffer_Release(&view);
+  if (PyErr_Occurred()) return NULL;
+  return PyLong_FromUnsignedLong(count);
+}
+
+/* Completions reaped at once by dispatch_completions */
+#define DISPATCH_BATCH 64
+
+/* asyncio.Future and the names called on it, looked up on first use */
+static PyTypeObject *future_type;
+static PyObject *str_done, *str_set_result, *str_set_exception;
+
+static int dispatch_init(void) {
+  if (future_type != NULL) return 0;
+
+  PyObject *futures = PyImport_ImportModule("asyncio.futures");
+  if (futures == NULL) return -1;
+  PyObject *type = PyObject_GetAttrString(futures, "Future");
+  Py_DECREF(futures);
+  if (type == NULL) return -1;
+  if (!PyType_Check(type)) {
+    Py_DECREF(type);
+    PyErr_SetString(PyExc_TypeError, "asyncio.futures.Future isn't a type");
+    return -1;
+  }
+
+  str_done = PyUnicode_InternFromString("done");
+  str_set_result = PyUnicode_InternFromString("set_result");
+  str_set_exception = PyUnicode_InternFromString("set_exception");
+  if (str_done == NULL || str_set_result == NULL || str_set_exception == NULL) {
+    Py_DECREF(type);
+    return -1;
+  }
+  future_type = (PyTypeObject *)type;
+  return 0;
+}
+
+/* Resolve a future with the result of its operation unless it's done */
+static int dispatch_future(PyObject *fut, __s32 res) {
+  PyObject *ret = PyObject_CallMethodNoArgs(fut, str_done);
+  if (ret == NULL) return -1;
+  int done = PyObject_IsTrue(ret);
+  Py_DECREF(ret);
+  if (done != 0) return done;
+
+  if (res < 0) {
+    PyObject *exc =
+        PyObject_CallFunction(PyExc_OSError, "is", -res, strerror(-res));
+    if (exc == NULL) return -1;
+    ret = PyObject_CallMethodOneArg(fut, str_set_exception, exc);
+    Py_DECREF(exc);
+  } else {
+    PyObject *value = PyLong_FromLong(res);
+    if (value == NULL) return -1;
+    ret = PyObject_CallMethodOneArg(fut, str_set_result, value);
+    Py_DECREF(value);
+  }
+  Py_XDECREF(ret);
+  return ret == NULL ? -1 : 0;
+}
+
+/* Call a callback attached to an operation with (res, flags) */
+static int dispatch_call(PyObject *callback, cqe_record *record) {
+  PyObject *argv[2];
+  argv[0] = PyLong_FromLong(record->res);
+  argv[1] = PyLong_FromUnsignedLong(
+      record->flags | (unsigned long)record->buffer_id
+                          << IORING_CQE_BUFFER_SHIFT);
+  PyObject *ret = NULL;
+  if (argv[0] != NULL && argv[1] != NULL)
+    ret = PyObject_Vectorcall(callback, argv, 2, NULL);
+  Py_XDECREF(argv[0]);
+  Py_XDECREF(argv[1]);
+  Py_XDECREF(ret);
+  return ret == NULL ? -1 : 0;
+}
+
+/*
+ * Consume up to max ready completions (all of them if max is 0) and act on
+ * the object attached to each: futures are resolved, callables are called.
+ * Every reaped completion is dispatched even if a callback raises, the
+ * first exception is raised afterwards and any later ones are reported as
+ * unraisable.
+ */
+PyObject *RingDispatchCompletions(PyObject *self, PyObject *args) {
+  Ring *ring = (Ring *)self;
+  unsigned int max = 0, total = 0;
+  cqe_record records[DISPATCH_BATCH];
+  PyObject *exc_type = NULL, *exc_value = NULL, *exc_tb = NULL;
+
+  if (!PyArg_ParseTuple(args, "|I:dispatch_completions", &max)) return NULL;
+  if (dispatch_init() < 0) return NULL;
+
+  while (max == 0 || total < max) {
+    unsigned int want = DISPATCH_BATCH;
+    if (max != 0 && max - total < want) want = max - total;
+    unsigned int count = ring_reap(ring, records, want);
+
+    for (unsigned int i = 0; i < count; i++) {
+      PyObject *obj = ring_record_data(ring, &records[i]);
+      if (obj == NULL) continue;
+
+      int err = 0;
+      if (PyObject_TypeCheck(obj, future_type))
+        err = dispatch_future(obj, records[i].res);
+      else if (PyCallable_Check(obj))
+        err = dispatch_call(obj, &records[i]);
+      if (err < 0) {
+        if (exc_type == NULL)
+          PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+        else
+          PyErr_WriteUnraisable(obj);
+      }
+      Py_DECREF(obj);
+    }
+
+    total += count;
+    if (count < want) break;
+  }
+
+  if (exc_type != NULL) {
+    PyErr_Restore(exc_type, exc_value, exc_tb);
+    return NULL;
+  }
+  return PyLong_FromUnsignedLong(total);
+}
+
+/* List the (user_data, data) pairs of operations still in flight */
+PyObject *RingPending(PyObject *self, PyObject *args) {
+  (void)args;
+  return token_items(&((Ring *)self)->tokens);
+}
+
+/* Start a chain of linked operations */
+PyObject *RingChain(PyObject *self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"hard", NULL};
+  int hard = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p:chain", kwlist, &hard))
+    return NULL;
+  return chain_new((Ring *)self, hard);
+}
+
+/* The completion at the head of the CQ, if there is one */
+static struct io_uring_cqe *ring_cq_head(Ring *ring) {
+  struct io_uring_cq *cq = &ring->ring.cq;
+  unsigned int shift = ring->ring.flags & IORING_SETUP_CQE32 ? 1 : 0;
+  return &cq->cqes[(*cq->khead & cq->ring_mask) << shift];
+}
+
+/*
+ * Take the completion of user_data out of the CQ, wherever it is in there:
+ * the ones before it move up a slot. Returns 1 with its result in res, or 0
+ * if it is not posted. The caller holds the cq_lock.
+ */
+int ring_cq_take(Ring *ring, __u64 user_data, int *res) {
+  struct io_uring_cq *cq = &ring->ring.cq;
+  unsigned int shift = ring->ring.flags & IORING_SETUP_CQE32 ? 1 : 0;
+  unsigned int head = *cq->khead;
+  unsigned int tail = head + io_uring_cq_ready(&ring->ring);
+
+  for (unsigned int i = head; i != tail; i++) {
+    struct io_uring_cqe *entry = &cq->cqes[(i & cq->ring_mask) << shift];
+    if (entry->user_data != user_data) continue;
+
+    *res = entry->res;
+    for (; i != head; i--) {
+      struct io_uring_cqe *prev =
+          &cq->cqes[((i - 1) & cq->ring_mask) << shift];
+      memcpy(entry, prev, sizeof(*entry) << shift);
+      entry = prev;
+    }
+    io_uring_cq_advance(&ring->ring, 1);
+    stats_complete(ring, user_data, 0);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Signals the ring that this complementation is checked. Completions are
+ * consumed in order, so only the CQE at the head of this ring can be.
+ */
 PyObject *RingCQESeen(PyObject *self, PyObject *args) {
   Ring *ring = (Ring *)self;
-  CQE cqe;
+  CQE *cqe;
   if (!PyArg_ParseTuple(args, "O!", &cqe_type, &cqe)) return NULL;
 
-  io_uring_cqe_seen(&ring->ring, cqe.entry);
+  if (cqe->ring != ring) {
+    PyErr_SetString(PyExc_ValueError, "CQE belongs to another ring");
+    return NULL;
+  }
+  if (cqe->seen) {
+    PyErr_SetString(PyExc_ValueError, "CQE was already seen");
+    return NULL;
+  }
 
-  // TODO(reza): decrease reference of cqe data
+  struct io_uring_cqe *entry = &cqe->entry;
+  RING_LOCK(ring->cq_lock);
+  if (io_uring_cq_ready(&ring->ring) == 0 || ring_cq_head(ring) != cqe->slot) {
+    RING_UNLOCK(ring->cq_lock);
+    PyErr_SetString(PyExc_ValueError,
+                    "CQE is not the next completion of the ring");
+    return NULL;
+  }
+  io_uring_cq_advance(&ring->ring, 1);
+  stats_complete(ring, entry->user_data,
+                 ring->stats.latency ? stats_now() : 0);
+  RING_UNLOCK(ring->cq_lock);
+  cqe->seen = 1;
+
+  /* Multishot operations keep their token until the final completion */
+  if (!(entry->flags & IORING_CQE_F_MORE))
+    ring_user_data_done(ring, entry->user_data);
   Py_RETURN_NONE;
 }
 
 /* destructor of ring */
 void RingDestructor(void *self) {
   Ring *ring = (Ring *)self;
-  io_uring_queue_exit(&ring->ring);
+  /* entries is only set once the ring is actually set up */
+  if (ring->entries != NULL) {
+    for (unsigned i = 0; i < ring->ring.sq.ring_entries; i++)
+      Py_XDECREF(ring->sqe_keep[i]);
+    PyMem_Free(ring->sqe_keep);
+    io_uring_queue_exit(&ring->ring);
+  }
+  ring_buffers_clear(ring);
+  stats_clear(ring);
+  token_table_clear(&ring->tokens);
+  Py_XDECREF(ring->entries);
+  if (ring->sq_lock) PyThread_free_lock(ring->sq_lock);
+  if (ring->cq_lock) PyThread_free_lock(ring->cq_lock);
+  Py_TYPE(ring)->tp_free(self);
 }
 
 static PyMemberDef ring_members[] = {
@@ -248,11 +897,47 @@ static PyMemberDef ring_members[] = {
      1, "Flags of ring"},
     {"fd", T_INT, offsetof(Ring, ring) + offsetof(struct io_uring, ring_fd), 1,
      "file descriptor of ring"},
+    {"features", T_UINT,
+     offsetof(Ring, ring) + offsetof(struct io_uring, features), 1,
+     "IORING_FEAT_* flags the kernel reported for ring"},
+    {"sq_wakeups", T_ULONGLONG, offsetof(Ring, sq_wakeups), 1,
+     "Submissions that had to wake up the SQPOLL thread"},
+    {"sq_skipped", T_ULONGLONG, offsetof(Ring, sq_skipped), 1,
+     "Submissions the awake SQPOLL thread took without a system call"},
     {NULL, 0, 0, 0, NULL}};
 
+/* Whether the SQPOLL thread is idle and the next submit has to wake it */
+static PyObject *RingGetSQThreadAsleep(PyObject *self, void *closure) {
+  (void)closure;
+  Ring *ring = (Ring *)self;
+
+  if (!(ring->ring.flags & IORING_SETUP_SQPOLL)) Py_RETURN_NONE;
+  io_uring_smp_mb();
+  return PyBool_FromLong(IO_URING_READ_ONCE(*ring->ring.sq.kflags) &
+                         IORING_SQ_NEED_WAKEUP);
+}
+
+static PyObject *RingGetInflight(PyObject *self, void *closure) {
+  (void)closure;
+  return PyLong_FromUnsignedLong(((Ring *)self)->tokens.used);
+}
+
+static PyGetSetDef ring_getset[] = {
+    {"sq_thread_asleep", RingGetSQThreadAsleep, NULL,
+     "Whether the SQPOLL thread sleeps, None without SQPOLL", NULL},
+    {"inflight", RingGetInflight, NULL,
+     "Operations with data attached whose final completion is pending",
+     NULL},
+    {NULL, NULL, NULL, NULL, NULL}};
+
 static PyMethodDef ring_methods[] = {
     {"get_sqe", RingGetSQE, METH_NOARGS, "Get a single SQE"},
     {"submit", RingSubmit, METH_NOARGS, "Submit the ring"},
+    {"submit_and_wait_timeout", RingSubmitAndWaitTimeout, METH_VARARGS,
+     "submit_and_wait_timeout(wait_nr, timeout=None)\n\n"
+     "Submit, then wait for wait_nr completions for at most timeout seconds.\n"
+     "Other threads can submit during the wait. Returns the number of\n"
+     "completions ready"},
     {"submit_and_wait", RingSubmitAndWait, METH_VARARGS,
      "Submit the ring and wait for an specific count of complementation"},
     {"wait_for_cqe", RingWaitForCQE, METH_NOARGS,
@@ -265,9 +950,230 @@ static PyMethodDef ring_methods[] = {
     {"peek_cqe_batch", RingPeekCQEBatch, METH_VARARGS,
      "Peek a batch of CQEs from ring"},
     {"cqe_seen", RingCQESeen, METH_VARARGS, "Mark CQE as seen"},
+    {"harvest_cqes", RingHarvestCQEs, METH_VARARGS,
+     "harvest_cqes(buffer, data=None)\n\n"
+     "Copy ready completions into a writable buffer of packed\n"
+     "(u64 user_data, i32 res, u16 flags, u16 buffer_id) records, laid out as\n"
+     "CQE_FORMAT for the struct module, and mark them seen. If data is a\n"
+     "list, it is filled with the object attached to each record. Returns\n"
+     "the number of records written"},
+    {"dispatch_completions", RingDispatchCompletions, METH_VARARGS,
+     "dispatch_completions(max=0)\n\n"
+     "Consume up to max ready completions, all of them if max is 0. An\n"
+     "asyncio future attached as data gets the result, or an OSError for a\n"
+     "negative one, unless it is done already. A callable is called with\n"
+     "(res, flags). Returns the number of completions consumed"},
+    {"pending", RingPending, METH_NOARGS,
+     "pending()\n\n"
+     "List the (user_data, data) pairs of the operations with data attached\n"
+     "whose final completion hasn't been consumed yet"},
+    {"stats", RingStats, METH_NOARGS,
+     "stats()\n\n"
+     "Snapshot of the counters of the ring as a Stats object: SQEs prepared\n"
+     "and submitted, io_uring_enter calls, CQEs reaped, CQ overflows and\n"
+     "times the SQ was full, along with the latency histograms if tracked"},
+    {"reset_stats", RingResetStats, METH_NOARGS,
+     "reset_stats()\n\nZero the counters and the latency histograms"},
+    {"track_latency", RingTrackLatency, METH_VARARGS,
+     "track_latency(enable=True)\n\n"
+     "Record the time from submit to completion of the operations with an\n"
+     "object attached as data, in a histogram per opcode. Off by default,\n"
+     "turning it off drops the histograms"},
+    {"chain", (PyCFunction)(void (*)(void))RingChain,
+     METH_VARARGS | METH_KEYWORDS,
+     "chain(hard=False)\n\n"
+     "Start a Chain of operations that run one after the other, e.g.\n"
+     "openat_direct, read and close of a FixedFile. With hard links the\n"
+     "steps after a failed one still run, otherwise they are cancelled"},
+    {"submit_batch", RingSubmitBatch, METH_VARARGS,
+     "submit_batch(ops)\n\n"
+     "Prepare and submit a batch of operations in one call. ops is either a\n"
+     "sequence of (opcode, *prep_args) tuples, taking the arguments of the\n"
+     "matching prep_* method, or a buffer of packed struct io_uring_sqe\n"
+     "records of SQE_SIZE bytes each, whose user_data must be below 2**63.\n"
+     "Returns the number of operations\n"
+     "accepted, less than len(ops) if the submission queue filled up"},
+    {"register_buffers", RingRegisterBuffers, METH_VARARGS,
+     "register_buffers(buffers)\n\n"
+     "Register a sequence of writable buffers (bytearray, mmap, memoryview,\n"
+     "...) for prep_read_fixed and prep_write_fixed. None leaves a slot\n"
+     "empty and an int registers that many empty slots. The buffers are held\n"
+     "and can't be resized until they are unregistered and no operation on\n"
+     "them is in flight"},
+    {"update_buffers", RingUpdateBuffers, METH_VARARGS,
+     "update_buffers(offset, buffers)\n\n"
+     "Replace registered buffers starting at slot offset"},
+    {"unregister_buffers", RingUnregisterBuffers, METH_NOARGS,
+     "Unregister all buffers"},
+    {"register_files", RingRegisterFiles, METH_VARARGS,
+     "register_files(files)\n\n"
+     "Register a sequence of file descriptors (or objects with fileno()) as\n"
+     "the file table, -1 leaves a slot empty. An int registers that many\n"
+     "empty slots. Slots are used through FixedFile(index)"},
+    {"update_files", RingUpdateFiles, METH_VARARGS,
+     "update_files(offset, files)\n\n"
+     "Replace slots of the file table starting at offset, -1 clears a slot.\n"
+     "Returns the number of slots updated"},
+    {"unregister_files", RingUnregisterFiles, METH_NOARGS,
+     "Unregister the file table"},
+    {"register_file_alloc_range", RingRegisterFileAllocRange, METH_VARARGS,
+     "register_file_alloc_range(offset, length)\n\n"
+     "Limit the slots picked for FILE_INDEX_ALLOC to offset..offset+length"},
+    {"register_eventfd", RingRegisterEventfd, METH_VARARGS,
+     "register_eventfd(fd, async_=False)\n\n"
+     "Signal the eventfd fd whenever a completion is posted, so the ring can\n"
+     "be watched by polling fd. With async_ only completions of operations\n"
+     "that didn't complete inline are signalled"},
+    {"unregister_eventfd", RingUnregisterEventfd, METH_NOARGS,
+     "Unregister the eventfd"},
+    {"register_ring_fd", RingRegisterRingFd, METH_NOARGS,
+     "register_ring_fd()\n\n"
+     "Register the ring fd with the calling thread, which saves looking it\n"
+     "up on each submission and wait. Other threads can't enter the ring\n"
+     "anymore. Linux 5.18 and later"},
+    {"unregister_ring_fd", RingUnregisterRingFd, METH_NOARGS,
+     "Unregister the ring fd, from the thread that registered it"},
+    {"enable", RingEnable, METH_NOARGS,
+     "enable()\n\n"
+     "Enable a ring set up with RING_SETUP_R_DISABLED. With\n"
+     "RING_SETUP_SINGLE_ISSUER the calling thread is the only one that may\n"
+     "submit to it from then on"},
+    {"msg_ring", RingMsgRing, METH_VARARGS,
+     "msg_ring(target, res=0, user_data=0)\n\n"
+     "Post a completion of res and user_data to the Ring target (or its\n"
+     "descriptor) right away, waking up a thread waiting on it. Safe to call\n"
+     "from any thread; this ring only gets a completion if it failed, which\n"
+     "is raised. With SQPOLL the failure may come later, as a completion\n"
+     "without data"},
+    {"cancel", (PyCFunction)(void (*)(void))RingCancel,
+     METH_VARARGS | METH_KEYWORDS,
+     "cancel(target, *, all=False)\n\n"
+     "Queue the cancellation of the operation whose user_data is target, or\n"
+     "of every one with it with all. Unlike prep_cancel there is no\n"
+     "completion to consume, the cancelled operations complete with\n"
+     "-ECANCELED as usual"},
+    {"cancel_fd", RingCancelFd, METH_VARARGS,
+     "cancel_fd(fd)\n\n"
+     "Queue the cancellation of every operation on fd, a descriptor or a\n"
+     "FixedFile, with no completion of its own. Linux 5.19 and later"},
+    {"cancel_all", RingCancelAll, METH_NOARGS,
+     "cancel_all()\n\n"
+     "Queue the cancellation of every operation in flight, with no\n"
+     "completion of its own. Linux 5.19 and later"},
+    {"prep_nop", RingPrepNop, METH_VARARGS,
+     "prep_nop(data=None)\n\nQueue a no-op"},
+    {"prep_read", RingPrepRead, METH_VARARGS,
+     "prep_read(fd, buf, offset, data=None)\n\n"
+     "Queue a read of len(buf) bytes from offset (-1 for the file position).\n"
+     "buf may be a BufferRing to let the kernel pick a buffer from it. Like\n"
+     "the buffers of every prep_*, it is held until the final completion"},
+    {"prep_write", RingPrepWrite, METH_VARARGS,
+     "prep_write(fd, buf, offset, data=None)\n\nQueue a write of buf"},
+    {"prep_readv", RingPrepReadv, METH_VARARGS,
+     "prep_readv(fd, buffers, offset, data=None)\n\n"
+     "Queue a vectored read into a sequence of writable buffers"},
+    {"prep_writev", RingPrepWritev, METH_VARARGS,
+     "prep_writev(fd, buffers, offset, data=None)\n\n"
+     "Queue a vectored write of a sequence of buffers"},
+    {"prep_send", RingPrepSend, METH_VARARGS,
+     "prep_send(fd, buf, flags=0, data=None)\n\nQueue a send on a socket"},
+    {"prep_send_zc", RingPrepSendZC, METH_VARARGS,
+     "prep_send_zc(fd, buf, flags=0, zc_flags=0, data=None)\n\n"
+     "Queue a send that doesn't copy buf into the socket buffers. The result\n"
+     "comes with CQE_F_MORE, then a completion with CQE_F_NOTIF tells that\n"
+     "the kernel released buf. buf is held until then"},
+    {"prep_send_zc_fixed", RingPrepSendZCFixed, METH_VARARGS,
+     "prep_send_zc_fixed(fd, index, nbytes=0, buf_offset=0, flags=0,\n"
+     "                   zc_flags=0, data=None)\n\n"
+     "Queue a zero copy send of nbytes, all if 0, from buf_offset of the\n"
+     "registered buffer index"},
+    {"prep_recv", RingPrepRecv, METH_VARARGS,
+     "prep_recv(fd, buf, flags=0, data=None)\n\n"
+     "Queue a receive from a socket. buf may be a BufferRing to let the\n"
+     "kernel pick a buffer from it"},
+    {"prep_accept", RingPrepAccept, METH_VARARGS,
+     "prep_accept(fd, flags=0, data=None)\n\n"
+     "Queue an accept; the result is the new descriptor"},
+    {"prep_accept_direct", RingPrepAcceptDirect, METH_VARARGS,
+     "prep_accept_direct(fd, flags=0, file_index=FILE_INDEX_ALLOC, "
+     "data=None)\n\n"
+     "Queue an accept installing the connection in a slot of the file table.\n"
+     "With FILE_INDEX_ALLOC the result is the slot picked, otherwise 0"},
+    {"prep_multishot_accept", RingPrepMultishotAccept, METH_VARARGS,
+     "prep_multishot_accept(fd, flags=0, direct=False, data=None)\n\n"
+     "Queue an accept that posts a completion for every connection until it\n"
+     "is cancelled, CQE.more is False on its last one. With direct the\n"
+     "connections go into slots of the file table"},
+    {"prep_recv_multishot", RingPrepRecvMultishot, METH_VARARGS,
+     "prep_recv_multishot(fd, pool, flags=0, data=None)\n\n"
+     "Queue a receive that posts a completion for every chunk of data, each\n"
+     "in a buffer of the BufferRing pool, until it is cancelled, the socket\n"
+     "is closed or the pool runs dry. CQE.more is False on its last one"},
+    {"prep_connect", RingPrepConnect, METH_VARARGS,
+     "prep_connect(fd, address, data=None)\n\n"
+     "Queue a connect to a numeric socket address"},
+    {"prep_timeout", RingPrepTimeout, METH_VARARGS,
+     "prep_timeout(seconds, count=0, flags=0, data=None)\n\n"
+     "Queue a timeout, completing early after count completions"},
+    {"prep_link_timeout", RingPrepLinkTimeout, METH_VARARGS,
+     "prep_link_timeout(seconds, flags=0, data=None)\n\n"
+     "Queue a timeout for the operation before it, which has to be queued\n"
+     "with SQE_IO_LINK"},
+    {"prep_msg_ring", RingPrepMsgRing, METH_VARARGS,
+     "prep_msg_ring(target, res, msg_data, flags=0, data=None)\n\n"
+     "Queue posting a completion of res with user_data msg_data to the Ring\n"
+     "target, its descriptor or its FixedFile"},
+    {"prep_cancel", RingPrepCancel, METH_VARARGS,
+     "prep_cancel(target, flags=0, data=None)\n\n"
+     "Queue the cancellation of the operation whose user_data is target,\n"
+     "as returned by its prep_* method. flags are ASYNC_CANCEL_* flags, e.g.\n"
+     "ASYNC_CANCEL_ALL for every operation with that user_data"},
+    {"prep_cancel_fd", RingPrepCancelFd, METH_VARARGS,
+     "prep_cancel_fd(fd, flags=ASYNC_CANCEL_ALL, data=None)\n\n"
+     "Queue the cancellation of the operations on fd, a descriptor or a\n"
+     "FixedFile; the result is the number cancelled with ASYNC_CANCEL_ALL"},
+    {"prep_close", RingPrepClose, METH_VARARGS,
+     "prep_close(fd, data=None)\n\nQueue a close"},
+    {"prep_openat", RingPrepOpenat, METH_VARARGS,
+     "prep_openat(dfd, path, flags, mode=0o644, data=None)\n\n"
+     "Queue an openat; the result is the new descriptor"},
+    {"prep_openat_direct", RingPrepOpenatDirect, METH_VARARGS,
+     "prep_openat_direct(dfd, path, flags, mode=0o644, "
+     "file_index=FILE_INDEX_ALLOC, data=None)\n\n"
+     "Queue an open installing the file in a slot of the file table.\n"
+     "With FILE_INDEX_ALLOC the result is the slot picked, otherwise 0"},
+    {"prep_statx", RingPrepStatx, METH_VARARGS,
+     "prep_statx(dfd, path, flags, mask, buf, data=None)\n\n"
+     "Queue a statx filling buf with a struct statx"},
+    {"prep_fsync", RingPrepFsync, METH_VARARGS,
+     "prep_fsync(fd, flags=0, data=None)\n\nQueue an fsync"},
+    {"prep_fallocate", RingPrepFallocate, METH_VARARGS,
+     "prep_fallocate(fd, mode, offset, length, data=None)\n\n"
+     "Queue a fallocate of length bytes at offset"},
+    {"prep_splice", RingPrepSplice, METH_VARARGS,
+     "prep_splice(fd_in, off_in, fd_out, off_out, nbytes, flags=0, "
+     "data=None)\n\n"
+     "Queue a splice of nbytes between two files, one of them a pipe. An\n"
+     "offset of -1 uses the file position, as needed for pipes and sockets"},
+    {"prep_tee", RingPrepTee, METH_VARARGS,
+     "prep_tee(fd_in, fd_out, nbytes, flags=0, data=None)\n\n"
+     "Queue a copy of nbytes from pipe fd_in to pipe fd_out that leaves\n"
+     "them in fd_in"},
+    {"prep_poll_add", RingPrepPollAdd, METH_VARARGS,
+     "prep_poll_add(fd, mask, data=None)\n\n"
+     "Queue a one shot poll for the events in mask. Errors and hangups are\n"
+     "reported even if mask is 0. The result is the mask of ready events"},
+    {"prep_read_fixed", RingPrepReadFixed, METH_VARARGS,
+     "prep_read_fixed(fd, index, offset, nbytes=0, buf_offset=0, data=None)\n"
+     "\nQueue a read into registered buffer index, at buf_offset. nbytes 0\n"
+     "reads up to the end of the buffer"},
+    {"prep_write_fixed", RingPrepWriteFixed, METH_VARARGS,
+     "prep_write_fixed(fd, index, offset, nbytes=0, buf_offset=0, data=None)\n"
+     "\nQueue a write from registered buffer index, at buf_offset. nbytes 0\n"
+     "writes up to the end of the buffer"},
     {NULL, NULL, 0, NULL}};
 
-static PyTypeObject ring_type = {
+PyTypeObject ring_type = {
     PyVarObject_HEAD_INIT(&PyType_Type, 0) "_uring_io.Ring", /* tp_name */
     sizeof(Ring),                                            /* tp_basicsize */
     0,                                                       /* tp_itemsize */
@@ -296,7 +1202,7 @@ static PyTypeObject ring_type = {
     0,                   /* tp_iternext */
     ring_methods,        /* tp_methods */
     ring_members,        /* tp_members */
-    0,                   /* tp_getset */
+    ring_getset,         /* tp_getset */
     0,                   /* tp_base */
     0,                   /* tp_dict */
     0,                   /* tp_descr_get */
@@ -308,6 +1214,7 @@ static PyTypeObject ring_type = {
 };
 
 void register_ring(PyObject *mod) {
+  if (PyType_Ready(&ring_type) < 0) return;
   Py_INCREF(&ring_type);
   if (PyModule_AddObject(mod, "Ring", (PyObject *)&ring_type) < 0)
     Py_DECREF(&ring_type);
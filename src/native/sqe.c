@@ -33,7 +33,11 @@ int SQEInit(PyObject *self, PyObject *args, PyObject *kwds) {
   return 0;
 }
 
-void SQEDestructor(void *self) { SQE *sqe = (SQE *)self; }
+void SQEDestructor(void *self) {
+  SQE *sqe = (SQE *)self;
+  Py_XDECREF(sqe->ring);
+  Py_TYPE(sqe)->tp_free(self);
+}
 
 /////////////////////// opcode
 int SQESetOC(PyObject *self, PyObject *args, void *enc) {
@@ -165,15 +169,46 @@ PyObject *SQEGetOpFlags(PyObject *self, void *enc) {
 int SQESetData(PyObject *self, PyObject *args, void *enc) {
   (void)enc;
   SQE *sqe = (SQE *)self;
-  Py_DECREF(sqe->entry->user_data);
-  sqe->entry->user_data = (__u64)args;
-  Py_INCREF(args);
+  __u64 user_data;
+  if (args == NULL) args = Py_None;
+  if (ring_user_data(sqe->ring, args, &user_data) < 0) return -1;
+  /* the token of a previous object is not going to be seen in a CQE */
+  ring_user_data_done(sqe->ring, sqe->entry->user_data);
+  sqe->entry->user_data = user_data;
   return 0;
 }
 PyObject *SQEGetData(PyObject *self, void *enc) {
   (void)enc;
   SQE *sqe = (SQE *)self;
-  return (PyObject *)sqe->entry->user_data;
+  if (!TOKEN_CHECK(sqe->entry->user_data))
+    return PyLong_FromUnsignedLongLong(sqe->entry->user_data);
+
+  PyObject *data = token_lookup(&sqe->ring->tokens, sqe->entry->user_data);
+  if (data == NULL) data = Py_None;
+  Py_INCREF(data);
+  return data;
+}
+
+/////////////////////// user_data
+int SQESetUserData(PyObject *self, PyObject *args, void *enc) {
+  (void)enc;
+  SQE *sqe = (SQE *)self;
+  if (!PyLong_Check(args)) {
+    PyErr_Format(PyExc_TypeError, "user_data must be an 'int'. got '%s'",
+                 args->ob_type->tp_name);
+    return -1;
+  }
+  /* Values with the top bit set would pass for a token of the ring */
+  __u64 user_data;
+  if (ring_user_data(sqe->ring, args, &user_data) < 0) return -1;
+  ring_user_data_done(sqe->ring, sqe->entry->user_data);
+  sqe->entry->user_data = user_data;
+  return 0;
+}
+PyObject *SQEGetUserData(PyObject *self, void *enc) {
+  (void)enc;
+  SQE *sqe = (SQE *)self;
+  return PyLong_FromUnsignedLongLong(sqe->entry->user_data);
 }
 
 /////////////////////// buf_index
@@ -206,7 +241,7 @@ int SQESetBufGroup(PyObject *self, PyObject *args, void *enc) {
   sqe->entry->buf_group = PyLong_AsLong(args);
   return 0;
 }
-PyObject *SQEGetGroup(PyObject *self, void *enc) {
+PyObject *SQEGetBufGroup(PyObject *self, void *enc) {
   (void)enc;
   SQE *sqe = (SQE *)self;
   return PyLong_FromLong(sqe->entry->buf_group);
@@ -245,9 +280,11 @@ static PyGetSetDef sqe_setget[] = {
     {"op_flags", SQEGetOpFlags, SQESetOpFlags, "fd to do the IO", NULL},
 
     {"data", SQEGetData, SQESetData, "User data of SQE", NULL},
+    {"user_data", SQEGetUserData, SQESetUserData, "Raw 64-bit user data",
+     NULL},
 
     {"buf_index", SQEGetBufIndex, SQESetBufIndex, "Buffer index", NULL},
-    {"buf_group", SQEGetBufIndex, SQESetBufGroup, "Buffer group", NULL},
+    {"buf_group", SQEGetBufGroup, SQESetBufGroup, "Buffer group", NULL},
 
     {"personality", SQEGetPersonality, SQESetPersonality, "Personality", NULL},
     {NULL, NULL, NULL, NULL, NULL}};
@@ -295,6 +332,7 @@ PyTypeObject sqe_type = {
 };
 
 extern void register_sqe(PyObject *mod) {
+  if (PyType_Ready(&sqe_type) < 0) return;
   Py_INCREF(&sqe_type);
   if (PyModule_AddObject(mod, "SQE", (PyObject *)&sqe_type) < 0)
     Py_DECREF(&sqe_type);
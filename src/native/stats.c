@@ -0,0 +1,465 @@
+/*
+ * Copyright (c) 2021 Reza Mahdi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Ring statistics.
+ *
+ * The counters are plain increments on paths that hold the ring locks
+ * anyway. Latency tracking is off by default: once enabled, every operation
+ * with a token gets the time it was submitted stamped into its token slot,
+ * and the time until its completion is consumed goes into a histogram of
+ * its opcode. Operations with raw integer user_data have no slot and aren't
+ * tracked.
+ *
+ * The histograms are log-linear like HDR histograms: each power of two of
+ * nanoseconds is split into STATS_SUB buckets, so a bucket is at most 25%
+ * wide whatever the magnitude. Recording is an index computation and an
+ * increment.
+ */
+
+#include <liburing.h>
+#include <string.h>
+#include <time.h>
+
+#include "uring.h"
+
+#define STATS_SUB_BITS 2
+#define STATS_SUB (1 << STATS_SUB_BITS)
+#define STATS_MAX_BITS 40 /* about 18 minutes, longer goes in the last bucket */
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 2) * STATS_SUB)
+#define STATS_OPS IORING_OP_LAST
+
+typedef struct {
+  PyObject_HEAD unsigned long long sqes_prepared;
+  unsigned long long sqes_submitted;
+  unsigned long long enters;
+  unsigned long long cqes_reaped;
+  unsigned long long sq_full;
+  unsigned long long cq_overflow;
+  unsigned long long sq_wakeups;
+  unsigned long long sq_skipped;
+  PyObject *latency;
+} Stats;
+
+typedef struct {
+  PyObject_HEAD unsigned long long count;
+  unsigned long long buckets[STATS_BUCKETS];
+} Histogram;
+
+static PyTypeObject stats_type;
+static PyTypeObject histogram_type;
+
+/* Monotonic time in nanoseconds */
+__u64 stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (__u64)ts.tv_sec * 1000000000ULL + (__u64)ts.tv_nsec;
+}
+
+/* Histogram bucket of a latency */
+static unsigned int stats_bucket(__u64 ns) {
+  if (ns < STATS_SUB) return (unsigned int)ns;
+
+  unsigned int msb = 63 - __builtin_clzll(ns);
+  if (msb > STATS_MAX_BITS) return STATS_BUCKETS - 1;
+  unsigned int shift = msb - STATS_SUB_BITS;
+  return (shift + 1) * STATS_SUB + ((ns >> shift) & (STATS_SUB - 1));
+}
+
+/* Lowest latency of a bucket, the next bucket starts right after it */
+static __u64 stats_bucket_low(unsigned int index) {
+  if (index < STATS_SUB) return index;
+
+  unsigned int shift = index / STATS_SUB - 1;
+  return (__u64)(STATS_SUB + index % STATS_SUB) << shift;
+}
+
+/*
+ * Account the entries about to be submitted, with the sq_lock held. wait_nr
+ * is the number of completions the call waits for. liburing only enters the
+ * kernel when there is something to submit, or fewer completions ready than
+ * waited for; an awake SQPOLL thread takes new entries without a system call.
+ */
+void stats_submit(Ring *ring, unsigned int wait_nr) {
+  struct io_uring_sq *sq = &ring->ring.sq;
+  unsigned int ready = sq->sqe_tail - sq->sqe_head;
+  int enter = io_uring_cq_ready(&ring->ring) < wait_nr;
+
+  if (ready > 0) {
+    if (ring->ring.flags & IORING_SETUP_SQPOLL) {
+      io_uring_smp_mb();
+      if (IO_URING_READ_ONCE(*sq->kflags) & IORING_SQ_NEED_WAKEUP) {
+        ring->sq_wakeups++;
+        enter = 1;
+      } else {
+        ring->sq_skipped++;
+      }
+    } else {
+      enter = 1;
+    }
+  }
+  ring->stats.sqes_submitted += ready;
+  ring->stats.enters += enter;
+
+  if (ring->stats.latency == NULL || ready == 0) return;
+  __u64 now = stats_now();
+  for (unsigned int i = sq->sqe_head; i != sq->sqe_tail; i++) {
+    struct io_uring_sqe *sqe = &sq->sqes[i & sq->ring_mask];
+    token_slot *slot = token_slot_of(&ring->tokens, sqe->user_data);
+    if (slot == NULL) continue;
+    slot->stamp = now;
+    slot->opcode = sqe->opcode;
+  }
+}
+
+/* Account a wait for wait_nr completions, with the cq_lock held */
+void stats_wait(Ring *ring, unsigned int wait_nr) {
+  if (io_uring_cq_ready(&ring->ring) < wait_nr) ring->stats.enters++;
+}
+
+/*
+ * Account a consumed completion whose token is still live. now is 0 unless
+ * latency is tracked, so callers look at the clock once per batch.
+ */
+void stats_complete(Ring *ring, __u64 user_data, __u64 now) {
+  ring->stats.cqes_reaped++;
+  if (now == 0) return;
+
+  token_slot *slot = token_slot_of(&ring->tokens, user_data);
+  if (slot == NULL || slot->stamp == 0) return;
+  if (slot->opcode < STATS_OPS) {
+    __u64 ns = now > slot->stamp ? now - slot->stamp : 0;
+    ring->stats.latency[slot->opcode * STATS_BUCKETS + stats_bucket(ns)]++;
+  }
+  /* Multishot operations count their first completion only */
+  slot->stamp = 0;
+}
+
+void stats_clear(Ring *ring) {
+  PyMem_Free(ring->stats.latency);
+  memset(&ring->stats, 0, sizeof(ring->stats));
+}
+
+/* Histograms of the opcodes with latencies recorded, by opcode */
+static PyObject *stats_latency(unsigned long long *latency) {
+  PyObject *dict = PyDict_New();
+  if (dict == NULL) return NULL;
+
+  for (unsigned int op = 0; op < STATS_OPS; op++) {
+    unsigned long long *buckets = &latency[op * STATS_BUCKETS];
+    unsigned long long count = 0;
+    for (unsigned int i = 0; i < STATS_BUCKETS; i++) count += buckets[i];
+    if (count == 0) continue;
+
+    Histogram *hist = PyObject_New(Histogram, &histogram_type);
+    if (hist == NULL) goto error;
+    hist->count = count;
+    memcpy(hist->buckets, buckets, sizeof(hist->buckets));
+
+    PyObject *key = PyLong_FromUnsignedLong(op);
+    int err = key == NULL || PyDict_SetItem(dict, key, (PyObject *)hist) < 0;
+    Py_XDECREF(key);
+    Py_DECREF(hist);
+    if (err) goto error;
+  }
+  return dict;
+
+error:
+  Py_DECREF(dict);
+  return NULL;
+}
+
+/* Snapshot of the counters */
+PyObject *RingStats(PyObject *self, PyObject *args) {
+  (void)args;
+  Ring *ring = (Ring *)self;
+  Stats *stats = PyObject_New(Stats, &stats_type);
+  if (stats == NULL) return NULL;
+  stats->latency = NULL;
+
+  /* The histograms are copied under the locks and turned into objects after */
+  size_t size = STATS_OPS * STATS_BUCKETS * sizeof(unsigned long long);
+  unsigned long long *latency = PyMem_Malloc(size);
+  if (latency == NULL) {
+    Py_DECREF(stats);
+    return PyErr_NoMemory();
+  }
+
+  RING_LOCK(ring->sq_lock);
+  RING_LOCK(ring->cq_lock);
+  stats->sqes_prepared = ring->stats.sqes_prepared;
+  stats->sqes_submitted = ring->stats.sqes_submitted;
+  stats->enters = ring->stats.enters;
+  stats->cqes_reaped = ring->stats.cqes_reaped;
+  stats->sq_full = ring->stats.sq_full;
+  stats->cq_overflow = IO_URING_READ_ONCE(*ring->ring.cq.koverflow);
+  stats->sq_wakeups = ring->sq_wakeups;
+  stats->sq_skipped = ring->sq_skipped;
+  int tracked = ring->stats.latency != NULL;
+  if (tracked) memcpy(latency, ring->stats.latency, size);
+  RING_UNLOCK(ring->cq_lock);
+  RING_UNLOCK(ring->sq_lock);
+
+  if (tracked) {
+    stats->latency = stats_latency(latency);
+  } else {
+    Py_INCREF(Py_None);
+    stats->latency = Py_None;
+  }
+  PyMem_Free(latency);
+  if (stats->latency == NULL) Py_CLEAR(stats);
+  return (PyObject *)stats;
+}
+
+/* Zero the counters, latency tracking stays as it is */
+PyObject *RingResetStats(PyObject *self, PyObject *args) {
+  (void)args;
+  Ring *ring = (Ring *)self;
+
+  RING_LOCK(ring->sq_lock);
+  RING_LOCK(ring->cq_lock);
+  unsigned long long *latency = ring->stats.latency;
+  memset(&ring->stats, 0, sizeof(ring->stats));
+  if (latency != NULL) {
+    memset(latency, 0, STATS_OPS * STATS_BUCKETS * sizeof(*latency));
+    ring->stats.latency = latency;
+  }
+  ring->sq_wakeups = ring->sq_skipped = 0;
+  RING_UNLOCK(ring->cq_lock);
+  RING_UNLOCK(ring->sq_lock);
+  Py_RETURN_NONE;
+}
+
+/* Turn latency tracking on or off, off drops the histograms */
+PyObject *RingTrackLatency(PyObject *self, PyObject *args) {
+  Ring *ring = (Ring *)self;
+  int enable = 1;
+
+  if (!PyArg_ParseTuple(args, "|p:track_latency", &enable)) return NULL;
+
+  unsigned long long *latency = NULL;
+  if (enable) {
+    latency = PyMem_Calloc(STATS_OPS * STATS_BUCKETS, sizeof(*latency));
+    if (latency == NULL) return PyErr_NoMemory();
+  }
+
+  RING_LOCK(ring->sq_lock);
+  RING_LOCK(ring->cq_lock);
+  if (enable && ring->stats.latency != NULL) {
+    /* Already on, keep what was recorded */
+    PyMem_Free(latency);
+  } else {
+    PyMem_Free(ring->stats.latency);
+    ring->stats.latency = latency;
+  }
+  RING_UNLOCK(ring->cq_lock);
+  RING_UNLOCK(ring->sq_lock);
+  Py_RETURN_NONE;
+}
+
+static void StatsDestructor(PyObject *self) {
+  Py_XDECREF(((Stats *)self)->latency);
+  Py_TYPE(self)->tp_free(self);
+}
+
+static PyObject *StatsRepr(PyObject *self) {
+  Stats *stats = (Stats *)self;
+  return PyUnicode_FromFormat(
+      "<Stats prepared=%llu submitted=%llu enters=%llu reaped=%llu "
+      "sq_full=%llu cq_overflow=%llu>",
+      stats->sqes_prepared, stats->sqes_submitted, stats->enters,
+      stats->cqes_reaped, stats->sq_full, stats->cq_overflow);
+}
+
+static PyMemberDef stats_members[] = {
+    {"sqes_prepared", T_ULONGLONG, offsetof(Stats, sqes_prepared), READONLY,
+     "Entries filled by the prep helpers"},
+    {"sqes_submitted", T_ULONGLONG, offsetof(Stats, sqes_submitted), READONLY,
+     "Entries handed over to the kernel"},
+    {"enters", T_ULONGLONG, offsetof(Stats, enters), READONLY,
+     "io_uring_enter system calls to submit or wait"},
+    {"cqes_reaped", T_ULONGLONG, offsetof(Stats, cqes_reaped), READONLY,
+     "Completions consumed"},
+    {"sq_full", T_ULONGLONG, offsetof(Stats, sq_full), READONLY,
+     "Times an entry was asked for while the submission queue was full"},
+    {"cq_overflow", T_ULONGLONG, offsetof(Stats, cq_overflow), READONLY,
+     "Completions the kernel dropped because the completion queue was full"},
+    {"sq_wakeups", T_ULONGLONG, offsetof(Stats, sq_wakeups), READONLY,
+     "Submissions that had to wake up the SQPOLL thread"},
+    {"sq_skipped", T_ULONGLONG, offsetof(Stats, sq_skipped), READONLY,
+     "Submissions the awake SQPOLL thread took without a system call"},
+    {"latency", T_OBJECT, offsetof(Stats, latency), READONLY,
+     "Histogram of submit to completion latency by opcode, None if not "
+     "tracked"},
+    {NULL, 0, 0, 0, NULL}};
+
+static PyTypeObject stats_type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0) "_uring_io.Stats", /* tp_name */
+    sizeof(Stats),                   /* tp_basicsize */
+    0,                               /* tp_itemsize */
+    (destructor)StatsDestructor,     /* tp_dealloc */
+    0,                               /* tp_print */
+    0,                               /* tp_getattr */
+    0,                               /* tp_setattr */
+    0,                               /* tp_reserved */
+    StatsRepr,                       /* tp_repr */
+    0,                               /* tp_as_number */
+    0,                               /* tp_as_sequence */
+    0,                               /* tp_as_mapping */
+    0,                               /* tp_hash */
+    0,                               /* tp_call */
+    0,                               /* tp_str */
+    0,                               /* tp_getattro */
+    0,                               /* tp_setattro */
+    0,                               /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,              /* tp_flags */
+    "Snapshot of the counters of a ring, see Ring.stats", /* tp_doc */
+    (traverseproc)NULL,              /* tp_traverse */
+    (inquiry)NULL,                   /* tp_clear */
+    0,                               /* tp_richcompare */
+    0,                               /* tp_weaklistoffset */
+    0,                               /* tp_iter */
+    0,                               /* tp_iternext */
+    0,                               /* tp_methods */
+    stats_members,                   /* tp_members */
+};
+
+/* Latency below which p percent of the recorded ones are */
+static PyObject *HistogramPercentile(PyObject *self, PyObject *args) {
+  Histogram *hist = (Histogram *)self;
+  double p;
+
+  if (!PyArg_ParseTuple(args, "d:percentile", &p)) return NULL;
+  if (p < 0 || p > 100) {
+    PyErr_SetString(PyExc_ValueError, "percentile must be in 0..100");
+    return NULL;
+  }
+
+  unsigned long long rank = (unsigned long long)(p / 100 * hist->count);
+  unsigned long long seen = 0;
+  unsigned int i;
+  for (i = 0; i < STATS_BUCKETS - 1; i++) {
+    seen += hist->buckets[i];
+    if (seen > rank || seen == hist->count) break;
+  }
+  return PyLong_FromUnsignedLongLong(stats_bucket_low(i + 1) - 1);
+}
+
+/* Non-empty buckets as (low, high, count) */
+static PyObject *HistogramBuckets(PyObject *self, PyObject *args) {
+  (void)args;
+  Histogram *hist = (Histogram *)self;
+  PyObject *list = PyList_New(0);
+
+  for (unsigned int i = 0; list != NULL && i < STATS_BUCKETS; i++) {
+    if (hist->buckets[i] == 0) continue;
+    PyObject *item = Py_BuildValue("KKK", stats_bucket_low(i),
+                                   stats_bucket_low(i + 1) - 1,
+                                   hist->buckets[i]);
+    if (item == NULL || PyList_Append(list, item) < 0) Py_CLEAR(list);
+    Py_XDECREF(item);
+  }
+  return list;
+}
+
+/* Mean latency, taking the middle of each bucket */
+static PyObject *HistogramGetMean(PyObject *self, void *closure) {
+  (void)closure;
+  Histogram *hist = (Histogram *)self;
+  double sum = 0;
+
+  for (unsigned int i = 0; i < STATS_BUCKETS; i++) {
+    if (hist->buckets[i] == 0) continue;
+    double low = (double)stats_bucket_low(i);
+    double high = (double)stats_bucket_low(i + 1);
+    sum += hist->buckets[i] * (low + high - 1) / 2;
+  }
+  return PyFloat_FromDouble(hist->count ? sum / hist->count : 0.0);
+}
+
+static PyObject *HistogramRepr(PyObject *self) {
+  Histogram *hist = (Histogram *)self;
+  return PyUnicode_FromFormat("<Histogram count=%llu>", hist->count);
+}
+
+static PyMemberDef histogram_members[] = {
+    {"count", T_ULONGLONG, offsetof(Histogram, count), READONLY,
+     "Number of latencies recorded"},
+    {NULL, 0, 0, 0, NULL}};
+
+static PyGetSetDef histogram_getset[] = {
+    {"mean", HistogramGetMean, NULL, "Approximate mean latency in ns", NULL},
+    {NULL, NULL, NULL, NULL, NULL}};
+
+static PyMethodDef histogram_methods[] = {
+    {"percentile", HistogramPercentile, METH_VARARGS,
+     "percentile(p)\n\n"
+     "Upper bound in nanoseconds of the latency p percent of the operations\n"
+     "stayed within, e.g. percentile(99)"},
+    {"buckets", HistogramBuckets, METH_NOARGS,
+     "buckets()\n\n"
+     "List the non-empty buckets as (low, high, count), low and high being\n"
+     "the inclusive latency range in nanoseconds"},
+    {NULL, NULL, 0, NULL}};
+
+static PyTypeObject histogram_type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0) "_uring_io.Histogram", /* tp_name */
+    sizeof(Histogram),               /* tp_basicsize */
+    0,                               /* tp_itemsize */
+    0,                               /* tp_dealloc */
+    0,                               /* tp_print */
+    0,                               /* tp_getattr */
+    0,                               /* tp_setattr */
+    0,                               /* tp_reserved */
+    HistogramRepr,                   /* tp_repr */
+    0,                               /* tp_as_number */
+    0,                               /* tp_as_sequence */
+    0,                               /* tp_as_mapping */
+    0,                               /* tp_hash */
+    0,                               /* tp_call */
+    0,                               /* tp_str */
+    0,                               /* tp_getattro */
+    0,                               /* tp_setattro */
+    0,                               /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,              /* tp_flags */
+    "Latency histogram of an opcode, see Stats.latency", /* tp_doc */
+    (traverseproc)NULL,              /* tp_traverse */
+    (inquiry)NULL,                   /* tp_clear */
+    0,                               /* tp_richcompare */
+    0,                               /* tp_weaklistoffset */
+    0,                               /* tp_iter */
+    0,                               /* tp_iternext */
+    histogram_methods,               /* tp_methods */
+    histogram_members,               /* tp_members */
+    histogram_getset,                /* tp_getset */
+};
+
+extern void register_stats(PyObject *mod) {
+  if (PyType_Ready(&stats_type) < 0 || PyType_Ready(&histogram_type) < 0)
+    return;
+  Py_INCREF(&stats_type);
+  if (PyModule_AddObject(mod, "Stats", (PyObject *)&stats_type) < 0)
+    Py_DECREF(&stats_type);
+  Py_INCREF(&histogram_type);
+  if (PyModule_AddObject(mod, "Histogram", (PyObject *)&histogram_type) < 0)
+    Py_DECREF(&histogram_type);
+}
@@ -0,0 +1,582 @@
+/*
+ * Copyright (c) 2021 Reza Mahdi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Hierarchical timer wheel.
+ *
+ * Deadlines are counted in ticks of a fixed resolution. Level L of the wheel
+ * has WHEEL_SIZE slots of WHEEL_SIZE^L ticks each, and a timer goes into the
+ * lowest level whose span covers its distance from the current tick. When
+ * the current tick crosses the start of a slot above level 0, the timers of
+ * that slot cascade down to the levels below; the timers of a level 0 slot
+ * expire when the current tick reaches it. Adding and removing a timer are
+ * O(1): the slots are doubly linked lists of nodes in a pool, and a timer is
+ * identified by the index of its node plus a generation, like the tokens of
+ * user_data.
+ *
+ * A bitmap of the occupied slots per level gives the next tick anything
+ * happens without walking the slots, so advancing over idle time and
+ * finding the next deadline cost O(levels). Timers expiring in the same
+ * advance are returned sorted by deadline, and in order of adding among
+ * equal deadlines, so the wheel keeps the order of a heap.
+ *
+ * With slack, deadlines are rounded up to a multiple of it, so timers close
+ * to each other share a slot and a single wakeup.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "uring.h"
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 6
+#define WHEEL_NONE UINT32_MAX
+/* Extra slot of timers added after their tick passed */
+#define WHEEL_DUE (WHEEL_LEVELS * WHEEL_SIZE)
+/* Distances beyond the top level are parked at its far end */
+#define WHEEL_MAX_DELTA ((1ull << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+#define WHEEL_GEN_MASK 0x7fffffffu
+
+typedef struct {
+  PyObject *obj; /* NULL while free */
+  double when;
+  uint64_t expires; /* tick */
+  uint64_t seq;     /* order of adding */
+  uint32_t prev;
+  uint32_t next; /* in the slot, or on the free list */
+  uint32_t gen;
+  uint16_t slot; /* level * WHEEL_SIZE + index */
+} wheel_node;
+
+/* An expired timer, sorted before handing them out */
+typedef struct {
+  double when;
+  uint64_t seq;
+  uint32_t index;
+} wheel_expired;
+
+typedef struct {
+  PyObject_HEAD wheel_node *nodes;
+  uint32_t size;
+  uint32_t count;
+  uint32_t free_head;
+  uint32_t head[WHEEL_DUE + 1];
+  uint32_t tail[WHEEL_DUE + 1];
+  uint64_t occupied[WHEEL_LEVELS]; /* bitmap of non-empty slots per level */
+  uint64_t current;                /* next tick to process */
+  uint64_t seq;
+  uint64_t slack; /* ticks */
+  double resolution;
+  /* Scratch space of expire */
+  wheel_expired *expired;
+  size_t expired_size;
+} TimerWheel;
+
+static PyTypeObject timer_wheel_type;
+
+/*
+ * The tick a deadline is due at, never before it. Both conversions tolerate
+ * the rounding of when / resolution, so a timer is due at its own deadline.
+ */
+static uint64_t wheel_tick_of(TimerWheel *wheel, double when) {
+  double ticks = ceil(when / wheel->resolution - 1e-6);
+  if (!(ticks > 0)) return 0;
+  if (ticks >= 0x1p63) return UINT64_C(1) << 63;
+  uint64_t tick = (uint64_t)ticks;
+  if (wheel->slack > 1)
+    tick = (tick + wheel->slack - 1) / wheel->slack * wheel->slack;
+  return tick;
+}
+
+/* The last tick that has passed at now */
+static uint64_t wheel_now(TimerWheel *wheel, double now) {
+  double ticks = floor(now / wheel->resolution + 1e-6);
+  if (!(ticks > 0)) return 0;
+  if (ticks >= 0x1p63) return UINT64_C(1) << 63;
+  return (uint64_t)ticks;
+}
+
+static uint64_t wheel_rotate(uint64_t bits, unsigned int n) {
+  n &= WHEEL_MASK;
+  return n ? (bits >> n) | (bits << (WHEEL_SIZE - n)) : bits;
+}
+
+static void wheel_mark(TimerWheel *wheel, unsigned int slot, int occupied) {
+  if (slot == WHEEL_DUE) return;
+  uint64_t bit = UINT64_C(1) << (slot & WHEEL_MASK);
+  if (occupied)
+    wheel->occupied[slot / WHEEL_SIZE] |= bit;
+  else
+    wheel->occupied[slot / WHEEL_SIZE] &= ~bit;
+}
+
+/* Put a node in the slot its deadline falls in, seen from the current tick */
+static void wheel_link(TimerWheel *wheel, uint32_t index) {
+  wheel_node *node = &wheel->nodes[index];
+  uint64_t expires = node->expires;
+  unsigned int slot = WHEEL_DUE;
+  if (expires >= wheel->current) {
+    uint64_t delta = expires - wheel->current;
+    if (delta > WHEEL_MAX_DELTA) {
+      delta = WHEEL_MAX_DELTA;
+      expires = wheel->current + delta;
+    }
+
+    unsigned int level = 0;
+    while (level < WHEEL_LEVELS - 1 &&
+           delta >> (WHEEL_BITS * (level + 1)) != 0)
+      level++;
+    slot = level * WHEEL_SIZE +
+           ((expires >> (WHEEL_BITS * level)) & WHEEL_MASK);
+  }
+
+  node->slot = slot;
+  node->next = WHEEL_NONE;
+  node->prev = wheel->tail[slot];
+  if (node->prev == WHEEL_NONE)
+    wheel->head[slot] = index;
+  else
+    wheel->nodes[node->prev].next = index;
+  wheel->tail[slot] = index;
+  wheel_mark(wheel, slot, 1);
+}
+
+static void wheel_unlink(TimerWheel *wheel, uint32_t index) {
+  wheel_node *node = &wheel->nodes[index];
+  unsigned int slot = node->slot;
+
+  if (node->prev == WHEEL_NONE)
+    wheel->head[slot] = node->next;
+  else
+    wheel->nodes[node->prev].next = node->next;
+  if (node->next == WHEEL_NONE)
+    wheel->tail[slot] = node->prev;
+  else
+    wheel->nodes[node->next].prev = node->prev;
+  if (wheel->head[slot] == WHEEL_NONE) wheel_mark(wheel, slot, 0);
+}
+
+/* Detach the list of a slot and return its first node */
+static uint32_t wheel_take(TimerWheel *wheel, unsigned int slot) {
+  uint32_t first = wheel->head[slot];
+  wheel->head[slot] = wheel->tail[slot] = WHEEL_NONE;
+  wheel_mark(wheel, slot, 0);
+  return first;
+}
+
+/*
+ * The next tick that expires a timer or cascades a slot. Slots above level
+ * 0 are due when the current tick reaches their start, the current slot of
+ * a level only if the current tick is that start.
+ */
+static uint64_t wheel_next_tick(TimerWheel *wheel) {
+  if (wheel->head[WHEEL_DUE] != WHEEL_NONE) return wheel->current - 1;
+
+  uint64_t next = UINT64_MAX;
+  for (unsigned int level = 0; level < WHEEL_LEVELS; level++) {
+    uint64_t bits = wheel->occupied[level];
+    if (bits == 0) continue;
+
+    unsigned int shift = WHEEL_BITS * level;
+    uint64_t base = wheel->current >> shift;
+    unsigned int index = base & WHEEL_MASK;
+    uint64_t distance;
+    if ((wheel->current & ((UINT64_C(1) << shift) - 1)) == 0)
+      distance = __builtin_ctzll(wheel_rotate(bits, index));
+    else
+      distance = __builtin_ctzll(wheel_rotate(bits, index + 1)) + 1;
+
+    uint64_t tick = (base + distance) << shift;
+    if (tick < next) next = tick;
+  }
+  return next;
+}
+
+static int wheel_collect(TimerWheel *wheel, size_t *count, uint32_t index) {
+  if (*count == wheel->expired_size) {
+    size_t size = wheel->expired_size ? wheel->expired_size * 2 : 64;
+    wheel_expired *expired =
+        PyMem_Realloc(wheel->expired, size * sizeof(wheel_expired));
+    if (expired == NULL) {
+      PyErr_NoMemory();
+      return -1;
+    }
+    wheel->expired = expired;
+    wheel->expired_size = size;
+  }
+
+  wheel_node *node = &wheel->nodes[index];
+  wheel->expired[*count].when = node->when;
+  wheel->expired[*count].seq = node->seq;
+  wheel->expired[*count].index = index;
+  (*count)++;
+  return 0;
+}
+
+/* Collect the timers of a slot */
+static int wheel_expire_slot(TimerWheel *wheel, unsigned int slot,
+                             size_t *count) {
+  uint32_t node = wheel_take(wheel, slot);
+  while (node != WHEEL_NONE) {
+    /* The node stays out of the slots until expire releases it */
+    wheel->nodes[node].slot = UINT16_MAX;
+    if (wheel_collect(wheel, count, node) < 0) {
+      /* Put the rest back, the collected ones are handed out anyway */
+      while (node != WHEEL_NONE) {
+        uint32_t next = wheel->nodes[node].next;
+        wheel_link(wheel, node);
+        node = next;
+      }
+      return -1;
+    }
+    node = wheel->nodes[node].next;
+  }
+  return 0;
+}
+
+/*
+ * Process the current tick: cascade the slots starting at it, highest level
+ * first as its timers may land in the slots below, then collect the timers
+ * of the level 0 slot.
+ */
+static int wheel_tick(TimerWheel *wheel, size_t *count) {
+  uint64_t current = wheel->current;
+  unsigned int top = 0;
+  while (top < WHEEL_LEVELS - 1 &&
+         (current & ((UINT64_C(1) << (WHEEL_BITS * (top + 1))) - 1)) == 0)
+    top++;
+
+  for (unsigned int level = top; level > 0; level--) {
+    unsigned int index = (current >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    uint32_t node = wheel_take(wheel, level * WHEEL_SIZE + index);
+    while (node != WHEEL_NONE) {
+      uint32_t next = wheel->nodes[node].next;
+      wheel_link(wheel, node);
+      node = next;
+    }
+  }
+
+  return wheel_expire_slot(wheel, current & WHEEL_MASK, count);
+}
+
+static int wheel_expired_compare(const void *a, const void *b) {
+  const wheel_expired *x = a, *y = b;
+  if (x->when != y->when) return x->when < y->when ? -1 : 1;
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* Grow the pool to size nodes, threading the new ones on the free list */
+static int wheel_grow(TimerWheel *wheel, uint32_t size) {
+  wheel_node *nodes = PyMem_Realloc(wheel->nodes, size * sizeof(wheel_node));
+  if (nodes == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  for (uint32_t i = wheel->size; i < size; i++) {
+    nodes[i].obj = NULL;
+    nodes[i].gen = 0;
+    nodes[i].next = i + 1 < size ? i + 1 : wheel->free_head;
+  }
+  wheel->free_head = wheel->size;
+  wheel->nodes = nodes;
+  wheel->size = size;
+  return 0;
+}
+
+static void wheel_release(TimerWheel *wheel, uint32_t index) {
+  wheel_node *node = &wheel->nodes[index];
+  node->obj = NULL;
+  node->gen = (node->gen + 1) & WHEEL_GEN_MASK;
+  node->next = wheel->free_head;
+  wheel->free_head = index;
+  wheel->count--;
+}
+
+/* Find the node of a live timer id, or WHEEL_NONE */
+static uint32_t wheel_find(TimerWheel *wheel, unsigned long long id) {
+  uint32_t index = (uint32_t)id;
+  if (id >> 63 || index >= wheel->size) return WHEEL_NONE;
+  wheel_node *node = &wheel->nodes[index];
+  if (node->obj == NULL || node->gen != (uint32_t)(id >> 32) ||
+      node->slot == UINT16_MAX)
+    return WHEEL_NONE;
+  return index;
+}
+
+static void wheel_clear(TimerWheel *wheel) {
+  for (uint32_t i = 0; i < wheel->size; i++) Py_CLEAR(wheel->nodes[i].obj);
+  PyMem_Free(wheel->nodes);
+  wheel->nodes = NULL;
+  wheel->size = 0;
+  wheel->count = 0;
+  wheel->free_head = WHEEL_NONE;
+  for (unsigned int i = 0; i <= WHEEL_DUE; i++)
+    wheel->head[i] = wheel->tail[i] = WHEEL_NONE;
+  for (unsigned int i = 0; i < WHEEL_LEVELS; i++) wheel->occupied[i] = 0;
+}
+
+static char *timer_wheel_kwds[] = {"now", "resolution", "slack", NULL};
+
+int TimerWheelInit(PyObject *self, PyObject *args, PyObject *kwds) {
+  TimerWheel *wheel = (TimerWheel *)self;
+  double now = 0, resolution = 0.001, slack = 0;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|d$dd:TimerWheel",
+                                   timer_wheel_kwds, &now, &resolution,
+                                   &slack))
+    return -1;
+  if (!(resolution > 0) || !isfinite(resolution)) {
+    PyErr_SetString(PyExc_ValueError, "resolution must be positive");
+    return -1;
+  }
+  if (!(slack >= 0) || !isfinite(slack)) {
+    PyErr_SetString(PyExc_ValueError, "slack must not be negative");
+    return -1;
+  }
+
+  wheel_clear(wheel);
+  wheel->resolution = resolution;
+  wheel->slack = (uint64_t)ceil(slack / resolution);
+  wheel->current = wheel_now(wheel, now);
+  wheel->seq = 0;
+  return 0;
+}
+
+/* Add a timer due at when and return its id */
+PyObject *TimerWheelAdd(PyObject *self, PyObject *args) {
+  TimerWheel *wheel = (TimerWheel *)self;
+  double when;
+  PyObject *obj;
+
+  if (!PyArg_ParseTuple(args, "dO:add", &when, &obj)) return NULL;
+  if (isnan(when)) {
+    PyErr_SetString(PyExc_ValueError, "when is NaN");
+    return NULL;
+  }
+  if (wheel->free_head == WHEEL_NONE) {
+    if (wheel->size > WHEEL_GEN_MASK / 2) {
+      PyErr_SetString(PyExc_OverflowError, "too many timers");
+      return NULL;
+    }
+    if (wheel_grow(wheel, wheel->size ? wheel->size * 2 : 64) < 0)
+      return NULL;
+  }
+
+  uint32_t index = wheel->free_head;
+  wheel_node *node = &wheel->nodes[index];
+  wheel->free_head = node->next;
+  wheel->count++;
+
+  Py_INCREF(obj);
+  node->obj = obj;
+  node->when = when;
+  node->expires = wheel_tick_of(wheel, when);
+  node->seq = wheel->seq++;
+  wheel_link(wheel, index);
+  return PyLong_FromUnsignedLongLong(((unsigned long long)node->gen << 32) |
+                                     index);
+}
+
+/* Remove a timer, False if it already expired or was removed */
+PyObject *TimerWheelRemove(PyObject *self, PyObject *args) {
+  TimerWheel *wheel = (TimerWheel *)self;
+  unsigned long long id;
+
+  if (!PyArg_ParseTuple(args, "K:remove", &id)) return NULL;
+  uint32_t index = wheel_find(wheel, id);
+  if (index == WHEEL_NONE) Py_RETURN_FALSE;
+
+  PyObject *obj = wheel->nodes[index].obj;
+  wheel_unlink(wheel, index);
+  wheel_release(wheel, index);
+  Py_DECREF(obj);
+  Py_RETURN_TRUE;
+}
+
+/* Time of the next tick anything is due, None without timers */
+PyObject *TimerWheelNextDeadline(PyObject *self, PyObject *args) {
+  TimerWheel *wheel = (TimerWheel *)self;
+  (void)args;
+
+  if (wheel->count == 0) Py_RETURN_NONE;
+  return PyFloat_FromDouble(wheel_next_tick(wheel) * wheel->resolution);
+}
+
+/* Advance the wheel to now and return the timers due, sorted by deadline */
+PyObject *TimerWheelExpire(PyObject *self, PyObject *args) {
+  TimerWheel *wheel = (TimerWheel *)self;
+  double now;
+
+  if (!PyArg_ParseTuple(args, "d:expire", &now)) return NULL;
+  uint64_t now_tick = wheel_now(wheel, now);
+
+  size_t count = 0;
+  int err = wheel_expire_slot(wheel, WHEEL_DUE, &count);
+  while (err == 0 && wheel->count > count) {
+    uint64_t tick = wheel_next_tick(wheel);
+    if (tick > now_tick) break;
+    wheel->current = tick;
+    err = wheel_tick(wheel, &count);
+    wheel->current = tick + 1;
+    if (err < 0) break;
+  }
+  if (err == 0 && now_tick >= wheel->current) wheel->current = now_tick + 1;
+
+  PyObject *list = err < 0 ? NULL : PyList_New(count);
+  qsort(wheel->expired, count, sizeof(wheel_expired), wheel_expired_compare);
+  for (size_t i = 0; i < count; i++) {
+    uint32_t index = wheel->expired[i].index;
+    PyObject *obj = wheel->nodes[index].obj;
+    wheel_release(wheel, index);
+    if (list != NULL)
+      PyList_SET_ITEM(list, i, obj);
+    else
+      Py_DECREF(obj);
+  }
+  return list;
+}
+
+PyObject *TimerWheelClear(PyObject *self, PyObject *args) {
+  TimerWheel *wheel = (TimerWheel *)self;
+  (void)args;
+
+  wheel_clear(wheel);
+  Py_RETURN_NONE;
+}
+
+static Py_ssize_t TimerWheelLength(PyObject *self) {
+  return ((TimerWheel *)self)->count;
+}
+
+static PyObject *TimerWheelGetSlack(PyObject *self, void *closure) {
+  TimerWheel *wheel = (TimerWheel *)self;
+  (void)closure;
+  return PyFloat_FromDouble(wheel->slack * wheel->resolution);
+}
+
+static PyObject *TimerWheelNew(PyTypeObject *type, PyObject *args,
+                               PyObject *kwds) {
+  (void)args;
+  (void)kwds;
+  TimerWheel *wheel = (TimerWheel *)type->tp_alloc(type, 0);
+  if (wheel == NULL) return NULL;
+  wheel->free_head = WHEEL_NONE;
+  wheel->resolution = 0.001;
+  for (unsigned int i = 0; i <= WHEEL_DUE; i++)
+    wheel->head[i] = wheel->tail[i] = WHEEL_NONE;
+  return (PyObject *)wheel;
+}
+
+void TimerWheelDestructor(PyObject *self) {
+  TimerWheel *wheel = (TimerWheel *)self;
+  wheel_clear(wheel);
+  PyMem_Free(wheel->expired);
+  Py_TYPE(self)->tp_free(self);
+}
+
+static PyMemberDef timer_wheel_members[] = {
+    {"resolution", T_DOUBLE, offsetof(TimerWheel, resolution), READONLY,
+     "Length of a tick in seconds"},
+    {NULL, 0, 0, 0, NULL}};
+
+static PyGetSetDef timer_wheel_getset[] = {
+    {"slack", TimerWheelGetSlack, NULL,
+     "Deadlines are rounded up to a multiple of it, in seconds", NULL},
+    {NULL, NULL, NULL, NULL, NULL}};
+
+static PyMethodDef timer_wheel_methods[] = {
+    {"add", TimerWheelAdd, METH_VARARGS,
+     "add(when, obj)\n\n"
+     "Add obj to expire at when and return the id of the timer"},
+    {"remove", TimerWheelRemove, METH_VARARGS,
+     "remove(id)\n\n"
+     "Remove the timer id. Returns False if it expired or was removed"},
+    {"next_deadline", TimerWheelNextDeadline, METH_NOARGS,
+     "next_deadline()\n\n"
+     "Time of the next tick a timer expires or a slot cascades at, None\n"
+     "without timers. Never after the earliest deadline, waiting until it\n"
+     "and calling expire gets the due timers"},
+    {"expire", TimerWheelExpire, METH_VARARGS,
+     "expire(now)\n\n"
+     "Remove the timers due at now and return their objects, sorted by\n"
+     "deadline"},
+    {"clear", TimerWheelClear, METH_NOARGS, "clear()\n\nRemove all timers"},
+    {NULL, NULL, 0, NULL}};
+
+static PySequenceMethods timer_wheel_as_sequence = {
+    TimerWheelLength, /* sq_length */
+};
+
+static PyTypeObject timer_wheel_type = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0) "_uring_io.TimerWheel", /* tp_name */
+    sizeof(TimerWheel),                  /* tp_basicsize */
+    0,                                   /* tp_itemsize */
+    (destructor)TimerWheelDestructor,    /* tp_dealloc */
+    0,                                   /* tp_print */
+    0,                                   /* tp_getattr */
+    0,                                   /* tp_setattr */
+    0,                                   /* tp_reserved */
+    0,                                   /* tp_repr */
+    0,                                   /* tp_as_number */
+    &timer_wheel_as_sequence,            /* tp_as_sequence */
+    0,                                   /* tp_as_mapping */
+    0,                                   /* tp_hash */
+    0,                                   /* tp_call */
+    0,                                   /* tp_str */
+    0,                                   /* tp_getattro */
+    0,                                   /* tp_setattro */
+    0,                                   /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                  /* tp_flags */
+    "TimerWheel(now=0, *, resolution=0.001, slack=0)\n\n"
+    "Timers with O(1) add and remove, counted in ticks of resolution seconds\n"
+    "from now. Deadlines are rounded up to the next tick, and to a multiple\n"
+    "of slack so that nearby timers expire together", /* tp_doc */
+    (traverseproc)NULL,                  /* tp_traverse */
+    (inquiry)NULL,                       /* tp_clear */
+    0,                                   /* tp_richcompare */
+    0,                                   /* tp_weaklistoffset */
+    0,                                   /* tp_iter */
+    0,                                   /* tp_iternext */
+    timer_wheel_methods,                 /* tp_methods */
+    timer_wheel_members,                 /* tp_members */
+    timer_wheel_getset,                  /* tp_getset */
+    0,                                   /* tp_base */
+    0,                                   /* tp_dict */
+    0,                                   /* tp_descr_get */
+    0,                                   /* tp_descr_set */
+    0,                                   /* tp_dictoffset */
+    TimerWheelInit,                      /* tp_init */
+    PyType_GenericAlloc,                 /* tp_alloc */
+    TimerWheelNew,                       /* tp_new */
+};
+
+extern void register_timer_wheel(PyObject *mod) {
+  if (PyType_Ready(&timer_wheel_type) < 0) return;
+  Py_INCREF(&timer_wheel_type);
+  if (PyModule_AddObject(mod, "TimerWheel", (PyObject *)&timer_wheel_type) < 0)
+    Py_DECREF(&timer_wheel_type);
+}
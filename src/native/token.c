@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2021 Reza Mahdi
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Table of objects attached to in-flight operations.
+ *
+ * The kernel hands back the 64-bit user_data of an SQE untouched in its CQE.
+ * Instead of a PyObject pointer, user_data carries a token: the index of a
+ * slot in this table plus the generation of that slot, with the top bit set
+ * so it never collides with raw integers. A slot is released exactly once,
+ * when the final completion of its operation is consumed, and the generation
+ * is bumped so stale tokens resolve to nothing.
+ */
+
+#include <liburing.h>
+#include <stdint.h>
+
+#include "uring.h"
+
+#define TOKEN_GEN_MASK 0x7fffffffu
+#define TOKEN_NONE UINT32_MAX
+
+static __u64 token_make(uint32_t index, uint32_t gen) {
+  return TOKEN_FLAG | ((__u64)gen << 32) | index;
+}
+
+/* Find the slot of a live token, or NULL */
+token_slot *token_slot_of(token_table *table, __u64 token) {
+  if (!TOKEN_CHECK(token)) return NULL;
+
+  uint32_t index = (uint32_t)token;
+  uint32_t gen = (uint32_t)(token >> 32) & TOKEN_GEN_MASK;
+  if (index >= table->size) return NULL;
+
+  token_slot *slot = &table->slots[index];
+  if (slot->obj == NULL || slot->gen != gen) return NULL;
+  return slot;
+}
+
+/* Grow the table to size slots, threading the new ones on the free list */
+static int token_table_grow(token_table *table, uint32_t size) {
+  token_slot *slots = PyMem_Realloc(table->slots, size * sizeof(token_slot));
+  if (slots == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  for (uint32_t i = table->size; i < size; i++) {
+    slots[i].obj = NULL;
+    slots[i].keep = NULL;
+    slots[i].gen = 0;
+    slots[i].next_free = i + 1 < size ? i + 1 : table->free_head;
+  }
+  table->free_head = table->size;
+  table->slots = slots;
+  table->size = size;
+  return 0;
+}
+
+int token_table_init(token_table *table, uint32_t size) {
+  table->slots = NULL;
+  table->size = 0;
+  table->used = 0;
+  table->free_head = TOKEN_NONE;
+  return token_table_grow(table, size ? size : 1);
+}
+
+void token_table_clear(token_table *table) {
+  for (uint32_t i = 0; i < table->size; i++) {
+    Py_CLEAR(table->slots[i].obj);
+    Py_CLEAR(table->slots[i].keep);
+  }
+  PyMem_Free(table->slots);
+  table->slots = NULL;
+  table->size = 0;
+  table->used = 0;
+  table->free_head = TOKEN_NONE;
+}
+
+/* Store a reference to obj and return its token, 0 on error */
+__u64 token_acquire(token_table *table, PyObject *obj) {
+  if (table->free_head == TOKEN_NONE) {
+    if (table->size > TOKEN_GEN_MASK / 2) {
+      PyErr_SetString(PyExc_OverflowError, "too many operations in flight");
+      return 0;
+    }
+    if (token_table_grow(table, table->size * 2) < 0) return 0;
+  }
+
+  uint32_t index = table->free_head;
+  token_slot *slot = &table->slots[index];
+  table->free_head = slot->next_free;
+
+  Py_INCREF(obj);
+  slot->obj = obj;
+  slot->stamp = 0;
+  table->used++;
+  return token_make(index, slot->gen);
+}
+
+/* Object of a live token as a borrowed reference, or NULL */
+PyObject *token_lookup(token_table *table, __u64 token) {
+  token_slot *slot = token_slot_of(table, token);
+  return slot ? slot->obj : NULL;
+}
+
+/*
+ * Free the slot of a token and hand its reference over to the caller. Stale
+ * tokens and raw user data give NULL without an exception.
+ */
+PyObject *token_release(token_table *table, __u64 token) {
+  token_slot *slot = token_slot_of(table, token);
+  if (slot == NULL) return NULL;
+
+  PyObject *obj = slot->obj;
+  PyObject *keep = slot->keep;
+  slot->obj = NULL;
+  slot->keep = NULL;
+  slot->gen = (slot->gen + 1) & TOKEN_GEN_MASK;
+  slot->next_free = table->free_head;
+  table->free_head = (uint32_t)(slot - table->slots);
+  table->used--;
+  Py_XDECREF(keep);
+  return obj;
+}
+
+/* Hold a reference to keep until the live token is released */
+void token_keep(token_table *table, __u64 token, PyObject *keep) {
+  token_slot *slot = token_slot_of(table, token);
+  if (slot == NULL) return;
+
+  Py_XINCREF(keep);
+  Py_XSETREF(slot->keep, keep);
+}
+
+/* New list of (token, object) pairs of the live slots */
+PyObject *token_items(token_table *table) {
+  PyObject *items = PyList_New(0);
+  if (items == NULL) return NULL;
+
+  for (uint32_t i = 0; i < table->size; i++) {
+    token_slot *slot = &table->slots[i];
+    if (slot->obj == NULL) continue;
+    PyObject *item = Py_BuildValue("KO", token_make(i, slot->gen), slot->obj);
+    if (item == NULL || PyList_Append(items, item) < 0) {
+      Py_XDECREF(item);
+      Py_DECREF(items);
+      return NULL;
+    }
+    Py_DECREF(item);
+  }
+  return items;
+}
@@ -18,28 +18,233 @@
 #include <pyerrors.h>
 #include <structmember.h>
 
+/**
+ * @brief Slot of the token table, see token.c
+ *
+ */
+typedef struct {
+  PyObject *obj;      /* attached object, NULL while free */
+  PyObject *keep;     /* held until the slot is released, may be NULL */
+  uint32_t gen;       /* bumped each time the slot is released */
+  uint32_t next_free; /* next slot of the free list */
+  __u64 stamp;        /* submit time for latency tracking, 0 if not stamped */
+  __u8 opcode;        /* opcode of the stamped operation */
+} token_slot;
+
+typedef struct {
+  token_slot *slots;
+  uint32_t size;
+  uint32_t used; /* slots holding an object */
+  uint32_t free_head;
+} token_table;
+
+/**
+ * @brief Counters of a ring, see stats.c
+ *
+ */
+typedef struct {
+  unsigned long long sqes_prepared;  /* entries filled by prep helpers */
+  unsigned long long sqes_submitted; /* entries handed to the kernel */
+  unsigned long long enters;         /* io_uring_enter system calls */
+  unsigned long long cqes_reaped;    /* completions consumed */
+  unsigned long long sq_full;        /* prep attempts on a full SQ */
+  unsigned long long *latency;       /* histograms per opcode, or NULL */
+} ring_stats;
+
+/* Tokens have the top bit set, lower user_data values are passed raw */
+#define TOKEN_FLAG (1ULL << 63)
+#define TOKEN_CHECK(user_data) (((user_data)&TOKEN_FLAG) != 0)
+/* Index of no slot, tags user_data the ring reserves for its own entries */
+#define TOKEN_RESERVED 0xffffffffu
+
 typedef struct {
   PyObject_HEAD struct io_uring ring;
   PyObject *entries;
+  PyThread_type_lock sq_lock; /* guards the submission side */
+  PyThread_type_lock cq_lock; /* guards the completion side */
+  PyObject **sqe_keep; /* per SQE slot data the kernel reads on submit */
+  token_table tokens;  /* objects attached to in-flight operations */
+  PyObject **buffers;  /* memoryviews of the registered buffers */
+  unsigned int nr_buffers;
+  unsigned long long sq_wakeups; /* SQPOLL submits that woke the thread */
+  unsigned long long sq_skipped; /* SQPOLL submits without a syscall */
+  unsigned long sq_owner; /* thread holding sq_lock across a chain */
+  unsigned int msg_seq;   /* tells the entries of msg_ring apart */
+  ring_stats stats;
 } Ring;
 
+/**
+ * @brief Acquire one of the ring locks
+ *
+ * Waits on the ring happen with the GIL released while the lock is held, so
+ * a contended lock must also be waited for without the GIL or the waiter
+ * could never get it back.
+ */
+#define RING_LOCK(lock)                                  \
+  do {                                                   \
+    if (!PyThread_acquire_lock((lock), NOWAIT_LOCK)) {   \
+      Py_BEGIN_ALLOW_THREADS;                            \
+      PyThread_acquire_lock((lock), WAIT_LOCK);          \
+      Py_END_ALLOW_THREADS;                              \
+    }                                                    \
+  } while (0)
+
+#define RING_UNLOCK(lock) PyThread_release_lock(lock)
+
 /**
  * @brief Python struct for sqe
  *
  */
 typedef struct {
   PyObject_HEAD struct io_uring_sqe *entry;
+  Ring *ring;
 } SQE;
 
 /**
  * @brief Python struct for cqe
  *
+ * Holds a copy of the completion, so it stays valid after being marked seen.
  */
 typedef struct {
-  PyObject_HEAD struct io_uring_cqe *entry;
+  PyObject_HEAD struct io_uring_cqe entry;
+  PyObject *data; /* object of entry.user_data, resolved on creation */
+  Ring *ring;     /* ring the completion was taken from */
+  struct io_uring_cqe *slot; /* where entry is in the CQ of ring */
+  int seen;       /* set once cqe_seen consumed it */
 } CQE;
 
+/**
+ * @brief Python struct for a provided buffer ring, see bufring.c
+ *
+ */
+typedef struct {
+  PyObject_HEAD Ring *ring;
+  struct io_uring_buf_ring *br;
+  char *arena;         /* count buffers of size bytes */
+  unsigned char *state; /* per buffer, who owns it, see bufring.c */
+  unsigned int count;
+  unsigned int size;
+  unsigned short group;
+} BufferRing;
+
+extern PyTypeObject buffer_ring_type;
+extern void buffer_ring_completed(Ring *ring, struct io_uring_cqe *entry);
+
+/**
+ * @brief Record written for each completion by Ring.harvest_cqes
+ *
+ * Same layout as struct io_uring_cqe on little endian machines, with the
+ * buffer id of the upper flag bits in a field of its own.
+ */
+typedef struct {
+  __u64 user_data;
+  __s32 res;
+  __u16 flags;
+  __u16 buffer_id; /* only meaningful with IORING_CQE_F_BUFFER */
+} cqe_record;
+
+extern PyObject *cqe_new(Ring *ring, struct io_uring_cqe *entry);
+
+extern int token_table_init(token_table *table, uint32_t size);
+extern void token_table_clear(token_table *table);
+extern __u64 token_acquire(token_table *table, PyObject *obj);
+extern token_slot *token_slot_of(token_table *table, __u64 token);
+extern PyObject *token_lookup(token_table *table, __u64 token);
+extern PyObject *token_release(token_table *table, __u64 token);
+extern void token_keep(token_table *table, __u64 token, PyObject *keep);
+extern PyObject *token_items(token_table *table);
+
+extern void ring_buffers_clear(Ring *ring);
+extern PyObject *RingRegisterBuffers(PyObject *self, PyObject *args);
+extern PyObject *RingUpdateBuffers(PyObject *self, PyObject *args);
+extern PyObject *RingUnregisterBuffers(PyObject *self, PyObject *args);
+extern PyObject *RingRegisterFiles(PyObject *self, PyObject *args);
+extern PyObject *RingUpdateFiles(PyObject *self, PyObject *args);
+extern PyObject *RingUnregisterFiles(PyObject *self, PyObject *args);
+extern PyObject *RingRegisterFileAllocRange(PyObject *self, PyObject *args);
+extern PyObject *RingRegisterEventfd(PyObject *self, PyObject *args);
+extern PyObject *RingUnregisterEventfd(PyObject *self, PyObject *args);
+extern PyObject *RingRegisterRingFd(PyObject *self, PyObject *args);
+extern PyObject *RingUnregisterRingFd(PyObject *self, PyObject *args);
+extern PyObject *RingEnable(PyObject *self, PyObject *args);
+extern PyTypeObject fixed_file_type;
+
+extern int ring_user_data(Ring *ring, PyObject *data, __u64 *user_data);
+extern int ring_user_data_keep(Ring *ring, PyObject *data, PyObject *keep,
+                               __u64 *user_data);
+extern void ring_user_data_done(Ring *ring, __u64 user_data);
+
+extern struct io_uring_sqe *ring_sqe_begin(Ring *ring, PyObject *keep);
+extern void ring_sqe_end(Ring *ring);
+extern int ring_submit_locked(Ring *ring);
+extern int ring_msg_ring(Ring *ring, int fd, unsigned int sqe_flags, int res,
+                         __u64 msg_data);
+extern PyObject *ring_sq_full(void);
+extern int ring_cq_take(Ring *ring, __u64 user_data, int *res);
+
+/* Counters and latency histograms, see stats.c */
+extern void stats_submit(Ring *ring, unsigned int wait_nr);
+extern void stats_wait(Ring *ring, unsigned int wait_nr);
+extern void stats_complete(Ring *ring, __u64 user_data, __u64 now);
+extern __u64 stats_now(void);
+extern void stats_clear(Ring *ring);
+extern PyObject *RingStats(PyObject *self, PyObject *args);
+extern PyObject *RingResetStats(PyObject *self, PyObject *args);
+extern PyObject *RingTrackLatency(PyObject *self, PyObject *args);
+
+/* Native prep helpers, see prep.c */
+typedef int (*prep_fn)(Ring *ring, PyObject *args, __u64 *user_data);
+extern prep_fn prep_for_opcode(long opcode);
+extern prep_fn prep_for_method(PyObject *method, PyObject *ring);
+
+extern PyObject *RingPrepNop(PyObject *self, PyObject *args);
+extern PyObject *RingPrepRead(PyObject *self, PyObject *args);
+extern PyObject *RingPrepWrite(PyObject *self, PyObject *args);
+extern PyObject *RingPrepReadv(PyObject *self, PyObject *args);
+extern PyObject *RingPrepWritev(PyObject *self, PyObject *args);
+extern PyObject *RingPrepSend(PyObject *self, PyObject *args);
+extern PyObject *RingPrepSendZC(PyObject *self, PyObject *args);
+extern PyObject *RingPrepSendZCFixed(PyObject *self, PyObject *args);
+extern PyObject *RingPrepRecv(PyObject *self, PyObject *args);
+extern PyObject *RingPrepAccept(PyObject *self, PyObject *args);
+extern PyObject *RingPrepConnect(PyObject *self, PyObject *args);
+extern PyObject *RingPrepTimeout(PyObject *self, PyObject *args);
+extern PyObject *RingPrepLinkTimeout(PyObject *self, PyObject *args);
+extern PyObject *RingPrepCancel(PyObject *self, PyObject *args);
+extern PyObject *RingPrepCancelFd(PyObject *self, PyObject *args);
+extern PyObject *RingPrepClose(PyObject *self, PyObject *args);
+extern PyObject *RingPrepOpenat(PyObject *self, PyObject *args);
+extern PyObject *RingPrepStatx(PyObject *self, PyObject *args);
+extern PyObject *RingPrepFsync(PyObject *self, PyObject *args);
+extern PyObject *RingPrepFallocate(PyObject *self, PyObject *args);
+extern PyObject *RingPrepSplice(PyObject *self, PyObject *args);
+extern PyObject *RingPrepTee(PyObject *self, PyObject *args);
+extern PyObject *RingPrepPollAdd(PyObject *self, PyObject *args);
+extern PyObject *RingPrepReadFixed(PyObject *self, PyObject *args);
+extern PyObject *RingPrepWriteFixed(PyObject *self, PyObject *args);
+extern PyObject *RingPrepAcceptDirect(PyObject *self, PyObject *args);
+extern PyObject *RingPrepOpenatDirect(PyObject *self, PyObject *args);
+extern PyObject *RingPrepMultishotAccept(PyObject *self, PyObject *args);
+extern PyObject *RingPrepRecvMultishot(PyObject *self, PyObject *args);
+extern PyObject *RingPrepMsgRing(PyObject *self, PyObject *args);
+extern PyObject *RingMsgRing(PyObject *self, PyObject *args);
+extern PyObject *RingCancel(PyObject *self, PyObject *args, PyObject *kwds);
+extern PyObject *RingCancelFd(PyObject *self, PyObject *args);
+extern PyObject *RingCancelAll(PyObject *self, PyObject *args);
+
 extern void register_ring(PyObject *mod);
 extern void register_sqe(PyObject *mod);
 extern void register_cqe(PyObject *mod);
+extern void register_fixed_file(PyObject *mod);
+extern void register_buffer_ring(PyObject *mod);
+extern void register_chain(PyObject *mod);
+extern void register_stats(PyObject *mod);
+extern void register_group(PyObject *mod);
+extern void register_timer_wheel(PyObject *mod);
+extern void register_capabilities(PyObject *mod);
+extern PyObject *capabilities(PyObject *self, PyObject *args);
+extern PyObject *capabilities_supported(PyObject *self, PyObject *args);
+extern PyObject *capabilities_probe(PyObject *self, PyObject *args);
+extern PyObject *capabilities_opcode_supported(PyObject *self, PyObject *args);
+extern PyObject *chain_new(Ring *ring, int hard);
 #endif
\ No newline at end of file